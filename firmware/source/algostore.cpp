@@ -0,0 +1,347 @@
+/**
+ * @file algostore.cpp
+ * @brief Stores algorithm binaries in the unused flash bank.
+ *
+ * Copyright (C) 2023 Clyne Sullivan
+ *
+ * Distributed under the GNU GPL v3 or later. You should have received a copy of
+ * the GNU General Public License along with this program.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "algostore.hpp"
+
+#include "periph/adc.hpp"
+#include "conversion.hpp"
+#include "elfload.hpp"
+#include "runstatus.hpp"
+#include "sclock.hpp"
+
+#include "hal.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Store layout: one erase unit for the directory, followed by the slots.
+// The H7's 128K sectors leave room for three slots in the 512K after the
+// firmware; the L4's 2K pages allow for more, smaller slots.
+constexpr uint32_t STORE_BASE = 0x08080000;
+#if defined(TARGET_PLATFORM_H7)
+constexpr uint32_t FLASH_ERASE_SIZE = 128 * 1024;
+constexpr uint32_t FLASH_WRITE_SIZE = 32;
+#else
+constexpr uint32_t FLASH_ERASE_SIZE = 2 * 1024;
+constexpr uint32_t FLASH_WRITE_SIZE = 8;
+#endif
+constexpr uint32_t SLOT_SIZE =
+    (MAX_ELF_FILE_SIZE + FLASH_ERASE_SIZE - 1) / FLASH_ERASE_SIZE * FLASH_ERASE_SIZE;
+constexpr uint32_t SLOT_BASE = STORE_BASE + FLASH_ERASE_SIZE;
+constexpr uint32_t ENTRY_MAGIC = 0x4F474C41; // "ALGO"
+
+static_assert(SLOT_BASE + AlgorithmStore::SLOT_COUNT * SLOT_SIZE <= STORE_BASE + 512 * 1024);
+static_assert(AlgorithmStore::SLOT_COUNT * sizeof(AlgorithmStore::Entry) <= FLASH_ERASE_SIZE);
+static_assert(sizeof(AlgorithmStore::Entry) % FLASH_WRITE_SIZE == 0);
+
+// Flash can only be changed without stalling the firmware on the L4; see
+// AlgorithmStore.
+static bool canWriteFlash()
+{
+#if defined(TARGET_PLATFORM_H7)
+    return run_status == RunStatus::Idle;
+#else
+    return true;
+#endif
+}
+
+const AlgorithmStore::Entry *AlgorithmStore::directory()
+{
+    return reinterpret_cast<const Entry *>(STORE_BASE);
+}
+
+const unsigned char *AlgorithmStore::slotData(unsigned int slot)
+{
+    return reinterpret_cast<const unsigned char *>(SLOT_BASE + slot * SLOT_SIZE);
+}
+
+const AlgorithmStore::Entry& AlgorithmStore::entry(unsigned int slot)
+{
+    return directory()[slot];
+}
+
+bool AlgorithmStore::isUsed(unsigned int slot)
+{
+    return slot < SLOT_COUNT && directory()[slot].magic == ENTRY_MAGIC;
+}
+
+bool AlgorithmStore::save(unsigned int slot, const char *name, uint8_t flags)
+{
+    const auto size = ELFManager::fileSize();
+    if (slot >= SLOT_COUNT || size == 0 || size > SLOT_SIZE || !canWriteFlash())
+        return false;
+
+    std::array<Entry, SLOT_COUNT> entries;
+    std::copy(directory(), directory() + SLOT_COUNT, entries.begin());
+
+    auto& e = entries[slot];
+    e.magic = ENTRY_MAGIC;
+    std::fill(e.name, e.name + NAME_LENGTH, '\0');
+    std::copy(name, name + NAME_LENGTH, e.name);
+    e.size = size;
+    e.crc = crc(ELFManager::fileBuffer(), size);
+    e.buffer_size = static_cast<uint16_t>(ConversionManager::bufferFrames());
+    e.rate = 0xFF;
+    e.flags = flags;
+    e.rate_factor = static_cast<uint8_t>(ConversionManager::rateFactor());
+    const auto rate = SClock::getFrequency();
+    for (unsigned int i = 0; i < sizeof(e.sample_rate); ++i)
+        e.sample_rate[i] = static_cast<uint8_t>(rate >> (8 * i));
+
+    // Only one slot may start at boot.
+    if (flags & Default) {
+        for (unsigned int i = 0; i < SLOT_COUNT; ++i) {
+            if (i != slot)
+                entries[i].flags = static_cast<uint8_t>(entries[i].flags & ~Default);
+        }
+    }
+
+    flashUnlock();
+    const auto addr = SLOT_BASE + slot * SLOT_SIZE;
+    bool ok = flashErase(addr, SLOT_SIZE) &&
+              flashWrite(addr, ELFManager::fileBuffer(), size);
+    flashLock();
+
+    // Write the directory last so an interrupted save leaves the slot unused.
+    return ok && writeDirectory(entries) && crc(slotData(slot), size) == e.crc;
+}
+
+bool AlgorithmStore::load(unsigned int slot)
+{
+    if (!isUsed(slot))
+        return false;
+
+    const auto& e = entry(slot);
+    const auto data = slotData(slot);
+    if (e.size > SLOT_SIZE || crc(data, e.size) != e.crc)
+        return false;
+
+    // Entries saved before the rate factor was recorded have 0xFF there.
+    // Either setting is left as it is if it does not fit with the others.
+    if (e.rate_factor != 0xFF)
+        ConversionManager::setRateFactor(e.rate_factor);
+    ConversionManager::setBufferFrames(e.buffer_size);
+
+    // Older entries saved the rate as an index into these presets.
+    constexpr std::array<unsigned int, 6> presets {
+        8000, 16000, 20000, 32000, 48000, 96000
+    };
+    unsigned int rate = 0;
+    if (e.rate < presets.size())
+        rate = presets[e.rate];
+    else if (e.rate == 0xFF)
+        rate = e.sample_rate[0] | (e.sample_rate[1] << 8) | (e.sample_rate[2] << 16);
+    const auto previous = SClock::getFrequency();
+    if (auto made = SClock::setRate(rate); made != 0 && !ADC::setRate(made))
+        SClock::setRate(previous);
+
+    // One copy straight from flash into algorithm memory.
+    return ELFManager::loadFromBuffer(data, e.size);
+}
+
+bool AlgorithmStore::loadDefault()
+{
+    for (unsigned int i = 0; i < SLOT_COUNT; ++i) {
+        if (isUsed(i) && (entry(i).flags & Default))
+            return load(i);
+    }
+
+    return false;
+}
+
+bool AlgorithmStore::erase(unsigned int slot)
+{
+    if (slot >= SLOT_COUNT || !canWriteFlash())
+        return false;
+
+    std::array<Entry, SLOT_COUNT> entries;
+    std::copy(directory(), directory() + SLOT_COUNT, entries.begin());
+    std::memset(&entries[slot], 0xFF, sizeof(Entry));
+
+    if (!writeDirectory(entries))
+        return false;
+
+    flashUnlock();
+    bool ok = flashErase(SLOT_BASE + slot * SLOT_SIZE, SLOT_SIZE);
+    flashLock();
+    return ok;
+}
+
+bool AlgorithmStore::writeDirectory(const std::array<Entry, SLOT_COUNT>& entries)
+{
+    flashUnlock();
+    bool ok = flashErase(STORE_BASE, FLASH_ERASE_SIZE) &&
+              flashWrite(STORE_BASE,
+                         reinterpret_cast<const unsigned char *>(entries.data()),
+                         sizeof(entries));
+    flashLock();
+    return ok;
+}
+
+uint32_t AlgorithmStore::crc(const unsigned char *data, unsigned int size)
+{
+    // Uses the CRC peripheral (CRC-32, poly. 0x04C11DB7).
+#if defined(TARGET_PLATFORM_H7)
+    RCC->AHB4ENR |= RCC_AHB4ENR_CRCEN;
+#else
+    RCC->AHB1ENR |= RCC_AHB1ENR_CRCEN;
+#endif
+    CRC->CR = CRC_CR_RESET;
+
+    auto words = reinterpret_cast<const uint32_t *>(data);
+    for (unsigned int i = 0; i < size / 4; ++i)
+        CRC->DR = words[i];
+    for (unsigned int i = size & ~3u; i < size; ++i)
+        *reinterpret_cast<volatile uint8_t *>(&CRC->DR) = data[i];
+
+    return CRC->DR;
+}
+
+#if defined(TARGET_PLATFORM_H7)
+void AlgorithmStore::flashUnlock()
+{
+    if (FLASH->CR1 & FLASH_CR_LOCK) {
+        FLASH->KEYR1 = 0x45670123;
+        FLASH->KEYR1 = 0xCDEF89AB;
+    }
+}
+
+void AlgorithmStore::flashLock()
+{
+    FLASH->CR1 |= FLASH_CR_LOCK;
+}
+
+static bool flashWait()
+{
+    // The store shares the firmware's bank, so the core is stalled on its
+    // next fetch from flash until the operation completes; there is no use
+    // in yielding to other threads.
+    while (FLASH->SR1 & (FLASH_SR_QW | FLASH_SR_BSY))
+        ;
+
+    bool ok = (FLASH->SR1 & (FLASH_SR_WRPERR | FLASH_SR_PGSERR | FLASH_SR_STRBERR |
+                             FLASH_SR_INCERR | FLASH_SR_OPERR)) == 0;
+    FLASH->CCR1 = FLASH_CCR_CLR_EOP | FLASH_CCR_CLR_WRPERR | FLASH_CCR_CLR_PGSERR |
+                  FLASH_CCR_CLR_STRBERR | FLASH_CCR_CLR_INCERR | FLASH_CCR_CLR_OPERR;
+    return ok;
+}
+
+bool AlgorithmStore::flashErase(uint32_t addr, uint32_t size)
+{
+    const auto start = addr;
+    for (uint32_t end = addr + size; addr < end; addr += FLASH_ERASE_SIZE) {
+        const uint32_t sector = (addr - FLASH_BANK1_BASE) / FLASH_ERASE_SIZE;
+        FLASH->CR1 = (FLASH->CR1 & ~FLASH_CR_SNB_Msk) |
+                     (sector << FLASH_CR_SNB_Pos) | FLASH_CR_SER;
+        FLASH->CR1 |= FLASH_CR_START;
+        bool ok = flashWait();
+        FLASH->CR1 &= ~FLASH_CR_SER;
+        if (!ok)
+            return false;
+    }
+
+    SCB_InvalidateDCache_by_Addr(reinterpret_cast<void *>(start), size);
+    return true;
+}
+
+bool AlgorithmStore::flashWrite(uint32_t addr, const unsigned char *data, uint32_t size)
+{
+    bool ok = true;
+
+    FLASH->CR1 |= FLASH_CR_PG;
+    for (uint32_t offset = 0; ok && offset < size; offset += FLASH_WRITE_SIZE) {
+        // Flash words are 256 bits; pad the final one with erased bytes.
+        std::array<uint32_t, FLASH_WRITE_SIZE / 4> word;
+        std::memset(word.data(), 0xFF, FLASH_WRITE_SIZE);
+        std::memcpy(word.data(), data + offset, std::min(FLASH_WRITE_SIZE, size - offset));
+
+        auto dst = reinterpret_cast<volatile uint32_t *>(addr + offset);
+        for (auto w : word)
+            *dst++ = w;
+        __DSB();
+        ok = flashWait();
+    }
+    FLASH->CR1 &= ~FLASH_CR_PG;
+
+    SCB_InvalidateDCache_by_Addr(reinterpret_cast<void *>(addr), size);
+    return ok;
+}
+#else
+void AlgorithmStore::flashUnlock()
+{
+    if (FLASH->CR & FLASH_CR_LOCK) {
+        FLASH->KEYR = 0x45670123;
+        FLASH->KEYR = 0xCDEF89AB;
+    }
+}
+
+void AlgorithmStore::flashLock()
+{
+    FLASH->CR |= FLASH_CR_LOCK;
+
+    // Reset the flash data cache so stale slot contents are not read back.
+    FLASH->ACR &= ~FLASH_ACR_DCEN;
+    FLASH->ACR |= FLASH_ACR_DCRST;
+    FLASH->ACR &= ~FLASH_ACR_DCRST;
+    FLASH->ACR |= FLASH_ACR_DCEN;
+}
+
+static bool flashWait()
+{
+    // The store is in bank 2, so the firmware keeps running from bank 1
+    // while the operation completes.
+    while (FLASH->SR & FLASH_SR_BSY)
+        chThdYield();
+
+    constexpr uint32_t errors = FLASH_SR_OPERR | FLASH_SR_PROGERR | FLASH_SR_WRPERR |
+                                FLASH_SR_PGAERR | FLASH_SR_SIZERR | FLASH_SR_PGSERR |
+                                FLASH_SR_MISERR | FLASH_SR_FASTERR;
+    bool ok = (FLASH->SR & errors) == 0;
+    FLASH->SR = errors | FLASH_SR_EOP;
+    return ok;
+}
+
+bool AlgorithmStore::flashErase(uint32_t addr, uint32_t size)
+{
+    for (uint32_t end = addr + size; addr < end; addr += FLASH_ERASE_SIZE) {
+        const uint32_t page = (addr - STORE_BASE) / FLASH_ERASE_SIZE;
+        FLASH->CR = (FLASH->CR & ~FLASH_CR_PNB_Msk) |
+                    (page << FLASH_CR_PNB_Pos) | FLASH_CR_BKER | FLASH_CR_PER;
+        FLASH->CR |= FLASH_CR_STRT;
+        bool ok = flashWait();
+        FLASH->CR &= ~(FLASH_CR_PER | FLASH_CR_BKER);
+        if (!ok)
+            return false;
+    }
+
+    return true;
+}
+
+bool AlgorithmStore::flashWrite(uint32_t addr, const unsigned char *data, uint32_t size)
+{
+    bool ok = true;
+
+    FLASH->CR |= FLASH_CR_PG;
+    for (uint32_t offset = 0; ok && offset < size; offset += FLASH_WRITE_SIZE) {
+        // Program one double-word at a time, padding the last with 0xFF.
+        std::array<uint32_t, 2> word = {0xFFFFFFFF, 0xFFFFFFFF};
+        std::memcpy(word.data(), data + offset, std::min(FLASH_WRITE_SIZE, size - offset));
+
+        auto dst = reinterpret_cast<volatile uint32_t *>(addr + offset);
+        dst[0] = word[0];
+        dst[1] = word[1];
+        ok = flashWait();
+    }
+    FLASH->CR &= ~FLASH_CR_PG;
+
+    return ok;
+}
+#endif
@@ -0,0 +1,112 @@
+/**
+ * @file algostore.hpp
+ * @brief Stores algorithm binaries in the unused flash bank.
+ *
+ * Copyright (C) 2023 Clyne Sullivan
+ *
+ * Distributed under the GNU GPL v3 or later. You should have received a copy of
+ * the GNU General Public License along with this program.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STMDSP_ALGOSTORE_HPP
+#define STMDSP_ALGOSTORE_HPP
+
+#include <array>
+#include <cstdint>
+
+/**
+ * Manages a directory of algorithm ELF images kept in flash from 0x08080000,
+ * past the firmware. Each slot keeps one image along with its name, CRC, and
+ * the buffer size and sample rate it was compiled for.
+ *
+ * On the L4 this is the second flash bank, so the firmware keeps running
+ * while it is written. The H7 has one bank: every fetch from flash stalls
+ * while a sector is erased or written (a second or more for each 128K
+ * sector), so the store is only changed while no conversion is running.
+ */
+class AlgorithmStore
+{
+public:
+#if defined(TARGET_PLATFORM_H7)
+    constexpr static unsigned int SLOT_COUNT = 3;
+#else
+    constexpr static unsigned int SLOT_COUNT = 8;
+#endif
+    constexpr static unsigned int NAME_LENGTH = 12;
+
+    enum Flags : uint8_t {
+        Default = (1 << 0) // Load and start this algorithm at boot.
+    };
+
+    // Directory entry format, also sent as-is to the host.
+    struct Entry {
+        uint32_t magic;
+        char name[NAME_LENGTH];
+        uint32_t size;
+        uint32_t crc;
+        uint16_t buffer_size;
+        uint8_t rate;           // Legacy rate preset; 0xFF if sample_rate is set.
+        uint8_t flags;
+        uint8_t rate_factor;
+        uint8_t sample_rate[3]; // In Hz, little-endian.
+    } __attribute__((packed));
+
+    static_assert(sizeof(Entry) == 32);
+
+    /**
+     * Writes the ELF binary currently in ELFManager's file buffer to the given
+     * slot, recording the current buffer size, sample rate and rate factor
+     * with it.
+     * If Default is set in flags, any other default slot is cleared.
+     * Returns true if successful; fails on the H7 unless conversion is idle.
+     */
+    static bool save(unsigned int slot, const char *name, uint8_t flags);
+
+    /**
+     * Verifies and loads the algorithm in the given slot, restoring the
+     * buffer size, sample rate and rate factor that it was saved with.
+     * Returns true if successful.
+     */
+    static bool load(unsigned int slot);
+
+    /**
+     * Loads the slot marked as Default, if any.
+     * Returns true if an algorithm was loaded.
+     */
+    static bool loadDefault();
+
+    /**
+     * Erases the given slot and its directory entry.
+     * Returns true if successful; fails on the H7 unless conversion is idle.
+     */
+    static bool erase(unsigned int slot);
+
+    /**
+     * Returns the directory entry for the given slot; entries for empty slots
+     * have a magic value of 0xFFFFFFFF.
+     */
+    static const Entry& entry(unsigned int slot);
+
+    /**
+     * Returns true if the given slot holds an image.
+     */
+    static bool isUsed(unsigned int slot);
+
+private:
+    static const Entry *directory();
+    static const unsigned char *slotData(unsigned int slot);
+    static bool writeDirectory(const std::array<Entry, SLOT_COUNT>& entries);
+
+    static uint32_t crc(const unsigned char *data, unsigned int size);
+
+    // Low-level flash operations; addresses must be aligned to the erase or
+    // write unit size of the target.
+    static void flashUnlock();
+    static void flashLock();
+    static bool flashErase(uint32_t addr, uint32_t size);
+    static bool flashWrite(uint32_t addr, const unsigned char *data, uint32_t size);
+};
+
+#endif // STMDSP_ALGOSTORE_HPP
+
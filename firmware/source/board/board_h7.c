@@ -257,6 +257,14 @@ bool mmc_lld_is_write_protected(MMCDriver *mmcp) {
 }
 #endif
 
+// The H723's MPU has 16 regions; ChibiOS only names the first eight.
+#if !defined(MPU_REGION_8)
+#define MPU_REGION_8 8U
+#endif
+#if !defined(MPU_REGION_9)
+#define MPU_REGION_9 9U
+#endif
+
 /**
  * @brief   Board-specific initialization code.
  * @note    You can add your board-specific code here.
@@ -269,19 +277,47 @@ void boardInit(void) {
     //     Region 2: Data for algorithm thread
     //     Region 3: Code for algorithm thread
     //     Region 4: User algorithm code
+    //     Region 6: User algorithm bulk data (AXI SRAM)
+    //     Region 7: Signal generator and DAC buffers (SRAM1, SRAM2)
+    //     Region 8: ADC buffer (SRAM4)
+    //     Region 9: TIM5, read-only for algorithm profiling (see Profiler)
+    // Region 2 also covers the algorithm's DTCM data at 0x20008000.
+    // Regions 6-8 are write-back cacheable: the DMA sample buffers are kept
+    // coherent with explicit cache maintenance (see ADC::conversionCallback,
+    // DAC::start, and the runner's svc 0).
     mpuConfigureRegion(MPU_REGION_2,
                        0x20000000,
                        MPU_RASR_ATTR_AP_RW_RW | MPU_RASR_ATTR_NON_CACHEABLE |
                        MPU_RASR_SIZE_64K |
                        MPU_RASR_ENABLE);
     mpuConfigureRegion(MPU_REGION_3,
-                       0x0807F800,
+                       0x0807C000,
                        MPU_RASR_ATTR_AP_RO_RO | MPU_RASR_ATTR_NON_CACHEABLE |
-                       MPU_RASR_SIZE_2K |
+                       MPU_RASR_SIZE_16K |
                        MPU_RASR_ENABLE);
     mpuConfigureRegion(MPU_REGION_4,
                        0x00000000,
                        MPU_RASR_ATTR_AP_RW_RW | MPU_RASR_ATTR_NON_CACHEABLE |
                        MPU_RASR_SIZE_64K |
                        MPU_RASR_ENABLE);
+    mpuConfigureRegion(MPU_REGION_6,
+                       0x24040000,
+                       MPU_RASR_ATTR_AP_RW_RW | MPU_RASR_ATTR_CACHEABLE_WB_WA |
+                       MPU_RASR_SIZE_64K |
+                       MPU_RASR_ENABLE);
+    mpuConfigureRegion(MPU_REGION_7,
+                       0x30000000,
+                       MPU_RASR_ATTR_AP_RW_RW | MPU_RASR_ATTR_CACHEABLE_WB_WA |
+                       MPU_RASR_SIZE_32K |
+                       MPU_RASR_ENABLE);
+    mpuConfigureRegion(MPU_REGION_8,
+                       0x38000000,
+                       MPU_RASR_ATTR_AP_RW_RW | MPU_RASR_ATTR_CACHEABLE_WB_WA |
+                       MPU_RASR_SIZE_16K |
+                       MPU_RASR_ENABLE);
+    mpuConfigureRegion(MPU_REGION_9,
+                       0x40000C00,
+                       MPU_RASR_ATTR_AP_RW_RO | MPU_RASR_ATTR_SHARED_DEVICE |
+                       MPU_RASR_ATTR_XN | MPU_RASR_SIZE_1K |
+                       MPU_RASR_ENABLE);
 }
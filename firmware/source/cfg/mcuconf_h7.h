@@ -48,7 +48,7 @@
 #define STM32_NOCACHE_MPU_REGION            MPU_REGION_1
 #define STM32_NOCACHE_SRAM1_SRAM2           FALSE
 #define STM32_NOCACHE_SRAM3                 FALSE
-#define STM32_NOCACHE_ALLSRAM               TRUE
+#define STM32_NOCACHE_ALLSRAM               FALSE
 
 /*
  * PWR system settings.
@@ -262,7 +262,7 @@
 #define STM32_GPT_USE_TIM4                  FALSE
 #define STM32_GPT_USE_TIM5                  FALSE
 #define STM32_GPT_USE_TIM6                  TRUE
-#define STM32_GPT_USE_TIM7                  FALSE
+#define STM32_GPT_USE_TIM7                  TRUE
 #define STM32_GPT_USE_TIM8                  FALSE
 #define STM32_GPT_USE_TIM12                 FALSE
 #define STM32_GPT_USE_TIM13                 FALSE
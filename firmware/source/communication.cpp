@@ -6,11 +6,14 @@
 #include "periph/adc.hpp"
 #include "periph/dac.hpp"
 #include "periph/usbserial.hpp"
+#include "algostore.hpp"
 #include "elfload.hpp"
 #include "error.hpp"
 #include "conversion.hpp"
+#include "profiler.hpp"
 #include "runstatus.hpp"
 #include "samples.hpp"
+#include "trace.hpp"
 
 #include <algorithm>
 #include <tuple>
@@ -29,61 +32,96 @@ void CommunicationManager::begin()
 
 static void writeADCBuffer(unsigned char *);
 static void setBufferSize(unsigned char *);
+static void setDataCache(unsigned char *);
 static void updateGenerator(unsigned char *);
 static void loadAlgorithm(unsigned char *);
+static void storeAlgorithm(unsigned char *);
+static void listStoredAlgorithms(unsigned char *);
+static void setChannels(unsigned char *);
+static void setRateFactor(unsigned char *);
+static void setOversampling(unsigned char *);
 static void readStatus(unsigned char *);
 static void measureConversion(unsigned char *);
 static void startConversion(unsigned char *);
 static void stopConversion(unsigned char *);
 static void startGenerator(unsigned char *);
+static void eraseStoredAlgorithm(unsigned char *);
 static void readADCBuffer(unsigned char *);
 static void readDACBuffer(unsigned char *);
 static void unloadAlgorithm(unsigned char *);
+static void loadStoredAlgorithm(unsigned char *);
 static void readIdentifier(unsigned char *);
 static void readExecTime(unsigned char *);
+static void readLatency(unsigned char *);
+static void readTiming(unsigned char *);
+static void readProfile(unsigned char *);
+static void setSampling(unsigned char *);
+static void readSampling(unsigned char *);
+static void setTrace(unsigned char *);
+static void readTrace(unsigned char *);
 static void sampleRate(unsigned char *);
 static void readConversionResults(unsigned char *);
 static void readConversionInput(unsigned char *);
 static void readMessage(unsigned char *);
 static void stopGenerator(unsigned char *);
 
-static const std::array<std::pair<char, void (*)(unsigned char *)>, 19> commandTable {{
+static const std::array<std::pair<char, void (*)(unsigned char *)>, 34> commandTable {{
     {'A', writeADCBuffer},
     {'B', setBufferSize},
+    {'C', setDataCache},
     {'D', updateGenerator},
     {'E', loadAlgorithm},
+    {'F', storeAlgorithm},
+    {'H', setRateFactor},
     {'I', readStatus},
+    {'L', listStoredAlgorithms},
     {'M', measureConversion},
+    {'N', setChannels},
+    {'O', setOversampling},
+    {'Q', setSampling},
     {'R', startConversion},
     {'S', stopConversion},
+    {'T', readTiming},
+    {'V', setTrace},
     {'W', startGenerator},
+    {'X', eraseStoredAlgorithm},
     {'a', readADCBuffer},
     {'d', readDACBuffer},
     {'e', unloadAlgorithm},
+    {'f', loadStoredAlgorithm},
     {'i', readIdentifier},
+    {'l', readLatency},
     {'m', readExecTime},
+    {'p', readProfile},
+    {'q', readSampling},
     {'r', sampleRate},
     {'s', readConversionResults},
     {'t', readConversionInput},
     {'u', readMessage},
+    {'v', readTrace},
     {'w', stopGenerator}
 }};
 
 void CommunicationManager::threadComm(void *)
 {
 	while (1) {
-        if (USBSerial::isActive()) {
+        // Handle every command received so far, then sleep until the USB
+        // driver signals more input. The timeout is only a fallback; it no
+        // longer sets the command latency.
+        while (USBSerial::isActive()) {
             // Attempt to receive a command packet
             if (unsigned char cmd[3]; USBSerial::read(&cmd[0], 1) > 0) {
                 // Packet received, first byte represents the desired command/action
                 auto func = std::find_if(commandTable.cbegin(), commandTable.cend(),
                                          [&cmd](const auto& f) { return f.first == cmd[0]; });
-                if (func != commandTable.cend())
+                if (func != commandTable.cend()) {
+                    Trace::record(Trace::Event::Command, cmd[0]);
                     func->second(cmd);
+                }
             }
         }
 
-		chThdSleepMicroseconds(100);
+        USBSerial::waitForInput(TIME_MS2I(100));
     }
 }
 
@@ -97,13 +135,37 @@ void setBufferSize(unsigned char *cmd)
     if (EM.assert(run_status == RunStatus::Idle, Error::NotIdle) &&
         EM.assert(USBSerial::read(&cmd[1], 2) == 2, Error::BadParamSize))
     {
-        // count is multiplied by two since this command receives size of buffer
-        // for each algorithm application.
-        unsigned int count = (cmd[1] | (cmd[2] << 8)) * 2;
-        if (EM.assert(count <= MAX_SAMPLE_BUFFER_SIZE, Error::BadParam)) {
-            Samples::In.setSize(count);
-            Samples::Out.setSize(count);
+        // The size given is of each algorithm application, in frames; the
+        // buffers hold two of these at the converter rate.
+        unsigned int frames = cmd[1] | (cmd[2] << 8);
+        EM.assert(ConversionManager::setBufferFrames(frames), Error::BadParam);
+    }
+}
+
+void setDataCache(unsigned char *cmd)
+{
+    // Param: 0 disables, 1 enables, 0xFF queries (replies with 0 or 1).
+    // Allows comparing algorithm execution times with and without the cache.
+    if (EM.assert(USBSerial::read(&cmd[1], 1) == 1, Error::BadParamSize)) {
+#if defined(TARGET_PLATFORM_H7)
+        if (cmd[1] == 0xFF) {
+            unsigned char enabled = (SCB->CCR & SCB_CCR_DC_Msk) ? 1 : 0;
+            USBSerial::write(&enabled, 1);
+        } else if (EM.assert(run_status == RunStatus::Idle, Error::NotIdle)) {
+            // Enabling invalidates the cache, so it must not be done twice.
+            const bool enabled = SCB->CCR & SCB_CCR_DC_Msk;
+            if (cmd[1] != 0 && !enabled)
+                SCB_EnableDCache();
+            else if (cmd[1] == 0 && enabled)
+                SCB_DisableDCache(); // Also cleans the cache.
+        }
+#else
+        // The L4 has no data cache.
+        if (cmd[1] == 0xFF) {
+            unsigned char enabled = 0;
+            USBSerial::write(&enabled, 1);
         }
+#endif
     }
 }
 
@@ -117,6 +179,7 @@ void updateGenerator(unsigned char *cmd)
                 USBSerial::read(
                     reinterpret_cast<uint8_t *>(Samples::Generator.data()),
                     Samples::Generator.bytesize());
+                cacheBufferFlush(Samples::Generator.data(), Samples::Generator.bytesize());
             } else {
                 const int more = DAC::sigGenWantsMore();
                 if (more == -1) {
@@ -125,15 +188,63 @@ void updateGenerator(unsigned char *cmd)
                     USBSerial::write(reinterpret_cast<const uint8_t *>("\1"), 1);
 
                     // Receive streamed samples in half-buffer chunks.
-                    USBSerial::read(reinterpret_cast<uint8_t *>(
-                        more == 0 ? Samples::Generator.data() : Samples::Generator.middata()),
+                    auto half = more == 0 ? Samples::Generator.data() : Samples::Generator.middata();
+                    USBSerial::read(reinterpret_cast<uint8_t *>(half),
                         Samples::Generator.bytesize() / 2);
+                    cacheBufferFlush(half, Samples::Generator.bytesize() / 2);
                 }
             }
         }
     }
 }
 
+void setChannels(unsigned char *cmd)
+{
+    // Param: channel count (1 to MAX_CHANNELS), or 0xFF to query it.
+    if (EM.assert(USBSerial::read(&cmd[1], 1) == 1, Error::BadParamSize)) {
+        if (cmd[1] == 0xFF) {
+            auto channels = static_cast<unsigned char>(ConversionManager::channels());
+            USBSerial::write(&channels, 1);
+        } else if (EM.assert(run_status == RunStatus::Idle, Error::NotIdle)) {
+            EM.assert(ConversionManager::setChannels(cmd[1]), Error::BadParam);
+        }
+    }
+}
+
+void setRateFactor(unsigned char *cmd)
+{
+    // Param: converter samples per algorithm sample (1, 2, 4 or 8), or 0xFF
+    // to query it.
+    if (EM.assert(USBSerial::read(&cmd[1], 1) == 1, Error::BadParamSize)) {
+        if (cmd[1] == 0xFF) {
+            auto factor = static_cast<unsigned char>(ConversionManager::rateFactor());
+            USBSerial::write(&factor, 1);
+        } else if (EM.assert(run_status == RunStatus::Idle, Error::NotIdle)) {
+            EM.assert(ConversionManager::setRateFactor(cmd[1]), Error::BadParam);
+        }
+    }
+}
+
+void setOversampling(unsigned char *cmd)
+{
+    // Params: oversampling ratio (as a power of two) and right shift, or 0xFF
+    // to query them along with the resulting bits per input sample.
+    if (EM.assert(USBSerial::read(&cmd[1], 1) == 1, Error::BadParamSize)) {
+        if (cmd[1] == 0xFF) {
+            unsigned char setting[3] = {
+                static_cast<unsigned char>(ADC::oversamplingRatio()),
+                static_cast<unsigned char>(ADC::oversamplingShift()),
+                static_cast<unsigned char>(ADC::sampleBits())
+            };
+            USBSerial::write(setting, 3);
+        } else if (EM.assert(USBSerial::read(&cmd[2], 1) == 1, Error::BadParamSize) &&
+                   EM.assert(run_status == RunStatus::Idle, Error::NotIdle))
+        {
+            EM.assert(ADC::setOversampling(cmd[1], cmd[2]), Error::BadParam);
+        }
+    }
+}
+
 void loadAlgorithm(unsigned char *cmd)
 {
     if (EM.assert(run_status == RunStatus::Idle, Error::NotIdle) &&
@@ -143,12 +254,59 @@ void loadAlgorithm(unsigned char *cmd)
         unsigned int size = cmd[1] | (cmd[2] << 8);
         if (EM.assert(size < MAX_ELF_FILE_SIZE, Error::BadUserCodeSize)) {
             USBSerial::read(ELFManager::fileBuffer(), size);
-            auto success = ELFManager::loadFromInternalBuffer();
+            auto success = ELFManager::loadFromInternalBuffer(size);
             EM.assert(success, Error::BadUserCodeLoad);
         }
     }
 }
 
+void storeAlgorithm(unsigned char *)
+{
+    // Params: slot, flags, then the algorithm's name (NAME_LENGTH bytes).
+    // Only an uploaded algorithm can be stored, as the file buffer holds its
+    // image; one loaded from the store has no image there.
+    unsigned char params[2 + AlgorithmStore::NAME_LENGTH];
+
+    if (EM.assert(run_status == RunStatus::Idle, Error::NotIdle) &&
+        EM.assert(USBSerial::read(params, sizeof(params)) == sizeof(params), Error::BadParamSize) &&
+        EM.assert(params[0] < AlgorithmStore::SLOT_COUNT, Error::BadSlot) &&
+        EM.assert(ELFManager::fileSize() > 0, Error::BadUserCodeLoad))
+    {
+        auto name = reinterpret_cast<const char *>(params + 2);
+        EM.assert(AlgorithmStore::save(params[0], name, params[1]), Error::FlashFailure);
+    }
+}
+
+void listStoredAlgorithms(unsigned char *)
+{
+    unsigned char count = AlgorithmStore::SLOT_COUNT;
+    USBSerial::write(&count, 1);
+
+    for (unsigned int i = 0; i < AlgorithmStore::SLOT_COUNT; ++i) {
+        USBSerial::write(reinterpret_cast<const uint8_t *>(&AlgorithmStore::entry(i)),
+                         sizeof(AlgorithmStore::Entry));
+    }
+}
+
+void eraseStoredAlgorithm(unsigned char *cmd)
+{
+    if (EM.assert(run_status == RunStatus::Idle, Error::NotIdle) &&
+        EM.assert(USBSerial::read(&cmd[1], 1) == 1, Error::BadParamSize) &&
+        EM.assert(cmd[1] < AlgorithmStore::SLOT_COUNT, Error::BadSlot))
+    {
+        EM.assert(AlgorithmStore::erase(cmd[1]), Error::FlashFailure);
+    }
+}
+
+void loadStoredAlgorithm(unsigned char *cmd)
+{
+    if (EM.assert(run_status == RunStatus::Idle, Error::NotIdle) &&
+        EM.assert(USBSerial::read(&cmd[1], 1) == 1, Error::BadParamSize))
+    {
+        EM.assert(AlgorithmStore::load(cmd[1]), Error::BadSlot);
+    }
+}
+
 void readStatus(unsigned char *)
 {
     unsigned char buf[2] = {
@@ -167,9 +325,10 @@ void measureConversion(unsigned char *)
 
 void startConversion(unsigned char *)
 {
-    if (EM.assert(run_status == RunStatus::Idle, Error::NotIdle)) {
+    if (EM.assert(run_status == RunStatus::Idle, Error::NotIdle) &&
+        ConversionManager::start())
+    {
         run_status = RunStatus::Running;
-        ConversionManager::start();
     }
 }
 
@@ -183,7 +342,12 @@ void stopConversion(unsigned char *)
 
 void startGenerator(unsigned char *)
 {
-    DAC::start(1, Samples::Generator.data(), Samples::Generator.size());
+    // The second channel's output uses the generator's DAC channel.
+    if (EM.assert(run_status != RunStatus::Running || ConversionManager::channels() == 1,
+                  Error::BadChannels))
+    {
+        DAC::start(1, Samples::Generator.data(), Samples::Generator.size());
+    }
 }
 
 void readADCBuffer(unsigned char *)
@@ -219,28 +383,152 @@ void readExecTime(unsigned char *)
                      sizeof(rtcnt_t));
 }
 
-void sampleRate(unsigned char *cmd)
+void readLatency(unsigned char *)
+{
+    // Timing of the low-latency mode: block period, last and longest
+    // turnaround, and missed blocks; each a 32-bit count.
+    const auto& stats = ConversionManager::latency();
+    USBSerial::write(reinterpret_cast<const uint8_t *>(&stats), sizeof(stats));
+}
+
+void readTiming(unsigned char *)
+{
+    // Time taken on each block since conversion started: blocks, last, min,
+    // max, mean, budget, near misses, overruns, then the histogram bins; each
+    // a 32-bit count.
+    const auto stats = ConversionManager::timing();
+    USBSerial::write(reinterpret_cast<const uint8_t *>(&stats), sizeof(stats));
+}
+
+void readProfile(unsigned char *)
 {
+    // The counter's rate in Hz and the loaded algorithm's marker count, then
+    // each marker's total (64 bits), count and longest pass; all 32-bit words.
+    std::array<ELFManager::ProfileMarker, ELFManager::MAX_PROFILE_MARKERS> markers;
+    std::array<uint32_t, 2 + 4 * ELFManager::MAX_PROFILE_MARKERS> reply;
+    const auto count = Profiler::read(markers.data());
+
+    reply[0] = Profiler::frequency();
+    reply[1] = count;
+    for (unsigned int i = 0; i < count; i++) {
+        reply[2 + 4 * i] = static_cast<uint32_t>(markers[i].total);
+        reply[3 + 4 * i] = static_cast<uint32_t>(markers[i].total >> 32);
+        reply[4 + 4 * i] = markers[i].count;
+        reply[5 + 4 * i] = markers[i].max;
+    }
+
+    USBSerial::write(reinterpret_cast<const uint8_t *>(reply.data()),
+                     (2 + 4 * count) * sizeof(uint32_t));
+}
+
+void setSampling(unsigned char *cmd)
+{
+    // Param: one to clear the PC samples and start sampling the algorithm
+    // thread, or zero to stop.
     if (EM.assert(USBSerial::read(&cmd[1], 1) == 1, Error::BadParamSize)) {
-        if (cmd[1] == 0xFF) {
-            auto r = static_cast<unsigned char>(SClock::getRate());
-            USBSerial::write(&r, 1);
+        if (cmd[1] != 0) {
+            EM.assert(Profiler::startSampling(ConversionManager::runnerThread()),
+                      Error::BadUserCodeLoad);
         } else {
-            auto r = static_cast<SClock::Rate>(cmd[1]);
-            SClock::setRate(r);
-            ADC::setRate(r);
+            Profiler::stopSampling();
         }
     }
 }
 
+void readSampling(unsigned char *)
+{
+    // Running, link address of the first bin, bin shift, bins in use, then
+    // the sample, outside and other counts; all 32-bit words. Followed by the
+    // bins in use as 16-bit counts.
+    const auto stats = Profiler::samplingStats();
+    USBSerial::write(reinterpret_cast<const uint8_t *>(&stats), sizeof(stats));
+    USBSerial::write(reinterpret_cast<const uint8_t *>(Profiler::samplingBins()),
+                     stats.bins * sizeof(uint16_t));
+}
+
+void setTrace(unsigned char *cmd)
+{
+    // Param: the events to record (bit n for Trace::Event n), which also
+    // clears the trace; zero stops recording.
+    if (EM.assert(USBSerial::read(&cmd[1], 1) == 1, Error::BadParamSize))
+        Trace::enable(cmd[1]);
+}
+
+void readTrace(unsigned char *)
+{
+    // The profile counter's rate in Hz, events lost since the last read and
+    // the number of events, each 32 bits; then the events, oldest first, as
+    // the counter (32 bits), event and argument (16 bits each). Events are
+    // removed from the trace as they are read.
+    std::array<uint32_t, 3> header = { Profiler::frequency(), 0, 0 };
+    header[2] = Trace::pending(&header[1]);
+    USBSerial::write(reinterpret_cast<const uint8_t *>(header.data()),
+                     header.size() * sizeof(uint32_t));
+
+    // Events only arrive meanwhile, so every read gets as many as asked.
+    std::array<Trace::Entry, 32> entries;
+    for (unsigned int left = header[2]; left > 0;) {
+        const auto count = Trace::read(entries.data(), std::min<unsigned int>(left, entries.size()));
+        USBSerial::write(reinterpret_cast<const uint8_t *>(entries.data()),
+                         count * sizeof(Trace::Entry));
+        left -= count;
+    }
+}
+
+void sampleRate(unsigned char *)
+{
+    // Param: sample rate in Hz (SClock::MIN_RATE to MAX_RATE) as 32 bits, or
+    // zero to query it. Replies with the rate now in effect, which for a new
+    // rate is the closest the timer could make.
+    if (unsigned char param[4]; EM.assert(USBSerial::read(param, 4) == 4, Error::BadParamSize)) {
+        unsigned int rate = param[0] | (param[1] << 8) | (param[2] << 16) |
+                            (static_cast<unsigned int>(param[3]) << 24);
+        if (rate != 0 && EM.assert(run_status == RunStatus::Idle, Error::NotIdle)) {
+            // The ADC may not keep up with its oversampling at the new rate,
+            // in which case the old rate is put back.
+            const auto previous = SClock::getFrequency();
+            if (auto made = SClock::setRate(rate); !EM.assert(made != 0 && ADC::setRate(made), Error::BadParam))
+                SClock::setRate(previous);
+        }
+
+        uint32_t current = SClock::getFrequency();
+        USBSerial::write(reinterpret_cast<const uint8_t *>(&current), sizeof(current));
+    }
+}
+
 void readConversionResults(unsigned char *)
 {
     if (auto samps = Samples::Out.modified(); samps != nullptr) {
+        const unsigned int frames = ConversionManager::bufferFrames();
         unsigned char buf[2] = {
-            static_cast<unsigned char>(Samples::Out.size() / 2 & 0xFF),
-            static_cast<unsigned char>(((Samples::Out.size() / 2) >> 8) & 0xFF)
+            static_cast<unsigned char>(frames & 0xFF),
+            static_cast<unsigned char>((frames >> 8) & 0xFF)
         };
         USBSerial::write(buf, 2);
+
+        const auto channels = ConversionManager::channels();
+        const auto factor = ConversionManager::rateFactor();
+        if (channels > 1 || factor > 1) {
+            // Output is sent at the algorithm's rate, taking every factor'th
+            // sample. The second channel's output (from the generator's
+            // buffer) is interleaved with the first, in the same size chunks
+            // as below.
+            const auto samps2 = Samples::Generator.data() + (samps - Samples::Out.data());
+            std::array<Sample, 256> chunk;
+            unsigned char unused;
+            for (unsigned int i = 0; i < frames;) {
+                unsigned int n = 0;
+                for (; n < chunk.size() && i < frames; ++i) {
+                    chunk[n++] = samps[i * factor];
+                    if (channels > 1)
+                        chunk[n++] = samps2[i * factor];
+                }
+                USBSerial::write(reinterpret_cast<uint8_t *>(chunk.data()), n * sizeof(Sample));
+                while (USBSerial::read(&unused, 1) == 0);
+            }
+            return;
+        }
+
         unsigned int total = Samples::Out.bytesize() / 2;
         unsigned int offset = 0;
         unsigned char unused;
@@ -260,12 +548,16 @@ void readConversionResults(unsigned char *)
 void readConversionInput(unsigned char *)
 {
     if (auto samps = Samples::In.modified(); samps != nullptr) {
+        // Samples are already interleaved; the count given is of frames.
+        // With a rate factor, these are the decimated frames at the start
+        // of the half.
+        const unsigned int frames = ConversionManager::bufferFrames();
         unsigned char buf[2] = {
-            static_cast<unsigned char>(Samples::In.size() / 2 & 0xFF),
-            static_cast<unsigned char>(((Samples::In.size() / 2) >> 8) & 0xFF)
+            static_cast<unsigned char>(frames & 0xFF),
+            static_cast<unsigned char>((frames >> 8) & 0xFF)
         };
         USBSerial::write(buf, 2);
-        unsigned int total = Samples::In.bytesize() / 2;
+        unsigned int total = frames * ConversionManager::channels() * sizeof(Sample);
         unsigned int offset = 0;
         unsigned char unused;
         while (total > 512) {
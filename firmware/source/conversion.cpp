@@ -13,10 +13,18 @@
 
 #include "periph/adc.hpp"
 #include "periph/dac.hpp"
+#include "periph/fmac.hpp"
 #include "elfload.hpp"
 #include "error.hpp"
+#include "multirate.hpp"
 #include "runstatus.hpp"
+#include "sampleformat.hpp"
 #include "samples.hpp"
+#include "sclock.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <bit>
 
 // MSG_* things below are macros rather than constexpr
 // to ensure inlining.
@@ -29,6 +37,13 @@
 #define MSG_FOR_FIRST(msg)   (msg & 1)
 #define MSG_FOR_MEASURE(msg) (msg > 2)
 
+// The realtime counter counts core clock cycles.
+#if defined(TARGET_PLATFORM_H7)
+constexpr uint64_t REALTIME_COUNTER_FREQUENCY = STM32_SYS_CK;
+#else
+constexpr uint64_t REALTIME_COUNTER_FREQUENCY = STM32_HCLK;
+#endif
+
 __attribute__((section(".convdata")))
 thread_t *ConversionManager::m_thread_monitor = nullptr;
 thread_t *ConversionManager::m_thread_runner = nullptr;
@@ -39,12 +54,37 @@ __attribute__((section(".stacks")))
 std::array<char, THD_WORKING_AREA_SIZE(128)> ConversionManager::m_thread_runner_entry_stack = {};
 __attribute__((section(".convdata")))
 std::array<char, CONVERSION_THREAD_STACK_SIZE> ConversionManager::m_thread_runner_stack = {};
+__attribute__((section(".convdata")))
+ELFManager::BlockContext ConversionManager::m_block_context = {};
+__attribute__((section(".convdata")))
+unsigned int ConversionManager::m_window_pos = 0;
+__attribute__((section(".convdata")))
+unsigned int ConversionManager::m_block_fill = 0;
+__attribute__((section(".convdata")))
+unsigned int ConversionManager::m_channels = 1;
+unsigned int ConversionManager::m_buffer_frames = MAX_SAMPLE_BUFFER_SIZE / 2;
 
 std::array<msg_t, 2> ConversionManager::m_mailbox_buffer;
 mailbox_t ConversionManager::m_mailbox = _MAILBOX_DATA(m_mailbox, m_mailbox_buffer.data(), m_mailbox_buffer.size());
 
+bool ConversionManager::m_direct = false;
+bool ConversionManager::m_direct_measure = false;
+thread_reference_t ConversionManager::m_runner_ref = nullptr;
+bool ConversionManager::m_latency_pending = false;
+rtcnt_t ConversionManager::m_latency_start = 0;
+rtcnt_t ConversionManager::m_block_time = 0;
+ConversionManager::LatencyStats ConversionManager::m_latency;
+bool ConversionManager::m_timing_pending = false;
+rtcnt_t ConversionManager::m_timing_start = 0;
+uint64_t ConversionManager::m_timing_total = 0;
+ConversionManager::TimingStats ConversionManager::m_timing;
+
 void ConversionManager::begin()
 {
+    // .convdata is not loaded at startup, so its values are set here.
+    m_channels = 1;
+    Multirate::setFactor(1);
+
     m_thread_monitor = chThdCreateStatic(m_thread_monitor_stack.data(),
                                          m_thread_monitor_stack.size(),
                                          NORMALPRIO + 1,
@@ -58,32 +98,225 @@ void ConversionManager::begin()
                                         runner_stack_end);
 }
 
-void ConversionManager::start()
+bool ConversionManager::start()
 {
+    // Multiple channels need an algorithm that takes them, and the second
+    // DAC channel free of the signal generator.
+    if (m_channels > 1) {
+        const auto& iface = ELFManager::loadedInterface();
+        if (ELFManager::loadedElf() == nullptr || iface.abi != 2 ||
+            !(iface.flags & ELFManager::BLOCK_CHANNELS) || DAC::isSigGenRunning())
+        {
+            EM.add(Error::BadChannels);
+            return false;
+        }
+    }
+
+    // ABI version 1 algorithms in another format take each whole buffer
+    // half through a block buffer sized when they were compiled; the device's
+    // buffers must not have grown since.
+    if (const auto& iface = ELFManager::loadedInterface();
+        iface.abi == 1 && iface.format != SampleFormat::Raw &&
+        Samples::Out.size() / 2 / Multirate::factor() > iface.capacity)
+    {
+        EM.add(Error::BadBufferSize);
+        return false;
+    }
+
+    m_block_context = {};
+    m_window_pos = 0;
+    m_block_fill = 0;
+    m_block_context.sampleRate = SClock::getFrequency() / Multirate::factor();
+    m_block_context.sampleBits = ADC::sampleBits();
+    m_block_context.profile = ELFManager::loadedInterface().profile;
+    ELFManager::clearBuffers();
+    Multirate::reset();
+
+    m_latency = {};
+    m_latency_pending = false;
+    m_block_time = 0;
+    m_direct_measure = false;
+    m_direct = Samples::Out.size() / 2 <= LOW_LATENCY_MAX_BLOCK;
+
+    // Each half of Samples::Out is one block period at the converter rate.
+    m_timing = {};
+    m_timing.budget = static_cast<uint32_t>(REALTIME_COUNTER_FREQUENCY *
+        (Samples::Out.size() / 2) / SClock::getFrequency());
+    m_timing_total = 0;
+    m_timing_pending = false;
+    if (m_direct) {
+        // Move the algorithm thread from the mailbox over to waiting on the
+        // ADC: an empty message wakes it, and it comes back to wait directly.
+        chMBPostTimeout(&m_mailbox, 0, TIME_INFINITE);
+        for (int i = 0; i < 100 && m_runner_ref == nullptr; i++)
+            chThdSleepMicroseconds(100);
+    }
+
     Samples::Out.clear();
-    ADC::start(Samples::In.data(), Samples::In.size(), adcReadHandler);
+    if (m_channels > 1) {
+        Samples::Generator.setSize(Samples::Out.size());
+        Samples::Generator.clear();
+    }
+
+    ADC::start(Samples::In.data(), Samples::In.size(),
+               m_direct ? adcReadHandlerDirect : adcReadHandler);
+    // Have the knobs' values ready for the first block.
+    if (ELFManager::loadedInterface().flags & ELFManager::BLOCK_PARAMS)
+        ADC::refreshAlt();
     DAC::start(0, Samples::Out.data(), Samples::Out.size());
+    if (m_channels > 1)
+        DAC::start(1, Samples::Generator.data(), Samples::Generator.size());
+
+    return true;
 }
 
 void ConversionManager::startMeasurement()
 {
-    ADC::setOperation(adcReadHandlerMeasure);
+    if (m_direct)
+        m_direct_measure = true;
+    else
+        ADC::setOperation(adcReadHandlerMeasure);
 }
 
 void ConversionManager::stop()
 {
     DAC::stop(0);
+    if (m_channels > 1)
+        DAC::stop(1);
     ADC::stop();
+    fmac::stop();
+
+    if (m_direct) {
+        // Send the algorithm thread back to the mailbox.
+        chSysLock();
+        m_direct = false;
+        chThdResumeS(&m_runner_ref, 0);
+        chSysUnlock();
+    }
+}
+
+bool ConversionManager::setBufferFrames(unsigned int frames)
+{
+    return resize(frames, m_channels, Multirate::factor());
+}
+
+unsigned int ConversionManager::bufferFrames()
+{
+    return m_buffer_frames;
+}
+
+bool ConversionManager::setChannels(unsigned int channels)
+{
+    return resize(m_buffer_frames, channels, Multirate::factor());
+}
+
+unsigned int ConversionManager::channels()
+{
+    return m_channels;
+}
+
+bool ConversionManager::setRateFactor(unsigned int factor)
+{
+    return resize(m_buffer_frames, m_channels, factor);
+}
+
+unsigned int ConversionManager::rateFactor()
+{
+    return Multirate::factor();
 }
 
-thread_t *ConversionManager::getMonitorHandle()
+bool ConversionManager::resize(unsigned int frames, unsigned int channels, unsigned int factor)
 {
-    return m_thread_monitor;
+    // Each half of Samples::Out holds frames frames at the converter rate,
+    // and Samples::In the same for each channel.
+    const auto size = frames * 2 * factor;
+    const auto previous_factor = Multirate::factor();
+    if (frames == 0 || channels < 1 || channels > MAX_CHANNELS ||
+        size * channels > MAX_SAMPLE_BUFFER_SIZE || !Multirate::setFactor(factor))
+    {
+        return false;
+    }
+
+    // A second channel can double the ADC's conversions per trigger.
+    if (!ADC::setChannels(channels)) {
+        Multirate::setFactor(previous_factor);
+        return false;
+    }
+
+    m_buffer_frames = frames;
+    m_channels = channels;
+    Samples::In.setSize(size * channels);
+    Samples::Out.setSize(size);
+    return true;
+}
+
+const ConversionManager::LatencyStats& ConversionManager::latency()
+{
+    return m_latency;
+}
+
+ConversionManager::TimingStats ConversionManager::timing()
+{
+    chSysLock();
+    auto stats = m_timing;
+    const auto total = m_timing_total;
+    chSysUnlock();
+
+    if (stats.blocks > 0)
+        stats.mean = static_cast<uint32_t>(total / stats.blocks);
+    return stats;
+}
+
+thread_t *ConversionManager::runnerThread()
+{
+    return m_thread_runner;
+}
+
+msg_t ConversionManager::waitForSamples()
+{
+    msg_t msg;
+
+    chSysLock();
+
+    // The algorithm has just finished a block: see how long that took.
+    if (m_timing_pending) {
+        m_timing_pending = false;
+        recordTiming(chSysGetRealtimeCounterX() - m_timing_start);
+        Trace::record(Trace::Event::BlockDone);
+    }
+    if (m_latency_pending) {
+        m_latency_pending = false;
+        const uint32_t time = chSysGetRealtimeCounterX() - m_latency_start;
+        m_latency.turnaround = time;
+        if (time > m_latency.turnaroundMax)
+            m_latency.turnaroundMax = time;
+        if (m_latency.period > 0 && time > m_latency.period)
+            m_latency.missed++;
+    }
+
+    if (m_direct) {
+        msg = chThdSuspendS(&m_runner_ref);
+    } else {
+        chMsgWaitS();
+        msg = chMsgGet(m_thread_monitor);
+        chMsgReleaseS(m_thread_monitor, MSG_OK);
+    }
+
+    // Empty messages only move the thread between modes.
+    if (msg != 0) {
+        m_timing_pending = true;
+        m_timing_start = chSysGetRealtimeCounterX();
+        Trace::record(Trace::Event::RunnerWake, static_cast<uint32_t>(msg));
+    }
+
+    chSysUnlock();
+    return msg;
 }
 
 void ConversionManager::abort(bool fpu_stacked)
 {
     ELFManager::unload();
+    fmac::stop();
     EM.add(Error::ConversionAborted);
     //run_status = RunStatus::Recovering;
 
@@ -141,42 +374,286 @@ void ConversionManager::threadRunner(void *)
         asm("svc 0; mov %0, r0" : "=r" (message));
 
         if (message != 0) {
-            auto samples = MSG_FOR_FIRST(message) ? Samples::In.data()
-                                                  : Samples::In.middata();
-            auto size = Samples::In.size() / 2;
-
-            auto entry = ELFManager::loadedElf();
-            if (entry) {
-                // Below, we remember the stack pointer just in case the
-                // loaded algorithm messes things up.
-                uint32_t sp;
-
-                if (!MSG_FOR_MEASURE(message)) {
-                    asm("mov %0, sp" : "=r" (sp));
-                    samples = entry(samples, size);
-                    asm("mov sp, %0" :: "r" (sp));
-                    volatile auto testRead = *samples;
-                    (void)testRead;
-                } else {
-                    // Start execution timer:
-                    asm("mov %0, sp; eor r0, r0; svc 2" : "=r" (sp));
-                    samples = entry(samples, size);
-                    // Stop execution timer:
-                    asm("mov r0, #1; svc 2; mov sp, %0" :: "r" (sp));
-                    volatile auto testRead = *samples;
-                    (void)testRead;
-                } 
-            }
+            const bool first = MSG_FOR_FIRST(message);
+            auto samples = first ? Samples::In.data() : Samples::In.middata();
+            // Each channel's output has its own buffer (see setChannels).
+            Sample * const out[MAX_CHANNELS] = {
+                first ? Samples::Out.data() : Samples::Out.middata(),
+                first ? Samples::Generator.data() : Samples::Generator.middata() };
+
+            // With a rate factor, the input is decimated in place to the
+            // algorithm's rate, and the output is interpolated back up after.
+            const auto factor = Multirate::factor();
+            const auto frames = Samples::Out.size() / 2 / factor;
+            if (factor > 1)
+                Multirate::decimate(samples, frames, m_channels, m_block_context.sampleBits);
+
+            bool updated = true;
+            if (ELFManager::loadedInterface().abi == 2)
+                runBlocks(samples, out, frames, MSG_FOR_MEASURE(message));
+            else
+                updated = runEntry(samples, frames, first, MSG_FOR_MEASURE(message));
 
-            // Update the sample out buffer with the transformed samples.
-            if (samples != nullptr) {
-                if (MSG_FOR_FIRST(message))
-                    Samples::Out.modify(samples, size);
+            if (updated) {
+                if (factor > 1) {
+                    for (unsigned int c = 0; c < m_channels; c++)
+                        Multirate::interpolate(out[c], frames, c);
+                }
+
+                if (first)
+                    Samples::Out.setModified();
                 else
-                    Samples::Out.midmodify(samples, size);
+                    Samples::Out.setMidmodified();
+            }
+        }
+    }
+}
+
+// Runs an ABI version 1 algorithm over size samples, writing its output to
+// the first or second half of Samples::Out. Returns false if the algorithm
+// gave no output.
+__attribute__((section(".convcode")))
+bool ConversionManager::runEntry(Sample *samples, unsigned int size, bool first, bool measure)
+{
+    // Algorithms that asked for another format are given a converted copy
+    // of the input, leaving Samples::In untouched for streaming.
+    const auto& iface = ELFManager::loadedInterface();
+    if (iface.format != SampleFormat::Raw) {
+        sampleformat::convertIn(iface.format, m_block_context.sampleBits, samples,
+                                iface.in[0], size);
+        samples = static_cast<Sample *>(iface.in[0]);
+    }
+
+    auto entry = ELFManager::loadedElf();
+    if (entry) {
+        // Below, we remember the stack pointer just in case the
+        // loaded algorithm messes things up.
+        uint32_t sp;
+
+        if (!measure) {
+            asm("mov %0, sp" : "=r" (sp));
+            samples = entry(samples, size);
+            asm("mov sp, %0" :: "r" (sp));
+            volatile auto testRead = *samples;
+            (void)testRead;
+        } else {
+            // Start execution timer:
+            asm("mov %0, sp; eor r0, r0; svc 2" : "=r" (sp));
+            samples = entry(samples, size);
+            // Stop execution timer:
+            asm("mov r0, #1; svc 2; mov sp, %0" :: "r" (sp));
+            volatile auto testRead = *samples;
+            (void)testRead;
+        } 
+    }
+
+    // Update the sample out buffer with the transformed samples.
+    if (samples == nullptr) {
+        return false;
+    } else if (iface.format != SampleFormat::Raw) {
+        auto out = first ? Samples::Out.data() : Samples::Out.middata();
+        sampleformat::convertOut(iface.format, samples, out, size);
+    } else {
+        if (first)
+            Samples::Out.modify(samples, size);
+        else
+            Samples::Out.midmodify(samples, size);
+    }
+
+    return true;
+}
+
+// Copies between buffers that do not overlap, for use in the conversion
+// thread (which cannot call memcpy).
+__attribute__((section(".convcode")))
+static void copyBytes(uint8_t *dst, const uint8_t *src, unsigned int count)
+{
+    if (((reinterpret_cast<uint32_t>(dst) | reinterpret_cast<uint32_t>(src) | count) & 3) == 0) {
+        auto d = reinterpret_cast<uint32_t *>(dst);
+        auto s = reinterpret_cast<const uint32_t *>(src);
+        for (count /= 4; count > 0; --count)
+            *d++ = *s++;
+    } else {
+        while (count-- > 0)
+            *dst++ = *src++;
+    }
+}
+
+// Runs an ABI version 2 algorithm over frames frames of interleaved samples
+// from in, writing each channel's output to its buffer in out. The algorithm
+// is always given whole blocks of the size it declared; if the device's
+// buffers do not hold a whole number of blocks, blocks are gathered across
+// them instead.
+__attribute__((section(".convcode")))
+void ConversionManager::runBlocks(const Sample *in, Sample * const out[], unsigned int frames, bool measure)
+{
+    const auto& iface = ELFManager::loadedInterface();
+    const auto block_size = iface.capacity;
+    auto& ctx = m_block_context;
+
+    // The knobs are read together without waiting on the ADC: each read
+    // starts the conversion that the next block's values come from.
+    if (iface.flags & ELFManager::BLOCK_PARAMS) {
+        uint32_t values;
+        asm volatile("mov r0, #2; svc 3; mov %0, r0" : "=r" (values) :: "r0");
+        ctx.params[0] = values & 0xFFFF;
+        ctx.params[1] = values >> 16;
+    }
+
+    // Start execution timer; conversions are included in the time.
+    if (measure)
+        asm volatile("eor r0, r0; svc 2" ::: "r0");
+
+    ctx.length = block_size;
+    ctx.channels = m_channels;
+    if (frames % block_size == 0) {
+        // Raw samples of a single channel are read and written in place
+        // unless the algorithm needs its input kept.
+        const bool in_place = iface.format == SampleFormat::Raw && m_channels == 1;
+        const bool keep = !in_place || iface.window > 0 ||
+                          (iface.flags & ELFManager::BLOCK_HISTORY);
+
+        for (unsigned int done = 0; done < frames; done += block_size) {
+            if (keep) {
+                auto buffer = blockInput();
+                blockConvertIn(in + done * m_channels, buffer, 0, block_size);
+                ctx.in = buffer;
+            } else {
+                ctx.in = in + done;
+            }
+
+            ctx.out = in_place ? out[0] + done : iface.out;
+            runBlock();
+            if (!in_place)
+                blockConvertOut(0, out, done, block_size);
+        }
+    } else {
+        // Samples go into the block being gathered, and the previous block's
+        // output at the same position comes out. This delays the signal by
+        // one block.
+        for (unsigned int done = 0, n; done < frames; done += n) {
+            n = block_size - m_block_fill;
+            if (n > frames - done)
+                n = frames - done;
+
+            auto buffer = blockInput();
+            blockConvertIn(in + done * m_channels, buffer, m_block_fill, n);
+            blockConvertOut(m_block_fill, out, done, n);
+
+            m_block_fill += n;
+            if (m_block_fill == block_size) {
+                ctx.in = buffer;
+                ctx.out = iface.out;
+                runBlock();
+                m_block_fill = 0;
             }
         }
     }
+
+    // Stop execution timer:
+    if (measure)
+        asm volatile("mov r0, #1; svc 2" ::: "r0");
+}
+
+// Returns where the input of the current block goes, and points the block
+// context's history at what the algorithm asked to keep.
+__attribute__((section(".convcode")))
+uint8_t *ConversionManager::blockInput()
+{
+    const auto& iface = ELFManager::loadedInterface();
+    auto& ctx = m_block_context;
+
+    if (iface.window > 0) {
+        // Each block is converted into the buffer right after the window, so
+        // it is copied there like any other block input. The window then
+        // slides along the buffer, and is moved back to the start once the
+        // next block would not fit after it. The buffer has room for two
+        // windows past one block, so a block longer than the window costs one
+        // window-sized copy every time; shorter blocks only every few blocks.
+        auto base = static_cast<uint8_t *>(iface.in[0]);
+        if (m_block_fill == 0 && m_window_pos > iface.window) {
+            copyBytes(base, base + m_window_pos * iface.sampleSize,
+                      iface.window * iface.sampleSize);
+            m_window_pos = 0;
+        }
+
+        auto window = base + m_window_pos * iface.sampleSize;
+        ctx.history = window;
+        return window + iface.window * iface.sampleSize;
+    } else if (iface.flags & ELFManager::BLOCK_HISTORY) {
+        // The two input buffers take turns, so the one not being filled
+        // holds the previous block.
+        ctx.history = iface.in[(ctx.block + 1) & 1];
+        return static_cast<uint8_t *>(iface.in[ctx.block & 1]);
+    } else {
+        ctx.history = nullptr;
+        return static_cast<uint8_t *>(iface.in[0]);
+    }
+}
+
+// Converts n frames of interleaved samples from in into the block input
+// buffer, starting at frame pos, in the layout the algorithm asked for.
+__attribute__((section(".convcode")))
+void ConversionManager::blockConvertIn(const Sample *in, uint8_t *buffer, unsigned int pos, unsigned int n)
+{
+    const auto& iface = ELFManager::loadedInterface();
+    const auto sample_size = iface.sampleSize;
+    const auto bits = m_block_context.sampleBits;
+
+    if (m_channels == 1) {
+        sampleformat::convertIn(iface.format, bits, in, buffer + pos * sample_size, n);
+    } else if (iface.flags & ELFManager::BLOCK_PLANAR) {
+        for (unsigned int c = 0; c < m_channels; c++) {
+            sampleformat::convertInStrided(iface.format, bits, in + c, m_channels,
+                buffer + (c * iface.capacity + pos) * sample_size, n);
+        }
+    } else {
+        sampleformat::convertIn(iface.format, bits, in,
+            buffer + pos * m_channels * sample_size, n * m_channels);
+    }
+}
+
+// Converts n frames of the block output buffer, starting at frame pos, into
+// each channel's output buffer starting at sample at.
+__attribute__((section(".convcode")))
+void ConversionManager::blockConvertOut(unsigned int pos, Sample * const out[], unsigned int at, unsigned int n)
+{
+    const auto& iface = ELFManager::loadedInterface();
+    const auto sample_size = iface.sampleSize;
+    const auto buffer = static_cast<const uint8_t *>(iface.out);
+
+    if (m_channels == 1) {
+        sampleformat::convertOut(iface.format, buffer + pos * sample_size, out[0] + at, n);
+    } else if (iface.flags & ELFManager::BLOCK_PLANAR) {
+        for (unsigned int c = 0; c < m_channels; c++) {
+            sampleformat::convertOut(iface.format,
+                buffer + (c * iface.capacity + pos) * sample_size, out[c] + at, n);
+        }
+    } else {
+        for (unsigned int c = 0; c < m_channels; c++) {
+            sampleformat::convertOutStrided(iface.format,
+                buffer + (pos * m_channels + c) * sample_size, m_channels, out[c] + at, n);
+        }
+    }
+}
+
+// Calls the algorithm for the block described by the block context.
+__attribute__((section(".convcode")))
+void ConversionManager::runBlock()
+{
+    const auto entry = reinterpret_cast<ELFManager::EntryFuncV2>(
+        reinterpret_cast<void (*)()>(ELFManager::loadedElf()));
+
+    if (entry) {
+        // Restore the stack pointer in case the algorithm messes it up.
+        uint32_t sp;
+        asm("mov %0, sp" : "=r" (sp));
+        entry(&m_block_context);
+        asm("mov sp, %0" :: "r" (sp));
+    }
+
+    m_block_context.block++;
+    m_window_pos += m_block_context.length;
 }
 
 void ConversionManager::adcReadHandler(adcsample_t *buffer, size_t)
@@ -186,6 +663,7 @@ void ConversionManager::adcReadHandler(adcsample_t *buffer, size_t)
     // If previous request hasn't been handled, then we're going too slow.
     // We'll need to abort.
     if (chMBGetUsedCountI(&m_mailbox) > 1) {
+        Trace::record(Trace::Event::Overrun, 0);
         chMBResetI(&m_mailbox);
         chMBResumeX(&m_mailbox);
         chSysUnlockFromISR();
@@ -195,9 +673,11 @@ void ConversionManager::adcReadHandler(adcsample_t *buffer, size_t)
         if (buffer == Samples::In.data()) {
             Samples::In.setModified();
             chMBPostI(&m_mailbox, MSG_CONVFIRST);
+            Trace::record(Trace::Event::MailboxPost, MSG_CONVFIRST);
         } else {
             Samples::In.setMidmodified();
             chMBPostI(&m_mailbox, MSG_CONVSECOND);
+            Trace::record(Trace::Event::MailboxPost, MSG_CONVSECOND);
         }
         chSysUnlockFromISR();
     }
@@ -209,12 +689,72 @@ void ConversionManager::adcReadHandlerMeasure(adcsample_t *buffer, size_t)
     if (buffer == Samples::In.data()) {
         Samples::In.setModified();
         chMBPostI(&m_mailbox, MSG_CONVFIRST_MEASURE);
+        Trace::record(Trace::Event::MailboxPost, MSG_CONVFIRST_MEASURE);
     } else {
         Samples::In.setMidmodified();
         chMBPostI(&m_mailbox, MSG_CONVSECOND_MEASURE);
+        Trace::record(Trace::Event::MailboxPost, MSG_CONVSECOND_MEASURE);
     }
     chSysUnlockFromISR();
 
     ADC::setOperation(adcReadHandler);
 }
 
+// Low-latency mode: wakes the algorithm thread for each block without going
+// through the mailbox and monitor thread.
+void ConversionManager::adcReadHandlerDirect(adcsample_t *buffer, size_t)
+{
+    const auto now = chSysGetRealtimeCounterX();
+
+    chSysLockFromISR();
+
+    if (buffer == Samples::In.data())
+        Samples::In.setModified();
+    else
+        Samples::In.setMidmodified();
+
+    if (m_block_time != 0)
+        m_latency.period = now - m_block_time;
+    m_block_time = now;
+
+    // If the algorithm is still busy with the last block, this one is
+    // dropped: the DAC repeats the previous output instead.
+    if (m_runner_ref != nullptr) {
+        msg_t msg = buffer == Samples::In.data() ? MSG_CONVFIRST : MSG_CONVSECOND;
+        if (m_direct_measure) {
+            m_direct_measure = false;
+            msg += MSG_CONVFIRST_MEASURE - MSG_CONVFIRST;
+        }
+
+        m_latency_start = now;
+        m_latency_pending = true;
+        chThdResumeI(&m_runner_ref, msg);
+    } else {
+        m_latency.missed++;
+        Trace::record(Trace::Event::Overrun, 1);
+    }
+
+    chSysUnlockFromISR();
+}
+
+// Adds one block's processing time to the timing statistics. Called with
+// the system locked.
+void ConversionManager::recordTiming(uint32_t time)
+{
+    auto& stats = m_timing;
+    if (stats.blocks == 0 || time < stats.min)
+        stats.min = time;
+    if (time > stats.max)
+        stats.max = time;
+    stats.last = time;
+    stats.blocks++;
+    m_timing_total += time;
+
+    if (time > stats.budget)
+        stats.overruns++;
+    else if (time > stats.budget - stats.budget / 8)
+        stats.nearMisses++;
+
+    const auto width = static_cast<unsigned int>(std::bit_width(time));
+    stats.histogram[width > 8 ? std::min(width - 8, TIMING_BINS - 1) : 0]++;
+}
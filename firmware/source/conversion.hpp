@@ -15,32 +15,108 @@
 #include "ch.h"
 #include "hal.h"
 
+#include "elfload.hpp"
+
 #include <array>
 
+// On the H7, this stack shares the first half of DTCM with the other
+// .convdata; the second half is used for algorithm data. On the L4, 2K of
+// .convdata's 16K is left for the rest (mostly Multirate's filter state).
 constexpr unsigned int CONVERSION_THREAD_STACK_SIZE = 
 #if defined(TARGET_PLATFORM_H7)
-                                                  62 * 1024;
+                                                  28 * 1024;
 #else
-                                                  15 * 1024;
+                                                  14 * 1024;
 #endif
 
 class ConversionManager
 {
 public:
+    // Half-buffer sizes up to this run in low-latency mode, where the ADC
+    // interrupt hands each block straight to the algorithm thread.
+    static constexpr unsigned int LOW_LATENCY_MAX_BLOCK = 8;
+
+    /**
+     * Timing of the low-latency mode, in realtime counter cycles.
+     * The ADC-to-DAC delay is two block periods (one full buffer) as long
+     * as every block is turned around within one block period.
+     */
+    struct LatencyStats {
+        uint32_t period = 0;         // Time between blocks.
+        uint32_t turnaround = 0;     // Last time from ADC block to output.
+        uint32_t turnaroundMax = 0;  // Longest turnaround so far.
+        uint32_t missed = 0;         // Blocks dropped or finished late.
+    };
+
+    // Execution times are sorted into this many bins: the first holds times
+    // under 256 cycles, and each after it twice the range of the one before.
+    static constexpr unsigned int TIMING_BINS = 24;
+
+    /**
+     * Time taken to process each block since conversion started, in realtime
+     * counter cycles, from the algorithm thread waking for a block to it
+     * waiting for the next one. The budget is the block period: the time
+     * the thread has before the next block arrives.
+     */
+    struct TimingStats {
+        uint32_t blocks = 0;         // Blocks processed.
+        uint32_t last = 0;
+        uint32_t min = 0;
+        uint32_t max = 0;
+        uint32_t mean = 0;
+        uint32_t budget = 0;
+        uint32_t nearMisses = 0;     // Blocks within an eighth of the budget.
+        uint32_t overruns = 0;       // Blocks over the budget.
+        uint32_t histogram[TIMING_BINS] = {};
+    };
+
     /**
      * Starts two threads: the privileged monitor thread and the unprivileged
      * algorithm execution thread.
      */
     static void begin();
 
-    // Begins sample conversion.
-    static void start();
+    // Begins sample conversion. Returns false (and adds an error) if the
+    // loaded algorithm cannot take the set number of channels.
+    static bool start();
     // Prepare to measure execution time of next conversion.
     static void startMeasurement();
     // Stops conversion.
     static void stop();
 
-    static thread_t *getMonitorHandle();
+    // The setters below size the sample buffers, and return false if the
+    // result would not fit. Only call them while stopped.
+
+    // Sets the number of frames (one sample of each channel) the algorithm
+    // is given at a time; each half of the sample buffers holds this many
+    // frames at the algorithm's rate.
+    static bool setBufferFrames(unsigned int frames);
+    static unsigned int bufferFrames();
+
+    // Sets the number of input and output channels (one to MAX_CHANNELS).
+    // Input samples are interleaved in Samples::In; the second channel's
+    // output goes through Samples::Generator to the second DAC channel.
+    // Also fails if the ADC's oversampling cannot keep up with more channels.
+    static bool setChannels(unsigned int channels);
+    static unsigned int channels();
+
+    // Sets how many converter samples there are for each of the algorithm's
+    // samples (see Multirate): input is decimated by this factor before the
+    // algorithm, and output interpolated by it afterwards.
+    static bool setRateFactor(unsigned int factor);
+    static unsigned int rateFactor();
+
+    // Returns the low-latency mode's timing since conversion started.
+    static const LatencyStats& latency();
+    // Returns the algorithm thread's timing since conversion started.
+    static TimingStats timing();
+
+    // Returns the algorithm thread, e.g. for sampling where it runs.
+    static thread_t *runnerThread();
+
+    // Internal only: Waits for the next block of samples on behalf of the
+    // algorithm thread (service call 0), returning its message.
+    static msg_t waitForSamples();
 
     // Internal only: Aborts a running conversion.
     static void abort(bool fpu_stacked = true);
@@ -49,9 +125,19 @@ private:
     static void threadMonitor(void *);
     static void threadRunnerEntry(void *stack);
 
+    static bool resize(unsigned int frames, unsigned int channels, unsigned int factor);
+
     static void threadRunner(void *);
+    static bool runEntry(Sample *samples, unsigned int size, bool first, bool measure);
+    static void runBlocks(const Sample *in, Sample * const out[], unsigned int frames, bool measure);
+    static uint8_t *blockInput();
+    static void blockConvertIn(const Sample *in, uint8_t *buffer, unsigned int pos, unsigned int n);
+    static void blockConvertOut(unsigned int pos, Sample * const out[], unsigned int at, unsigned int n);
+    static void runBlock();
     static void adcReadHandler(adcsample_t *buffer, size_t);
     static void adcReadHandlerMeasure(adcsample_t *buffer, size_t);
+    static void adcReadHandlerDirect(adcsample_t *buffer, size_t);
+    static void recordTiming(uint32_t time);
 
     static thread_t *m_thread_monitor;
     static thread_t *m_thread_runner;
@@ -59,9 +145,29 @@ private:
     static std::array<char, 1024> m_thread_monitor_stack;
     static std::array<char, THD_WORKING_AREA_SIZE(128)> m_thread_runner_entry_stack;
     static std::array<char, CONVERSION_THREAD_STACK_SIZE> m_thread_runner_stack;
+    static ELFManager::BlockContext m_block_context;
+    static unsigned int m_window_pos;
+    static unsigned int m_block_fill;
+    static unsigned int m_channels;
+    static unsigned int m_buffer_frames;
 
     static std::array<msg_t, 2> m_mailbox_buffer;
     static mailbox_t m_mailbox;
+
+    // Low-latency mode state:
+    static bool m_direct;
+    static bool m_direct_measure;
+    static thread_reference_t m_runner_ref;
+    static bool m_latency_pending;
+    static rtcnt_t m_latency_start;
+    static rtcnt_t m_block_time;
+    static LatencyStats m_latency;
+
+    // Timing state, kept by waitForSamples():
+    static bool m_timing_pending;
+    static rtcnt_t m_timing_start;
+    static uint64_t m_timing_total;
+    static TimingStats m_timing;
 };
 
 #endif // STMDSP_CONVERSION_HPP
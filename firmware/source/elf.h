@@ -12,6 +12,18 @@
 
 #define EI_NIDENT 16
 
+#define EI_CLASS    4
+#define EI_DATA     5
+#define ELFCLASS32  1
+#define ELFDATA2LSB 1
+
+#define ET_NONE 0
+#define ET_REL  1
+#define ET_EXEC 2
+#define ET_DYN  3
+
+#define EM_ARM 40
+
 #define PT_NULL     0
 #define PT_LOAD     1
 #define PT_DYNAMIC  2
@@ -21,6 +33,20 @@
 #define PT_PHDR     6
 #define PT_RESERVED 0x70000000
 
+#define PF_X 0x1
+#define PF_W 0x2
+#define PF_R 0x4
+
+#define DT_NULL   0
+#define DT_RELA   7
+#define DT_RELASZ 8
+#define DT_REL    17
+#define DT_RELSZ  18
+#define DT_RELENT 19
+
+#define R_ARM_NONE     0
+#define R_ARM_RELATIVE 23
+
 #define ELF32_ST_BIND(i)    ((i) >> 4)
 #define ELF32_ST_TYPE(i)    ((i) & 0xF)
 #define ELF32_ST_INFO(b, t) (((b) << 4) + ((t) & 0xF))
@@ -96,5 +122,16 @@ typedef struct {
 	Elf32_Word p_align;
 } __attribute__((packed)) Elf32_Phdr;
 
+typedef struct {
+	Elf32_Sword d_tag;
+	Elf32_Word  d_val;
+} __attribute__((packed)) Elf32_Dyn;
+
+typedef struct {
+	Elf32_Word n_namesz;
+	Elf32_Word n_descsz;
+	Elf32_Word n_type;
+} __attribute__((packed)) Elf32_Nhdr;
+
 #endif // STMDSP_ELF_HPP
 
@@ -17,7 +17,10 @@
 
 __attribute__((section(".convdata")))
 ELFManager::EntryFunc ELFManager::m_entry = nullptr;
+__attribute__((section(".convdata")))
+ELFManager::Interface ELFManager::m_interface = {};
 std::array<unsigned char, MAX_ELF_FILE_SIZE> ELFManager::m_file_buffer = {};
+unsigned int ELFManager::m_file_size = 0;
 
 static const unsigned char elf_header[] = { '\177', 'E', 'L', 'F' };
 
@@ -27,58 +30,434 @@ ELFManager::EntryFunc ELFManager::loadedElf()
     return m_entry;
 }
 
+__attribute__((section(".convcode")))
+const ELFManager::Interface& ELFManager::loadedInterface()
+{
+    return m_interface;
+}
+
 unsigned char *ELFManager::fileBuffer()
 {
     return m_file_buffer.data();
 }
 
+unsigned int ELFManager::fileSize()
+{
+    return m_file_size;
+}
+
 void ELFManager::unload()
 {
     m_entry = nullptr;
+    m_interface = {};
+    m_file_size = 0;
+}
+
+void ELFManager::clearBuffers()
+{
+    const unsigned int block = m_interface.capacity * m_interface.channels;
+    const unsigned int lengths[3] = {
+        block + 2 * m_interface.window,
+        block,
+        block
+    };
+    void * const buffers[3] = { m_interface.in[0], m_interface.in[1], m_interface.out };
+
+    for (unsigned int i = 0; i < 3; i++) {
+        if (buffers[i] == nullptr)
+            continue;
+
+        // Raw samples are silent at mid-scale rather than at zero.
+        if (m_interface.format == SampleFormat::Raw)
+            std::fill_n(static_cast<Sample *>(buffers[i]), lengths[i], Sample(2048));
+        else
+            std::memset(buffers[i], 0, lengths[i] * m_interface.sampleSize);
+    }
+
+    if (m_interface.profile != nullptr)
+        std::fill_n(m_interface.profile, m_interface.profileMarkers, ProfileMarker {});
 }
 
 template<typename T>
-constexpr static auto ptr_from_offset(void *base, uint32_t offset)
+constexpr static auto ptr_from_offset(const void *base, uint32_t offset)
 {
-    return reinterpret_cast<T>(reinterpret_cast<uint8_t *>(base) + offset);
+    return reinterpret_cast<T>(reinterpret_cast<const uint8_t *>(base) + offset);
 }
 
-bool ELFManager::loadFromInternalBuffer()
+// Memory that algorithms may be loaded into, in order of preference.
+// Position-independent images are placed in the first region they fit in;
+// fixed-address images must lie entirely within one of these.
+// Sample conversion buffers go in the first data region with room.
+struct LoadRegion {
+    uint32_t base;
+    uint32_t size;
+    bool data;
+};
+
+#if defined(TARGET_PLATFORM_H7)
+static const std::array<LoadRegion, 3> loadRegions {{
+    {0x00000000, 64 * 1024, false}, // ITCM: HOT_CODE, code and read-only data
+    {0x20008000, 32 * 1024, true},  // DTCM: HOT_DATA, data and bss
+    {0x24040000, 64 * 1024, true}   // AXI SRAM: BULK_DATA
+}};
+#else
+static const std::array<LoadRegion, 1> loadRegions {{
+    {0x10000000, 32 * 1024, true}   // SRAM2
+}};
+#endif
+
+static bool within(uint32_t addr, uint32_t size, uint32_t base, uint32_t limit)
+{
+    return addr >= base && size <= limit && addr - base <= limit - size;
+}
+
+static bool withinLoadRegion(uint32_t addr, uint32_t size)
+{
+    return std::any_of(loadRegions.cbegin(), loadRegions.cend(),
+        [&](const auto& r) { return within(addr, size, r.base, r.size); });
+}
+
+// The REL table of a position-independent image, within its file data.
+struct RelTable {
+    const unsigned char *data = nullptr;
+    uint32_t size = 0;
+    uint32_t entry = sizeof(Elf32_Rel);
+};
+static bool findRelocations(const unsigned char *elf_data, unsigned int size,
+                            const Elf32_Ehdr *ehdr, const Elf32_Phdr *dynamic,
+                            uint32_t bias, RelTable *table);
+static void relocate(const RelTable& table, uint32_t bias);
+static bool findNote(const unsigned char *elf_data, unsigned int size,
+                     const Elf32_Phdr *note, uint32_t type,
+                     uint32_t *desc, unsigned int desc_words);
+
+bool ELFManager::loadFromInternalBuffer(unsigned int size)
+{
+    const bool loaded = loadFromBuffer(m_file_buffer.data(), size);
+    if (loaded)
+        m_file_size = size;
+    return loaded;
+}
+
+bool ELFManager::loadFromBuffer(const unsigned char *elf_data, unsigned int size)
 {
     m_entry = nullptr;
+    m_interface = {};
+    m_file_size = 0;
 
-    auto elf_data = m_file_buffer.data();
+    // Check the ELF's header: a 32-bit, little-endian ARM executable.
+    if (size < sizeof(Elf32_Ehdr))
+        return false;
 
-    // Check the ELF's header signature
-    auto ehdr = reinterpret_cast<Elf32_Ehdr *>(elf_data);
-    if (!std::equal(ehdr->e_ident, ehdr->e_ident + 4, elf_header))
+    auto ehdr = reinterpret_cast<const Elf32_Ehdr *>(elf_data);
+    if (!std::equal(ehdr->e_ident, ehdr->e_ident + 4, elf_header) ||
+        ehdr->e_ident[EI_CLASS] != ELFCLASS32 ||
+        ehdr->e_ident[EI_DATA] != ELFDATA2LSB ||
+        ehdr->e_machine != EM_ARM ||
+        (ehdr->e_type != ET_EXEC && ehdr->e_type != ET_DYN))
+    {
         return false;
+    }
+
+    if (ehdr->e_phentsize < sizeof(Elf32_Phdr) ||
+        !within(ehdr->e_phoff, ehdr->e_phnum * ehdr->e_phentsize, 0, size))
+    {
+        return false;
+    }
 
-    // Iterate through program header LOAD sections
-    bool loaded = false;
-    auto phdr = ptr_from_offset<Elf32_Phdr *>(elf_data, ehdr->e_phoff);
+    auto phdr_at = [&](unsigned int i) {
+        return ptr_from_offset<const Elf32_Phdr *>(elf_data, ehdr->e_phoff + i * ehdr->e_phentsize);
+    };
+
+    // Find the span of the image's LOAD segments and check their file data.
+    uint32_t span_start = UINT32_MAX;
+    uint32_t span_end = 0;
+    const Elf32_Phdr *dynamic = nullptr;
+    uint32_t format[2] = { static_cast<uint32_t>(SampleFormat::Raw), 0 };
+    uint32_t abi[2] = { 1, 0 };
+    uint32_t window = 0;
+    uint32_t markers = 0;
     for (Elf32_Half i = 0; i < ehdr->e_phnum; i++) {
-        if (phdr->p_type == PT_LOAD) {
-            if (phdr->p_filesz == 0) {
-                std::memset(reinterpret_cast<void *>(phdr->p_vaddr),
-                            0,
-                            phdr->p_memsz);
-            } else {
-                std::memcpy(reinterpret_cast<void *>(phdr->p_vaddr),
-                            ptr_from_offset<void *>(elf_data, phdr->p_offset),
-                            phdr->p_filesz);
-                if (!loaded)
-                    loaded = true;
+        auto phdr = phdr_at(i);
+        if (phdr->p_type == PT_LOAD && phdr->p_memsz > 0) {
+            if (phdr->p_filesz > phdr->p_memsz ||
+                !within(phdr->p_offset, phdr->p_filesz, 0, size) ||
+                phdr->p_vaddr + phdr->p_memsz < phdr->p_vaddr)
+            {
+                return false;
             }
+
+            span_start = std::min(span_start, phdr->p_vaddr);
+            span_end = std::max(span_end, phdr->p_vaddr + phdr->p_memsz);
+        } else if (phdr->p_type == PT_DYNAMIC) {
+            dynamic = phdr;
+        } else if (phdr->p_type == PT_NOTE) {
+            findNote(elf_data, size, phdr, NOTE_FORMAT, format, 2);
+            findNote(elf_data, size, phdr, NOTE_ABI, abi, 2);
+            findNote(elf_data, size, phdr, NOTE_WINDOW, &window, 1);
+            findNote(elf_data, size, phdr, NOTE_PROFILE, &markers, 1);
         }
+    }
+
+    // Work out which block buffers the algorithm needs; these require the
+    // block size from the format note.
+    Interface loaded;
+    loaded.abi = abi[0];
+    loaded.flags = abi[1];
+    loaded.format = static_cast<SampleFormat>(format[0]);
+    loaded.window = window;
+    if (format[0] >= static_cast<uint32_t>(SampleFormat::Count) ||
+        (loaded.abi != 1 && loaded.abi != 2) ||
+        (loaded.abi == 1 && (loaded.flags != 0 || window != 0 || markers != 0)) ||
+        markers > MAX_PROFILE_MARKERS ||
+        (loaded.flags & ~(BLOCK_PARAMS | BLOCK_HISTORY | BLOCK_CHANNELS | BLOCK_PLANAR)) != 0 ||
+        ((loaded.flags & BLOCK_HISTORY) && window != 0) ||
+        ((loaded.flags & BLOCK_PLANAR) && !(loaded.flags & BLOCK_CHANNELS)) ||
+        ((loaded.flags & BLOCK_CHANNELS) && ((loaded.flags & BLOCK_HISTORY) || window != 0)) ||
+        window > MAX_SAMPLE_BUFFER_SIZE / 2)
+    {
+        return false;
+    }
 
-        phdr = ptr_from_offset<Elf32_Phdr *>(phdr, ehdr->e_phentsize);
+    // ABI version 2 algorithms always get their own buffers, so that blocks
+    // can be gathered across the device's buffers. A window is kept in
+    // front of the input block, in a single buffer.
+    const bool converted = loaded.format != SampleFormat::Raw;
+    unsigned int in_buffers = converted ? 1 : 0;
+    unsigned int out_buffers = 0;
+    if (loaded.abi == 2) {
+        in_buffers = (loaded.flags & BLOCK_HISTORY) ? 2 : 1;
+        out_buffers = 1;
+        if (loaded.flags & BLOCK_CHANNELS)
+            loaded.channels = MAX_CHANNELS;
     }
+    if (in_buffers > 0 && (format[1] == 0 || format[1] > MAX_SAMPLE_BUFFER_SIZE / 2))
+        return false;
 
+    if (span_end == 0)
+        return false;
 
-    if (loaded)
-        m_entry = reinterpret_cast<ELFManager::EntryFunc>(ehdr->e_entry);
+    // Position-independent images are given a load address (bias) here;
+    // others must already be linked to run from an algorithm region.
+    uint32_t bias = 0;
+    if (ehdr->e_type == ET_DYN) {
+        auto region = std::find_if(loadRegions.cbegin(), loadRegions.cend(),
+            [&](const auto& r) { return span_end - span_start <= r.size; });
+        if (region == loadRegions.cend())
+            return false;
 
-    return loaded;
+        bias = region->base - span_start;
+    }
+
+    // Validate every segment's destination, the entry point and the
+    // relocations before anything is written.
+    bool entry_ok = false;
+    const uint32_t entry = ehdr->e_entry + bias;
+    for (Elf32_Half i = 0; i < ehdr->e_phnum; i++) {
+        auto phdr = phdr_at(i);
+        if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0)
+            continue;
+
+        const uint32_t dst = phdr->p_vaddr + bias;
+        if (!withinLoadRegion(dst, phdr->p_memsz))
+            return false;
+
+        // Entry must be Thumb code within an executable segment.
+        if ((phdr->p_flags & PF_X) && (entry & 1) &&
+            within(entry & ~1u, 2, dst, phdr->p_memsz))
+        {
+            entry_ok = true;
+            loaded.codeBase = dst;
+            loaded.codeSize = phdr->p_memsz;
+            loaded.codeLink = phdr->p_vaddr;
+        }
+    }
+
+    if (!entry_ok)
+        return false;
+
+    RelTable relocations;
+    if (dynamic != nullptr &&
+        !findRelocations(elf_data, size, ehdr, dynamic, bias, &relocations))
+    {
+        return false;
+    }
+
+    // Reserve the block buffers past the end of the image in a data region,
+    // each aligned to a cache line, followed by any profile markers.
+    if (in_buffers > 0) {
+        // Windows of 16-bit samples are kept to an even length so that blocks
+        // stay word-aligned for the conversion routines.
+        loaded.sampleSize = sampleformat::elementSize(loaded.format);
+        if (loaded.sampleSize == 2)
+            loaded.window = (loaded.window + 1) & ~1u;
+
+        const uint32_t stride = (format[1] * loaded.channels * loaded.sampleSize + 31) & ~31u;
+        const uint32_t first = (2 * loaded.window * loaded.sampleSize + stride + 31) & ~31u;
+        const uint32_t buffer_bytes = first + stride * (in_buffers - 1 + out_buffers);
+        const uint32_t bytes = buffer_bytes + markers * static_cast<uint32_t>(sizeof(ProfileMarker));
+        for (const auto& r : loadRegions) {
+            if (!r.data)
+                continue;
+
+            uint32_t top = r.base;
+            for (Elf32_Half i = 0; i < ehdr->e_phnum; i++) {
+                auto phdr = phdr_at(i);
+                const uint32_t dst = phdr->p_vaddr + bias;
+                if (phdr->p_type == PT_LOAD && within(dst, phdr->p_memsz, r.base, r.size))
+                    top = std::max(top, dst + phdr->p_memsz);
+            }
+
+            top = (top + 31) & ~31u;
+            if (within(top, bytes, r.base, r.size)) {
+                loaded.in[0] = reinterpret_cast<void *>(top);
+                if (in_buffers > 1)
+                    loaded.in[1] = reinterpret_cast<void *>(top + first);
+                if (out_buffers > 0)
+                    loaded.out = reinterpret_cast<void *>(top + first + (in_buffers - 1) * stride);
+                if (markers > 0)
+                    loaded.profile = reinterpret_cast<ProfileMarker *>(top + buffer_bytes);
+                loaded.profileMarkers = markers;
+                loaded.capacity = format[1];
+                break;
+            }
+        }
+
+        if (loaded.in[0] == nullptr)
+            return false;
+    }
+
+    // Copy LOAD segments to their destination, zeroing .bss areas.
+    for (Elf32_Half i = 0; i < ehdr->e_phnum; i++) {
+        auto phdr = phdr_at(i);
+        if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0)
+            continue;
+
+        auto dst = reinterpret_cast<unsigned char *>(phdr->p_vaddr + bias);
+        auto src = ptr_from_offset<const unsigned char *>(elf_data, phdr->p_offset);
+        std::memcpy(dst, src, phdr->p_filesz);
+        std::memset(dst + phdr->p_filesz, 0, phdr->p_memsz - phdr->p_filesz);
+    }
+
+    if (dynamic != nullptr)
+        relocate(relocations, bias);
+
+    m_interface = loaded;
+    clearBuffers();
+    m_entry = reinterpret_cast<ELFManager::EntryFunc>(entry);
+    return true;
+}
+
+// Looks through a PT_NOTE segment for a note named "stmdsp" of the given
+// type, copying up to desc_words words of its descriptor into desc.
+bool findNote(const unsigned char *elf_data, unsigned int size,
+              const Elf32_Phdr *note, uint32_t type,
+              uint32_t *desc, unsigned int desc_words)
+{
+    static const char name[] = "stmdsp";
+
+    if (!within(note->p_offset, note->p_filesz, 0, size))
+        return false;
+
+    uint32_t off = 0;
+    while (note->p_filesz - off >= sizeof(Elf32_Nhdr)) {
+        Elf32_Nhdr nhdr;
+        std::memcpy(&nhdr, elf_data + note->p_offset + off, sizeof(nhdr));
+        off += sizeof(nhdr);
+
+        // Name and descriptor are each padded to a multiple of four bytes.
+        const uint32_t left = note->p_filesz - off;
+        if (nhdr.n_namesz > left || nhdr.n_descsz > left ||
+            ((nhdr.n_namesz + 3) & ~3u) + ((nhdr.n_descsz + 3) & ~3u) > left)
+        {
+            return false;
+        }
+
+        auto note_name = elf_data + note->p_offset + off;
+        off += (nhdr.n_namesz + 3) & ~3u;
+        if (nhdr.n_type == type && nhdr.n_namesz == sizeof(name) &&
+            std::equal(name, name + sizeof(name), note_name))
+        {
+            const auto words = std::min<unsigned int>(desc_words, nhdr.n_descsz / 4);
+            std::memcpy(desc, elf_data + note->p_offset + off, words * 4);
+            return true;
+        }
+
+        off += (nhdr.n_descsz + 3) & ~3u;
+    }
+
+    return false;
+}
+
+bool findRelocations(const unsigned char *elf_data, unsigned int size,
+                     const Elf32_Ehdr *ehdr, const Elf32_Phdr *dynamic,
+                     uint32_t bias, RelTable *table)
+{
+    if (!within(dynamic->p_offset, dynamic->p_filesz, 0, size))
+        return false;
+
+    // Find the REL table; the image is linked without a dynamic linker, so
+    // only base-relative relocations are expected.
+    uint32_t rel = 0, relsz = 0, relent = sizeof(Elf32_Rel);
+    auto dyn = ptr_from_offset<const Elf32_Dyn *>(elf_data, dynamic->p_offset);
+    for (unsigned int i = 0; i < dynamic->p_filesz / sizeof(Elf32_Dyn); ++i) {
+        if (dyn[i].d_tag == DT_NULL)
+            break;
+        else if (dyn[i].d_tag == DT_REL)
+            rel = dyn[i].d_val;
+        else if (dyn[i].d_tag == DT_RELSZ)
+            relsz = dyn[i].d_val;
+        else if (dyn[i].d_tag == DT_RELENT)
+            relent = dyn[i].d_val;
+        else if (dyn[i].d_tag == DT_RELA || dyn[i].d_tag == DT_RELASZ)
+            return false; // ARM uses REL only.
+    }
+
+    *table = {};
+    if (relsz == 0)
+        return true;
+    if (relent < sizeof(Elf32_Rel))
+        return false;
+
+    // The table is read from the file data of the LOAD segment holding it,
+    // so that it can be checked before the image is copied.
+    for (Elf32_Half i = 0; i < ehdr->e_phnum; i++) {
+        auto phdr = ptr_from_offset<const Elf32_Phdr *>(elf_data, ehdr->e_phoff + i * ehdr->e_phentsize);
+        if (phdr->p_type == PT_LOAD && within(rel, relsz, phdr->p_vaddr, phdr->p_filesz))
+            table->data = elf_data + phdr->p_offset + (rel - phdr->p_vaddr);
+    }
+    if (table->data == nullptr)
+        return false;
+
+    for (uint32_t off = 0; off < relsz; off += relent) {
+        Elf32_Rel r;
+        std::memcpy(&r, table->data + off, sizeof(r));
+        const auto type = ELF32_R_TYPE(r.r_info);
+        if (type == R_ARM_RELATIVE ? !withinLoadRegion(r.r_offset + bias, 4)
+                                   : type != R_ARM_NONE)
+        {
+            return false;
+        }
+    }
+
+    table->size = relsz;
+    table->entry = relent;
+    return true;
+}
+
+void relocate(const RelTable& table, uint32_t bias)
+{
+    for (uint32_t off = 0; off < table.size; off += table.entry) {
+        Elf32_Rel r;
+        std::memcpy(&r, table.data + off, sizeof(r));
+        if (ELF32_R_TYPE(r.r_info) != R_ARM_RELATIVE)
+            continue;
+
+        const uint32_t target = r.r_offset + bias;
+        uint32_t value;
+        std::memcpy(&value, reinterpret_cast<void *>(target), 4);
+        value += bias;
+        std::memcpy(reinterpret_cast<void *>(target), &value, 4);
+    }
 }
 
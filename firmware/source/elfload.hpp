@@ -13,6 +13,7 @@
 #define ELF_LOAD_HPP_
 
 #include "samplebuffer.hpp"
+#include "sampleformat.hpp"
 
 #include <array>
 #include <cstddef>
@@ -22,13 +23,117 @@ constexpr unsigned int MAX_ELF_FILE_SIZE = 16 * 1024;
 class ELFManager
 {
 public:
+    // ABI version 1: r0 = samples, r1 = count; returns the output samples.
     using EntryFunc = Sample *(*)(Sample *, size_t);
-    
+
+    /**
+     * Timing of one section of an ABI version 2 algorithm (NOTE_PROFILE), in
+     * Profiler counts. Kept in algorithm memory and updated by the algorithm
+     * itself, so part of the algorithm interface.
+     */
+    struct ProfileMarker {
+        uint64_t total;      // Time spent in the section.
+        uint32_t count;      // Passes through the section; updated last.
+        uint32_t max;        // Longest pass.
+        uint32_t start;      // Counter at the start of the current pass.
+        uint32_t reserved;
+    };
+    static constexpr unsigned int MAX_PROFILE_MARKERS = 8;
+
+    /**
+     * Passed (in r0) to the entry point of ABI version 2 algorithms for each
+     * block. Part of the algorithm interface, so only append to this.
+     */
+    struct BlockContext {
+        const void *in;      // Input samples, in the algorithm's format.
+        void *out;           // Output samples; never the same as in.
+        uint32_t length;     // Samples in this block.
+        uint32_t sampleRate; // In Hz, after any rate factor.
+        uint32_t block;      // Blocks processed since conversion started.
+        uint32_t params[2];  // Knob values (0-4095), with BLOCK_PARAMS;
+                             // read during the previous block.
+        const void *history; // Previous block's input, with BLOCK_HISTORY;
+                             // or the start of the window just before in.
+        uint32_t channels;   // Channels in in and out, with BLOCK_CHANNELS
+                             // (otherwise one).
+        uint32_t sampleBits; // Bits in each raw input sample (12 to 16, see
+                             // ADC::setOversampling()); raw output is 12-bit.
+        ProfileMarker *profile; // Section timing, with NOTE_PROFILE.
+    };
+    using EntryFuncV2 = void (*)(BlockContext *);
+
+    // Flags for NOTE_ABI.
+    static constexpr uint32_t BLOCK_PARAMS = 1 << 0;
+    static constexpr uint32_t BLOCK_HISTORY = 1 << 1;
+    // The algorithm takes every input channel. in and out then hold length
+    // frames of channels samples, one frame after another; or with
+    // BLOCK_PLANAR, each channel's length samples one after another.
+    static constexpr uint32_t BLOCK_CHANNELS = 1 << 2;
+    static constexpr uint32_t BLOCK_PLANAR = 1 << 3;
+
+    /**
+     * Describes how to call the loaded algorithm, as declared by the image's
+     * "stmdsp" ELF notes. Images without notes use ABI version 1 with raw
+     * samples.
+     */
+    struct Interface {
+        uint32_t abi = 1;
+        uint32_t flags = 0;
+        SampleFormat format = SampleFormat::Raw;
+        // Buffers in algorithm memory, each holding capacity samples: in[0]
+        // for converted input (in[1] too for BLOCK_HISTORY), and out for the
+        // output of ABI version 2 algorithms. Unused buffers are nullptr; for
+        // ABI version 2, capacity is the fixed block size.
+        void *in[2] = {};
+        void *out = nullptr;
+        unsigned int capacity = 0;
+        // Samples of input history kept in front of each block (NOTE_WINDOW,
+        // made even for 16-bit formats). in[0] then holds capacity + 2 *
+        // window samples, and the window is moved back to its start whenever
+        // the next block would not fit: after every block if the block is
+        // longer than the window, otherwise every few blocks.
+        unsigned int window = 0;
+        unsigned int sampleSize = sizeof(Sample);
+        // Channels each buffer has room for: MAX_CHANNELS with
+        // BLOCK_CHANNELS, multiplying the buffers' sizes.
+        unsigned int channels = 1;
+        // Section timing markers in algorithm memory, after the buffers.
+        ProfileMarker *profile = nullptr;
+        unsigned int profileMarkers = 0;
+        // The executable segment holding the entry point: where it was
+        // loaded, its size, and the address it was linked at (which differs
+        // for position-independent images), for mapping PC samples.
+        uint32_t codeBase = 0;
+        uint32_t codeSize = 0;
+        uint32_t codeLink = 0;
+    };
+
+    // Note types found under the "stmdsp" note name.
+    static constexpr uint32_t NOTE_FORMAT = 1; // desc: format, block size
+    static constexpr uint32_t NOTE_ABI = 2;    // desc: version, flags
+    static constexpr uint32_t NOTE_WINDOW = 3; // desc: history samples
+    static constexpr uint32_t NOTE_PROFILE = 4; // desc: profile markers
+
     /**
      * Attempts to parse the ELF binary loaded in the file buffer.
      * Returns true if successful.
+     * @param size Size of the binary in bytes.
      */
-    static bool loadFromInternalBuffer();
+    static bool loadFromInternalBuffer(unsigned int size);
+
+    /**
+     * Attempts to parse and load the ELF binary at the given address.
+     * The binary is validated before anything is copied: it must be a 32-bit
+     * ARM executable whose segments fit in algorithm memory, whose entry
+     * point is Thumb code in an executable segment, and whose relocations
+     * (if any) are all base-relative and within algorithm memory.
+     * Position-independent (ET_DYN) binaries are placed in the first
+     * algorithm memory region that fits them, then relocated.
+     * Buffers for converted or kept blocks and profile markers are reserved
+     * in algorithm memory after the image, as its notes require.
+     * Returns true if successful.
+     */
+    static bool loadFromBuffer(const unsigned char *elf_data, unsigned int size);
 
     /**
      * Returns a function pointer to the loaded ELF's entry point.
@@ -36,20 +141,40 @@ public:
      */
     static EntryFunc loadedElf();
 
+    /**
+     * Returns the calling interface of the loaded ELF.
+     */
+    static const Interface& loadedInterface();
+
     /**
      * Returns the address of the ELF file buffer (copy ELF binary to here).
      */
     static unsigned char *fileBuffer();
 
+    /**
+     * Returns the size of the loaded binary if it was loaded from the file
+     * buffer (i.e. uploaded), or zero if it came from elsewhere (such as the
+     * algorithm store) or nothing is loaded.
+     */
+    static unsigned int fileSize();
+
     /**
      * "Unloads" the loaded binary by invalidating the entry pointer.
      */
     static void unload();
 
+    /**
+     * Zeroes the loaded ELF's block buffers, so that the first block's
+     * history is silence, and its profile markers.
+     */
+    static void clearBuffers();
+
 private:
     static EntryFunc m_entry;
+    static Interface m_interface;
 
     static std::array<unsigned char, MAX_ELF_FILE_SIZE> m_file_buffer;
+    static unsigned int m_file_size;
 };
 
 #endif // ELF_LOAD_HPP_
@@ -23,7 +23,11 @@ enum class Error : char
     BadUserCodeSize,
     NotIdle,
     ConversionAborted,
-    NotRunning
+    NotRunning,
+    BadSlot,
+    FlashFailure,
+    BadChannels,
+    BadBufferSize
 };
 
 class ErrorManager
@@ -3,7 +3,48 @@
 #include "adc.hpp"
 #include "conversion.hpp"
 #include "cordic.hpp"
+#include "fmac.hpp"
 #include "runstatus.hpp"
+#include "samples.hpp"
+#include "trace.hpp"
+
+#include <array>
+#include <bit>
+
+/**
+ * Checks that the unprivileged algorithm may access the given memory, so
+ * that service calls cannot be used to reach privileged memory.
+ * The whole range must fall within one enabled MPU region; the highest
+ * numbered region containing the start address determines access.
+ */
+static bool isUserAccessible(uint32_t addr, uint32_t size, bool write)
+{
+    if (size == 0)
+        return true;
+    if (addr + size < addr)
+        return false;
+
+    const unsigned int regions = (MPU->TYPE & MPU_TYPE_DREGION_Msk) >> MPU_TYPE_DREGION_Pos;
+    for (unsigned int i = regions; i-- > 0;) {
+        MPU->RNR = i;
+        const uint32_t rasr = MPU->RASR;
+        if (!(rasr & MPU_RASR_ENABLE_Msk))
+            continue;
+
+        const uint32_t base = MPU->RBAR & MPU_RBAR_ADDR_Msk;
+        const uint32_t rsize = 2u << ((rasr & MPU_RASR_SIZE_Msk) >> MPU_RASR_SIZE_Pos);
+        if (addr < base || addr - base >= rsize)
+            continue;
+
+        // AP: 2 = read-only (unprivileged), 3 = full access, 6/7 = read-only.
+        const uint32_t ap = (rasr & MPU_RASR_AP_Msk) >> MPU_RASR_AP_Pos;
+        const bool readable = ap == 2 || ap == 3 || ap == 6 || ap == 7;
+        const bool writable = ap == 3;
+        return (write ? writable : readable) && size <= rsize - (addr - base);
+    }
+
+    return false;
+}
 
 extern "C" {
 
@@ -12,49 +53,50 @@ time_measurement_t conversion_time_measurement;
 __attribute__((naked))
 void port_syscall(struct port_extctx *ctxp, uint32_t n)
 {
+    Trace::record(Trace::Event::Syscall, n);
+
     switch (n) {
 
     // Sleeps the current thread until a message is received.
     // Used the algorithm runner to wait for new data.
     case 0:
         {
-            chSysLock();
-            chMsgWaitS();
-            auto monitor = ConversionManager::getMonitorHandle();
-            auto msg = chMsgGet(monitor);
-            chMsgReleaseS(monitor, MSG_OK);
-            chSysUnlock();
-            ctxp->r0 = msg;
+            // The runner has just written its results: make them visible to
+            // the DAC's DMA.
+            cacheBufferFlush(Samples::Out.data(), Samples::Out.bytesize());
+            if (ConversionManager::channels() > 1)
+                cacheBufferFlush(Samples::Generator.data(), Samples::Generator.bytesize());
+
+            ctxp->r0 = ConversionManager::waitForSamples();
         }
         break;
 
     // Provides access to advanced math functions.
     // A service call like this is required for some hardware targets that
     // provide hardware-accelerated math computations (e.g. CORDIC).
+    // The argument and result are passed in r1 (and r2 for the H7's doubles).
     case 1:
         {
-            using mathcall = void (*)();
-            static mathcall funcs[3] = {
-                reinterpret_cast<mathcall>(cordic::sin),
-                reinterpret_cast<mathcall>(cordic::cos),
-                reinterpret_cast<mathcall>(cordic::tan),
+#if defined(TARGET_PLATFORM_H7)
+            using mathcall = double (*)(double);
+#else
+            using mathcall = float (*)(float);
+#endif
+            static const mathcall funcs[3] = {
+                cordic::sin,
+                cordic::cos,
+                cordic::tan,
             };
-#if defined(PLATFORM_H7)
-            asm("vmov.f64 d0, %0, %1" :: "r" (ctxp->r1), "r" (ctxp->r2));
-            if (ctxp->r0 < 3) {
-                funcs[ctxp->r0]();
-                asm("vmov.f64 %0, %1, d0" : "=r" (ctxp->r1), "=r" (ctxp->r2));
-            } else {
-                asm("eor r0, r0; vmov.f64 d0, r0, r0");
-            }
+
+#if defined(TARGET_PLATFORM_H7)
+            uint32_t arg[2] = { ctxp->r1, ctxp->r2 };
+            auto x = ctxp->r0 < 3 ? funcs[ctxp->r0](std::bit_cast<double>(arg)) : 0.;
+            auto res = std::bit_cast<std::array<uint32_t, 2>>(x);
+            ctxp->r1 = res[0];
+            ctxp->r2 = res[1];
 #else
-            asm("vmov.f32 s0, %0" :: "r" (ctxp->r1));
-            if (ctxp->r0 < 3) {
-                funcs[ctxp->r0]();
-                asm("vmov.f32 %0, s0" : "=r" (ctxp->r1));
-            } else {
-                asm("eor r0, r0; vmov.f32 s0, r0");
-            }
+            auto x = ctxp->r0 < 3 ? funcs[ctxp->r0](std::bit_cast<float>(ctxp->r1)) : 0.f;
+            ctxp->r1 = std::bit_cast<uint32_t>(x);
 #endif
         }
         break;
@@ -76,21 +118,68 @@ void port_syscall(struct port_extctx *ctxp, uint32_t n)
         break;
 
     // Reads one of the analog inputs made available for algorithm run-time input.
+    // With r0 = 2, gives both inputs' latest values without waiting for a
+    // conversion (first | second << 16), for reading them once per block.
     case 3:
-        ctxp->r0 = ADC::readAlt(ctxp->r0);
+        if (ctxp->r0 == 2) {
+            adcsample_t values[2];
+            ADC::readAltLatest(values);
+            ctxp->r0 = static_cast<uint32_t>(values[0]) | (static_cast<uint32_t>(values[1]) << 16);
+        } else {
+            ctxp->r0 = ADC::readAlt(ctxp->r0);
+        }
+        break;
+
+    // Computes a math function over a block of values, so that vectorized
+    // algorithms pay for one service call instead of one per element.
+    // r0 = function (cordic::Function, optionally | cordic::Q31),
+    // r1 = input array, r2 = output array, r3 = element count.
+    // Returns zero in r0 if the call was rejected.
+    case 4:
+        {
+            const auto args = cordic::argumentCount(ctxp->r0);
+            const auto count = ctxp->r3;
+            const bool ok = args > 0 && count <= MAX_SAMPLE_BUFFER_SIZE &&
+                isUserAccessible(ctxp->r1, count * args * 4, false) &&
+                isUserAccessible(ctxp->r2, count * 4, true) &&
+                cordic::batch(ctxp->r0,
+                              reinterpret_cast<const void *>(ctxp->r1),
+                              reinterpret_cast<void *>(ctxp->r2),
+                              count);
+            ctxp->r0 = ok ? 1 : 0;
+        }
         break;
 
-    //case 4:
-    //    {
-    //        const char *str = reinterpret_cast<const char *>(ctxp->r0);
-    //        auto src = str;
-    //        auto dst = userMessageBuffer;
-    //        while (*src)
-    //            *dst++ = *src++;
-    //        *dst = '\0';
-    //        userMessageSize = src - str;
-    //    }
-    //    break;
+    // Runs FIR/IIR filters on the FMAC (or in software on the L4).
+    // r0 = 0: configure: r1 = Q15 coefficients (b then a),
+    //         r2 = nb | (na << 8) | (type << 16), r3 = gain.
+    // r0 = 1: start: r1 = Q15 input, r2 = Q15 output, r3 = count.
+    // r0 = 2: wait for the started block to finish.
+    // Returns zero in r0 if the call failed.
+    case 5:
+        {
+            bool ok = false;
+            if (ctxp->r0 == 0) {
+                const auto nb = ctxp->r2 & 0xFF;
+                const auto na = (ctxp->r2 >> 8) & 0xFF;
+                ok = isUserAccessible(ctxp->r1, (nb + na) * sizeof(int16_t), false) &&
+                     fmac::configure(static_cast<fmac::Type>(ctxp->r2 >> 16),
+                                     reinterpret_cast<const int16_t *>(ctxp->r1),
+                                     nb, na, ctxp->r3);
+            } else if (ctxp->r0 == 1) {
+                const auto count = ctxp->r3;
+                ok = count <= MAX_SAMPLE_BUFFER_SIZE &&
+                     isUserAccessible(ctxp->r1, count * sizeof(int16_t), false) &&
+                     isUserAccessible(ctxp->r2, count * sizeof(int16_t), true) &&
+                     fmac::start(reinterpret_cast<const int16_t *>(ctxp->r1),
+                                 reinterpret_cast<int16_t *>(ctxp->r2),
+                                 count);
+            } else if (ctxp->r0 == 2) {
+                ok = fmac::wait();
+            }
+            ctxp->r0 = ok ? 1 : 0;
+        }
+        break;
     default:
         while (1);
         break;
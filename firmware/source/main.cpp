@@ -13,9 +13,12 @@
 #include "hal.h"
 
 #include "adc.hpp"
+#include "algostore.hpp"
 #include "cordic.hpp"
 #include "dac.hpp"
 #include "error.hpp"
+#include "fmac.hpp"
+#include "profiler.hpp"
 #include "sclock.hpp"
 #include "usbserial.hpp"
 
@@ -43,15 +46,20 @@ int main()
     SClock::begin();
     USBSerial::begin();
     cordic::init();
+    fmac::init();
+    Profiler::begin();
 
-    SClock::setRate(SClock::Rate::R32K);
-    ADC::setRate(SClock::Rate::R32K);
+    ADC::setRate(SClock::setRate(32000));
 
     // Start our threads.
     ConversionManager::begin();
     CommunicationManager::begin();
     Monitor::begin();
 
+    // Start the stored default algorithm, if one exists, for standalone use.
+    if (AlgorithmStore::loadDefault() && ConversionManager::start())
+        run_status = RunStatus::Running;
+
     chThdExit(0);
     return 0;
 }
@@ -0,0 +1,202 @@
+/**
+ * @file multirate.cpp
+ * @brief Decimates input and interpolates output, so that algorithms can run
+ *        at a fraction of the converter rate.
+ *
+ * Copyright (C) 2023 Clyne Sullivan
+ *
+ * Distributed under the GNU GPL v3 or later. You should have received a copy of
+ * the GNU General Public License along with this program.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "multirate.hpp"
+
+#include <algorithm>
+#include <array>
+
+namespace {
+    constexpr double pi = 3.14159265358979323846;
+
+    // std::sin is not constexpr, so the filters are designed with this series.
+    constexpr double sine(double x)
+    {
+        while (x > pi)
+            x -= 2 * pi;
+        while (x < -pi)
+            x += 2 * pi;
+
+        double term = x;
+        double sum = x;
+        for (int n = 1; n < 12; n++) {
+            term *= -x * x / ((2 * n) * (2 * n + 1));
+            sum += term;
+        }
+        return sum;
+    }
+
+    // Hamming-windowed sinc with a cutoff at 0.4 of the algorithm's rate (its
+    // -6 dB point, see Multirate) and a gain of one, in Q15. The filter has an even length, so no tap falls
+    // on the center of the sinc.
+    template<unsigned int Factor>
+    constexpr auto design()
+    {
+        constexpr unsigned int taps = Factor * Multirate::TAPS_PER_PHASE;
+        constexpr double cutoff = 0.4 / Factor;
+
+        double h[taps] = {};
+        double sum = 0;
+        for (unsigned int i = 0; i < taps; i++) {
+            const double t = i - (taps - 1) / 2.;
+            const double window = 0.54 - 0.46 * sine(2 * pi * i / (taps - 1) + pi / 2);
+            h[i] = sine(2 * pi * cutoff * t) / (pi * t) * window;
+            sum += h[i];
+        }
+
+        std::array<int16_t, taps> filter {};
+        for (unsigned int i = 0; i < taps; i++)
+            filter[i] = static_cast<int16_t>(h[i] / sum * 32768 + (h[i] < 0 ? -.5 : .5));
+        return filter;
+    }
+
+    constexpr auto filter2 = design<2>();
+    constexpr auto filter4 = design<4>();
+    constexpr auto filter8 = design<8>();
+}
+
+// The filter and its state are used by the unprivileged conversion thread.
+__attribute__((section(".convdata")))
+unsigned int Multirate::m_factor = 1;
+__attribute__((section(".convdata")))
+int16_t Multirate::m_filter[MAX_TAPS] = {};
+__attribute__((section(".convdata")))
+int16_t Multirate::m_delay[MAX_CHANNELS][MAX_TAPS] = {};
+__attribute__((section(".convdata")))
+unsigned int Multirate::m_delay_pos = 0;
+__attribute__((section(".convdata")))
+int16_t Multirate::m_history[MAX_CHANNELS][TAPS_PER_PHASE - 1] = {};
+
+bool Multirate::setFactor(unsigned int factor)
+{
+    // .convdata is not loaded at startup, so the chosen filter is copied in.
+    const int16_t *filter;
+    switch (factor) {
+    case 1:
+        filter = nullptr;
+        break;
+    case 2:
+        filter = filter2.data();
+        break;
+    case 4:
+        filter = filter4.data();
+        break;
+    case 8:
+        filter = filter8.data();
+        break;
+    default:
+        return false;
+    }
+
+    m_factor = factor;
+    if (filter != nullptr)
+        std::copy(filter, filter + factor * TAPS_PER_PHASE, m_filter);
+    reset();
+    return true;
+}
+
+__attribute__((section(".convcode")))
+unsigned int Multirate::factor()
+{
+    return m_factor;
+}
+
+void Multirate::reset()
+{
+    std::fill(&m_delay[0][0], &m_delay[0][0] + MAX_CHANNELS * MAX_TAPS, 0);
+    std::fill(&m_history[0][0], &m_history[0][0] + MAX_CHANNELS * (TAPS_PER_PHASE - 1), 0);
+    m_delay_pos = 0;
+}
+
+// Rounds a Q15 filter result back to a sample of the given bits, saturating.
+__attribute__((section(".convcode")))
+static inline Sample toSample(int32_t acc, unsigned int bits = 12)
+{
+    const int32_t mid = 1 << (bits - 1);
+    int32_t s = ((acc + (1 << 14)) >> 15) + mid;
+    s = s > 0 ? s : 0;
+    s = s < 2 * mid - 1 ? s : 2 * mid - 1;
+    return static_cast<Sample>(s);
+}
+
+__attribute__((section(".convcode")))
+void Multirate::decimate(Sample *samples, unsigned int frames, unsigned int channels,
+                         unsigned int bits)
+{
+    const unsigned int taps = m_factor * TAPS_PER_PHASE;
+    const int mid = 1 << (bits - 1);
+    const Sample *in = samples;
+    auto pos = m_delay_pos;
+
+    // Output frame i is written once the input up to frame (i + 1) * factor
+    // has been read, and later outputs read only beyond that, so the work
+    // can be done in place.
+    for (unsigned int i = 0; i < frames; i++) {
+        for (unsigned int j = 0; j < m_factor; j++) {
+            for (unsigned int c = 0; c < channels; c++)
+                m_delay[c][pos] = static_cast<int16_t>(in[c] - mid);
+            in += channels;
+            if (++pos == taps)
+                pos = 0;
+        }
+
+        // pos is now the oldest sample. The filter is symmetric, so it can
+        // be applied from the oldest sample to the newest.
+        for (unsigned int c = 0; c < channels; c++) {
+            const int16_t *line = m_delay[c];
+            int32_t acc = 0;
+            unsigned int k = 0;
+            for (unsigned int p = pos; p < taps; p++)
+                acc += m_filter[k++] * line[p];
+            for (unsigned int p = 0; p < pos; p++)
+                acc += m_filter[k++] * line[p];
+            samples[i * channels + c] = toSample(acc, bits);
+        }
+    }
+
+    m_delay_pos = pos;
+}
+
+__attribute__((section(".convcode")))
+void Multirate::interpolate(Sample *samples, unsigned int frames, unsigned int channel)
+{
+    constexpr unsigned int history_size = TAPS_PER_PHASE - 1;
+    const unsigned int factor = m_factor;
+    int16_t *history = m_history[channel];
+
+    // The next history is taken now, as these samples are about to be
+    // overwritten while the current history is still in use.
+    int16_t next[history_size];
+    for (unsigned int t = 0; t < history_size; t++) {
+        next[t] = t < frames ? static_cast<int16_t>(samples[frames - 1 - t] - 2048)
+                             : history[t - frames];
+    }
+
+    // Outputs are made from last to first, so that each input is only
+    // overwritten once no earlier output needs it. Output j is input j /
+    // factor through phase j % factor of the filter, scaled up by the
+    // factor to make up for the samples that zero-stuffing would insert.
+    for (unsigned int j = frames * factor; j-- > 0;) {
+        const unsigned int m = j / factor;
+        const int16_t *h = m_filter + j % factor;
+        int32_t acc = 0;
+        for (unsigned int t = 0; t < TAPS_PER_PHASE; t++, h += factor) {
+            const int32_t x = t <= m ? samples[m - t] - 2048 : history[t - m - 1];
+            acc += *h * x;
+        }
+        samples[j] = toSample(acc * static_cast<int32_t>(factor));
+    }
+
+    for (unsigned int t = 0; t < history_size; t++)
+        history[t] = next[t];
+}
+
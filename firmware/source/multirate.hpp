@@ -0,0 +1,77 @@
+/**
+ * @file multirate.hpp
+ * @brief Decimates input and interpolates output, so that algorithms can run
+ *        at a fraction of the converter rate.
+ *
+ * Copyright (C) 2023 Clyne Sullivan
+ *
+ * Distributed under the GNU GPL v3 or later. You should have received a copy of
+ * the GNU General Public License along with this program.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STMDSP_MULTIRATE_HPP
+#define STMDSP_MULTIRATE_HPP
+
+#include "samplebuffer.hpp"
+
+#include <cstdint>
+
+/**
+ * Both directions use the same polyphase FIR low-pass filter, designed for
+ * the rate factor with its cutoff (-6 dB) at 0.4 of the algorithm's sample
+ * rate: it is flat to within 0.5 dB up to about 0.33 of that rate, down 3 dB
+ * at 0.375, and attenuates by at least 43 dB from half of it. The ADC and DAC
+ * run from the same trigger, so one factor applies to both.
+ */
+class Multirate
+{
+public:
+    // Factors are powers of two up to this.
+    static constexpr unsigned int MAX_FACTOR = 8;
+    // Filter taps for each output; a factor of D uses D times as many.
+    static constexpr unsigned int TAPS_PER_PHASE = 16;
+
+    /**
+     * Sets how many converter samples there are for each of the algorithm's
+     * samples, loading the filter for it and clearing the filter state.
+     * Returns false if the factor is not supported.
+     */
+    static bool setFactor(unsigned int factor);
+    static unsigned int factor();
+
+    // Clears the filter state, as when conversion starts.
+    static void reset();
+
+    // Internal only (called from the conversion thread):
+
+    /**
+     * Filters and decimates frames * factor() frames of interleaved input
+     * samples of the given bits (see ADC::sampleBits()) in place, leaving
+     * frames frames at the start of samples.
+     */
+    static void decimate(Sample *samples, unsigned int frames, unsigned int channels,
+                         unsigned int bits);
+
+    /**
+     * Interpolates the given channel's frames 12-bit output samples in place,
+     * filling frames * factor() samples.
+     */
+    static void interpolate(Sample *samples, unsigned int frames, unsigned int channel);
+
+private:
+    static constexpr unsigned int MAX_TAPS = MAX_FACTOR * TAPS_PER_PHASE;
+
+    static unsigned int m_factor;
+    static int16_t m_filter[MAX_TAPS];
+
+    // Decimator state: each channel's last taps input samples, as a ring.
+    static int16_t m_delay[MAX_CHANNELS][MAX_TAPS];
+    static unsigned int m_delay_pos;
+
+    // Interpolator state: each channel's last samples, newest first.
+    static int16_t m_history[MAX_CHANNELS][TAPS_PER_PHASE - 1];
+};
+
+#endif // STMDSP_MULTIRATE_HPP
+
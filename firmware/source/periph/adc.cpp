@@ -10,6 +10,16 @@
  */
 
 #include "adc.hpp"
+#include "trace.hpp"
+
+// The second signal input, scanned after the first (IN5) for two channels.
+#if defined(TARGET_PLATFORM_H7)
+#define ADC_SECOND_CHANNEL         ADC_CHANNEL_IN9
+#define ADC_SMPR1_SMP_SECOND(smp)  ADC_SMPR1_SMP_AN9(smp)
+#else
+#define ADC_SECOND_CHANNEL         ADC_CHANNEL_IN6
+#define ADC_SMPR1_SMP_SECOND(smp)  ADC_SMPR1_SMP_AN6(smp)
+#endif
 
 #if defined(TARGET_PLATFORM_L4)
 ADCDriver *ADC::m_driver = &ADCD1;
@@ -62,11 +72,66 @@ ADCConversionGroup ADC::m_group_config = {
     },
 };
 
-static bool readAltDone = false;
+// Eight triggers take 8ms at the slowest rate (see SClock::MIN_RATE).
+constexpr sysinterval_t READ_ALT_TIMEOUT = TIME_MS2I(20);
+// PLLs lock within a few hundred microseconds.
+constexpr sysinterval_t PLL_TIMEOUT = TIME_MS2I(2);
+
+// Each conversion of the "alt" inputs scans both of them eight times; the
+// first scan's values are kept.
+static adcsample_t altResult[16] = {};
+static adcsample_t altLast[2] = {};
+static binary_semaphore_t readAltDone;
 static void readAltCallback(ADCDriver *)
 {
-    readAltDone = true;
+    chSysLockFromISR();
+    altLast[0] = altResult[0];
+    altLast[1] = altResult[1];
+    chBSemSignalI(&readAltDone);
+    chSysUnlockFromISR();
+}
+
+// Sleeps until the given RCC->CR bits are all set, or all clear, so that the
+// caller's thread yields while a PLL starts or stops. Returns false if this
+// takes longer than timeout.
+static bool waitForClock(uint32_t bits, bool set, sysinterval_t timeout)
+{
+    const auto start = chVTGetSystemTime();
+    while (((RCC->CR & bits) == bits) != set) {
+        if (chVTTimeElapsedSinceX(start) > timeout)
+            return false;
+        chThdSleep(1);
+    }
+
+    return true;
+}
+
+// Stops the PLL with the given CR bits, changes the masked bits of its
+// configuration register to bits, and restarts it. If it does not lock, its
+// previous configuration is put back and restarted, so that the ADC keeps a
+// clock. Returns false in that case.
+static bool reconfigurePLL(volatile uint32_t *cfgr, uint32_t mask, uint32_t bits,
+                           uint32_t on, uint32_t ready)
+{
+    const uint32_t previous = *cfgr;
+
+    RCC->CR &= ~on;
+    if (waitForClock(ready, false, PLL_TIMEOUT)) {
+        *cfgr = (previous & ~mask) | bits;
+        RCC->CR |= on;
+        if (waitForClock(ready, true, PLL_TIMEOUT))
+            return true;
+
+        RCC->CR &= ~on;
+        waitForClock(ready, false, PLL_TIMEOUT);
+        *cfgr = previous;
+    }
+
+    RCC->CR |= on;
+    waitForClock(ready, true, PLL_TIMEOUT);
+    return false;
 }
+
 ADCConversionGroup ADC::m_group_config2 = {
     .circular = false,
     .num_channels = 2,
@@ -99,17 +164,25 @@ ADCConversionGroup ADC::m_group_config2 = {
 adcsample_t *ADC::m_current_buffer = nullptr;
 size_t ADC::m_current_buffer_size = 0;
 ADC::Operation ADC::m_operation = nullptr;
+uint32_t ADC::m_sample_time = ADC_SMPR_SMP_12P5;
+unsigned int ADC::m_rate = 0;
+unsigned int ADC::m_oversampling_ratio = ADC::DEFAULT_OVERSAMPLING_RATIO;
+unsigned int ADC::m_oversampling_shift = ADC::DEFAULT_OVERSAMPLING_SHIFT;
 
 void ADC::begin()
 {
 #if defined(TARGET_PLATFORM_H7)
     palSetPadMode(GPIOF, 3, PAL_MODE_INPUT_ANALOG);
+    palSetPadMode(GPIOF, 4, PAL_MODE_INPUT_ANALOG); // Second channel in
 #else
     palSetPadMode(GPIOA, 0, PAL_MODE_INPUT_ANALOG); // Algorithm in
+    palSetPadMode(GPIOA, 1, PAL_MODE_INPUT_ANALOG); // Second channel in
     palSetPadMode(GPIOC, 0, PAL_MODE_INPUT_ANALOG); // Potentiometer 1
     palSetPadMode(GPIOC, 1, PAL_MODE_INPUT_ANALOG); // Potentiometer 2
 #endif
 
+    chBSemObjectInit(&readAltDone, true);
+    applyOversampling();
     adcStart(m_driver, &m_config);
     adcStart(m_driver2, &m_config2);
 }
@@ -120,7 +193,9 @@ void ADC::start(adcsample_t *buffer, size_t count, Operation operation)
     m_current_buffer_size = count;
     m_operation = operation;
 
-    adcStartConversion(m_driver, &m_group_config, buffer, count);
+    // The driver counts the buffer in scans of every channel.
+    adcStartConversion(m_driver, &m_group_config, buffer,
+                       count / m_group_config.num_channels);
     SClock::start();
 }
 
@@ -138,93 +213,273 @@ adcsample_t ADC::readAlt(unsigned int id)
 {
     if (id > 1)
         return 0;
-    static adcsample_t result[16] = {};
-    readAltDone = false;
-    adcStartConversion(m_driver2, &m_group_config2, result, 8);
-    while (!readAltDone);
-        //__WFI();
-    adcStopConversion(m_driver2);
-    return result[id];
+
+    // The conversions follow SClock's triggers, so this thread sleeps until
+    // they are done (joining one that refreshAlt() started). Without
+    // triggers (e.g. while stopped), the last values are given instead.
+    chBSemReset(&readAltDone, true);
+    refreshAlt();
+    if (chBSemWaitTimeout(&readAltDone, READ_ALT_TIMEOUT) != MSG_OK)
+        adcStopConversion(m_driver2);
+    return altLast[id];
+}
+
+void ADC::readAltLatest(adcsample_t values[2])
+{
+    chSysLock();
+    values[0] = altLast[0];
+    values[1] = altLast[1];
+    chSysUnlock();
+
+    refreshAlt();
+}
+
+void ADC::refreshAlt()
+{
+    chSysLock();
+    if (m_driver2->state == ADC_READY)
+        adcStartConversionI(m_driver2, &m_group_config2, altResult, 8);
+    chSysUnlock();
+}
+
+bool ADC::setChannels(unsigned int channels)
+{
+    const auto previous = m_group_config.num_channels;
+    scanChannels(channels);
+
+    // More conversions per trigger may need a faster ADC clock.
+    if (m_rate != 0 && !setRate(m_rate)) {
+        scanChannels(previous);
+        return false;
+    }
+
+    return true;
+}
+
+bool ADC::setOversampling(unsigned int ratio, unsigned int shift)
+{
+    const auto bits = 12 + ratio - shift;
+    if (ratio > MAX_OVERSAMPLING || shift > ratio || bits > 16)
+        return false;
+
+    const auto previous_ratio = m_oversampling_ratio;
+    const auto previous_shift = m_oversampling_shift;
+    m_oversampling_ratio = ratio;
+    m_oversampling_shift = shift;
+    applyOversampling();
+
+    if (m_rate != 0 && !setRate(m_rate)) {
+        m_oversampling_ratio = previous_ratio;
+        m_oversampling_shift = previous_shift;
+        applyOversampling();
+        return false;
+    }
+
+    return true;
 }
 
-void ADC::setRate(SClock::Rate rate)
+unsigned int ADC::oversamplingRatio()
 {
+    return m_oversampling_ratio;
+}
+
+unsigned int ADC::oversamplingShift()
+{
+    return m_oversampling_shift;
+}
+
+unsigned int ADC::sampleBits()
+{
+    return 12 + m_oversampling_ratio - m_oversampling_shift;
+}
+
+void ADC::scanChannels(unsigned int channels)
+{
+    if (channels == 2) {
+        m_group_config.num_channels = 2;
+        m_group_config.sqr[0] = ADC_SQR1_SQ1_N(ADC_CHANNEL_IN5) |
+                                ADC_SQR1_SQ2_N(ADC_SECOND_CHANNEL);
+    } else {
+        m_group_config.num_channels = 1;
+        m_group_config.sqr[0] = ADC_SQR1_SQ1_N(ADC_CHANNEL_IN5);
+    }
+
+    m_group_config.smpr[0] = ADC_SMPR1_SMP_AN5(m_sample_time) |
+                             ADC_SMPR1_SMP_SECOND(m_sample_time);
+    applyOversampling();
+}
+
+bool ADC::setRate(unsigned int rate)
+{
+    // The ADC clock must leave time for every conversion made on a trigger,
+    // each taking its sample time plus 12.5 cycles. The longest sample time
+    // that fits is used, with the slowest clock that fits it.
+    struct SampleTime {
+        uint32_t smp;
+        uint32_t halfCycles; // Sample time plus conversion, in half cycles.
+    };
+
 #if defined(TARGET_PLATFORM_H7)
-    std::array<std::array<uint32_t, 2>, 6> m_rate_presets = {{
-         // Rate   PLL N  PLL P
-        {/* 8k  */ 80,    20},
-        {/* 16k */ 80,    10},
-        {/* 20k */ 80,    8},
-        {/* 32k */ 80,    5},
-        {/* 48k */ 96,    4},
-        {/* 96k */ 288,   10}
+    // PLL2 sources HSI / 8 / PLL2M (4) = 2MHz, multiplied by N into a VCO
+    // kept between 150 and 420 MHz, then divided by P (1 to 128) for the ADC
+    // kernel clock. The ADC then divides that by 10:
+    //
+    // 2MHz * N / P / 10 = ADC clock.
+    //
+    // Time is left for four conversions for each oversampled sample: both
+    // channels, twice over.
+    const uint32_t conversions = 4u << m_oversampling_ratio;
+    constexpr std::array<SampleTime, 2> sampleTimes {{
+        {ADC_SMPR_SMP_12P5, 50},
+        {ADC_SMPR_SMP_2P5, 30}
     }};
 
-    auto& preset = m_rate_presets[static_cast<unsigned int>(rate)];
-    auto pllbits = (preset[0] << RCC_PLL2DIVR_N2_Pos) |
-                   (preset[1] << RCC_PLL2DIVR_P2_Pos);
+    uint32_t best_n = 0, best_p = 0, best_clock = UINT32_MAX;
+    uint32_t smp = sampleTimes.back().smp;
+    for (const auto& st : sampleTimes) {
+        // With heavy oversampling, this can pass 32 bits.
+        const uint64_t needed = static_cast<uint64_t>(rate) * conversions * st.halfCycles / 2;
+        for (uint32_t p = 1; p <= 128; p++) {
+            // Smallest N giving at least the needed clock.
+            const uint64_t min_n = (needed * p + 199999) / 200000;
+            if (min_n > 210)
+                continue;
+            const uint32_t n = min_n < 75 ? 75 : static_cast<uint32_t>(min_n);
+            const uint32_t clock = 200000 * n / p;
+            if (clock < best_clock) {
+                best_clock = clock;
+                best_n = n;
+                best_p = p;
+            }
+        }
+        if (best_n != 0) {
+            smp = st.smp;
+            break;
+        }
+    }
+    if (best_n == 0)
+        return false;
+
+    auto pllbits = ((best_n - 1) << RCC_PLL2DIVR_N2_Pos) |
+                   ((best_p - 1) << RCC_PLL2DIVR_P2_Pos);
 
     adcStop(m_driver);
 
     // Adjust PLL2
-    RCC->CR &= ~(RCC_CR_PLL2ON);
-    while ((RCC->CR & RCC_CR_PLL2RDY) == RCC_CR_PLL2RDY);
-    auto pll2divr = RCC->PLL2DIVR &
-                    ~(RCC_PLL2DIVR_N2_Msk | RCC_PLL2DIVR_P2_Msk);
-    pll2divr |= pllbits;
-    RCC->PLL2DIVR = pll2divr;
-    RCC->CR |= RCC_CR_PLL2ON;
-    while ((RCC->CR & RCC_CR_PLL2RDY) != RCC_CR_PLL2RDY);
-
-    m_group_config.smpr[0] = rate != SClock::Rate::R96K ? ADC_SMPR1_SMP_AN5(ADC_SMPR_SMP_12P5)
-                                                        : ADC_SMPR1_SMP_AN5(ADC_SMPR_SMP_2P5);
+    const bool locked = reconfigurePLL(&RCC->PLL2DIVR,
+                                       RCC_PLL2DIVR_N2_Msk | RCC_PLL2DIVR_P2_Msk,
+                                       pllbits, RCC_CR_PLL2ON, RCC_CR_PLL2RDY);
+    if (locked) {
+        m_sample_time = smp;
+        m_group_config.smpr[0] = ADC_SMPR1_SMP_AN5(m_sample_time) |
+                                 ADC_SMPR1_SMP_SECOND(m_sample_time);
+    }
 
     adcStart(m_driver, &m_config);
+    if (!locked)
+        return false;
 #elif defined(TARGET_PLATFORM_L4)
-    std::array<std::array<uint32_t, 3>, 6> m_rate_presets = {{
-        // PLLSAI2 sources MSI of 4MHz, divided by PLLM of /1 = 4MHz.
-        // 4MHz is then multiplied by PLLSAI2N (x8 to x86), with result
-        // between 64 and 344 MHz.
-        //
-        // SAI2N MUST BE AT LEAST 16 TO MAKE 64MHz MINIMUM.
-        //
-        // That is then divided by PLLSAI2R:
-        //     R of 0 = /2; 1 = /4, 2 = /6, 3 = /8.
-        // PLLSAI2 then feeds into the ADC, which has a prescaler of /10.
-        // Finally, the ADC's SMP value produces the desired sample rate.
-        //
-        // 4MHz * N / R / 10 / SMP = sample rate.
-        //
-        // With oversampling, must create faster clock
-        // (x2 oversampling requires x2 sample rate clock).
-        //
-        //  Rate   PLLSAI2N  R  SMPR
-        {/* 8k  */ 16,       1, ADC_SMPR_SMP_12P5}, // R3=32k (min), R1=64k
-        {/* 16k */ 16,       0, ADC_SMPR_SMP_12P5},
-        {/* 20k */ 20,       0, ADC_SMPR_SMP_12P5},
-        {/* 32k */ 32,       0, ADC_SMPR_SMP_12P5},
-        {/* 48k */ 48,       0, ADC_SMPR_SMP_12P5},
-        {/* 96k */ 73,       0, ADC_SMPR_SMP_6P5}   // Technically 96.05263kS/s
+    // PLLSAI2 sources MSI of 4MHz, divided by PLLM of /1 = 4MHz.
+    // 4MHz is then multiplied by PLLSAI2N (x16 to x86, for a result between
+    // 64 and 344 MHz), then divided by PLLSAI2R:
+    //     R of 0 = /2; 1 = /4, 2 = /6, 3 = /8.
+    // PLLSAI2 then feeds into the ADC, which has a prescaler of /10:
+    //
+    // 4MHz * N / R / 10 = ADC clock.
+    //
+    // Time is left for every channel's oversampling (see applyOversampling()).
+    const uint32_t conversions = m_group_config.num_channels << effectiveRatio();
+    constexpr std::array<SampleTime, 3> sampleTimes {{
+        {ADC_SMPR_SMP_12P5, 50},
+        {ADC_SMPR_SMP_6P5, 38},
+        {ADC_SMPR_SMP_2P5, 30}
     }};
 
-    auto& preset = m_rate_presets[static_cast<int>(rate)];
-    auto pllnr = (preset[0] << RCC_PLLSAI2CFGR_PLLSAI2N_Pos) |
-                 (preset[1] << RCC_PLLSAI2CFGR_PLLSAI2R_Pos);
-    auto smpr = preset[2];
+    uint32_t best_n = 0, best_r = 0, best_clock = UINT32_MAX;
+    uint32_t smp = sampleTimes.back().smp;
+    for (const auto& st : sampleTimes) {
+        // With heavy oversampling, this can pass 32 bits.
+        const uint64_t needed = static_cast<uint64_t>(rate) * conversions * st.halfCycles / 2;
+        for (uint32_t r = 0; r < 4; r++) {
+            // Smallest N giving at least the needed clock.
+            const uint32_t div = 2 * (r + 1);
+            const uint64_t min_n = (needed * div + 399999) / 400000;
+            if (min_n > 86)
+                continue;
+            const uint32_t n = min_n < 16 ? 16 : static_cast<uint32_t>(min_n);
+            const uint32_t clock = 400000 * n / div;
+            if (clock < best_clock) {
+                best_clock = clock;
+                best_n = n;
+                best_r = r;
+            }
+        }
+        if (best_n != 0) {
+            smp = st.smp;
+            break;
+        }
+    }
+    if (best_n == 0)
+        return false;
+
+    auto pllnr = (best_n << RCC_PLLSAI2CFGR_PLLSAI2N_Pos) |
+                 (best_r << RCC_PLLSAI2CFGR_PLLSAI2R_Pos);
 
     // Adjust PLLSAI2
-    RCC->CR &= ~(RCC_CR_PLLSAI2ON);
-    while ((RCC->CR & RCC_CR_PLLSAI2RDY) == RCC_CR_PLLSAI2RDY);
-    RCC->PLLSAI2CFGR = (RCC->PLLSAI2CFGR & ~(RCC_PLLSAI2CFGR_PLLSAI2N_Msk | RCC_PLLSAI2CFGR_PLLSAI2R_Msk)) | pllnr;
-    RCC->CR |= RCC_CR_PLLSAI2ON;
-    while ((RCC->CR & RCC_CR_PLLSAI2RDY) != RCC_CR_PLLSAI2RDY);
+    if (!reconfigurePLL(&RCC->PLLSAI2CFGR,
+                        RCC_PLLSAI2CFGR_PLLSAI2N_Msk | RCC_PLLSAI2CFGR_PLLSAI2R_Msk,
+                        pllnr, RCC_CR_PLLSAI2ON, RCC_CR_PLLSAI2RDY))
+    {
+        return false;
+    }
 
-    m_group_config.smpr[0] = ADC_SMPR1_SMP_AN5(smpr);
+    m_sample_time = smp;
+    m_group_config.smpr[0] = ADC_SMPR1_SMP_AN5(m_sample_time) |
+                             ADC_SMPR1_SMP_SECOND(m_sample_time);
 
-    // 8x oversample
-    m_group_config.cfgr2 = ADC_CFGR2_ROVSE | (2 << ADC_CFGR2_OVSR_Pos) | (3 << ADC_CFGR2_OVSS_Pos);
+    // The knobs are read with 8x oversampling.
     m_group_config2.cfgr2 = ADC_CFGR2_ROVSE | (2 << ADC_CFGR2_OVSR_Pos) | (3 << ADC_CFGR2_OVSS_Pos);
 #endif
+
+    m_rate = rate;
+    return true;
+}
+
+unsigned int ADC::effectiveRatio()
+{
+#if defined(TARGET_PLATFORM_L4)
+    // The default leaves the same eight conversions per trigger for two
+    // channels by oversampling each 4x instead, still down to 12 bits.
+    if (m_group_config.num_channels == 2 &&
+        m_oversampling_ratio == DEFAULT_OVERSAMPLING_RATIO &&
+        m_oversampling_shift == DEFAULT_OVERSAMPLING_SHIFT)
+    {
+        return m_oversampling_ratio - 1;
+    }
+#endif
+
+    return m_oversampling_ratio;
+}
+
+void ADC::applyOversampling()
+{
+    const auto ratio = effectiveRatio();
+    const auto shift = m_oversampling_shift - (m_oversampling_ratio - ratio);
+    if (ratio == 0) {
+        m_group_config.cfgr2 = 0;
+        return;
+    }
+
+    // Both encode a ratio of 2^(n + 1) as n. The H7 samples with ADC3, its
+    // 12-bit converter, whose fields are laid out unlike ADC1/2's.
+    const uint32_t ovsr = ratio - 1;
+#if defined(TARGET_PLATFORM_L4)
+    m_group_config.cfgr2 = ADC_CFGR2_ROVSE | (ovsr << ADC_CFGR2_OVSR_Pos) |
+                           (shift << ADC_CFGR2_OVSS_Pos);
+#else
+    m_group_config.cfgr2 = ADC3_CFGR2_ROVSE | (ovsr << ADC3_CFGR2_OVSR_Pos) |
+                           (shift << ADC3_CFGR2_OVSS_Pos);
+#endif
 }
 
 void ADC::setOperation(ADC::Operation operation)
@@ -234,6 +489,14 @@ void ADC::setOperation(ADC::Operation operation)
 
 void ADC::conversionCallback(ADCDriver *driver)
 {
+    Trace::record(Trace::Event::AdcBlock, adcIsBufferComplete(driver) ? 1 : 0);
+
+    // Invalidate the whole buffer: the completed half must be re-read from
+    // memory, and any lines left dirty by the algorithm in the half that the
+    // DMA is now filling must be dropped before they can be written back.
+    cacheBufferInvalidate(m_current_buffer,
+                          m_current_buffer_size * sizeof(adcsample_t));
+
     if (m_operation != nullptr) {
         auto half_size = m_current_buffer_size / 2;
         if (adcIsBufferComplete(driver))
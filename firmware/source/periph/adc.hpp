@@ -22,6 +22,16 @@ class ADC
 public:
     using Operation = void (*)(adcsample_t *buffer, size_t count);
 
+    // Largest oversampling ratio, as a power of two (256x).
+    static constexpr unsigned int MAX_OVERSAMPLING = 8;
+#if defined(TARGET_PLATFORM_L4)
+    static constexpr unsigned int DEFAULT_OVERSAMPLING_RATIO = 3;
+    static constexpr unsigned int DEFAULT_OVERSAMPLING_SHIFT = 3;
+#else
+    static constexpr unsigned int DEFAULT_OVERSAMPLING_RATIO = 0;
+    static constexpr unsigned int DEFAULT_OVERSAMPLING_SHIFT = 0;
+#endif
+
     /**
      * Initializes analog input pins and the microcontoller's ADC peripheral.
      */
@@ -43,15 +53,59 @@ public:
 
     /**
      * Runs a single conversion on the "alt" inputs (parameter knobs).
+     * The calling thread sleeps until the conversion is done; if SClock
+     * is not running, the last read value is returned after a timeout.
      * @param id The ID of the desired "alt" input (zero or one).
      * @return The sampled value for the given input.
      */
     static adcsample_t readAlt(unsigned int id);
 
     /**
-     * Sets the desired sampling rate for the ADC to operate at.
+     * Gives the values of both "alt" inputs from the last completed
+     * conversion without waiting, then calls refreshAlt() so that the next
+     * call has newer values.
+     * @param values Receives the first and second input's values.
+     */
+    static void readAltLatest(adcsample_t values[2]);
+
+    /**
+     * Starts a conversion of the "alt" inputs, if one is not already
+     * running, and returns. It completes over SClock's next triggers.
+     */
+    static void refreshAlt();
+
+    /**
+     * Sets how many inputs are scanned on each trigger (one or two). Samples
+     * are then interleaved in the buffer given to start(). Returns false,
+     * leaving the channels as they were, if the conversions would no longer
+     * keep up with the rate. Only call this while stopped.
      */
-    static void setRate(SClock::Rate rate);
+    static bool setChannels(unsigned int channels);
+
+    /**
+     * Sets the ADC clock and sample time for triggers at the given rate, in
+     * Hz (see SClock::setRate()). Returns false, changing nothing, if the
+     * ADC cannot make the conversions that each trigger needs in time.
+     * Also returns false if the ADC's PLL does not lock at the new rate; the
+     * previous rate is then put back. Only call this while stopped.
+     */
+    static bool setRate(unsigned int rate);
+
+    /**
+     * Sets the hardware oversampling of the signal inputs: each sample is the
+     * sum of 2^ratio conversions shifted right by shift bits, so samples have
+     * 12 + ratio - shift bits (12 to 16). With no shift, ratios of 4x to 16x
+     * give 14 to 16-bit samples. Returns false, changing nothing, if the
+     * result would not fit or the conversions would not keep up with the
+     * rate. Only call this while stopped.
+     */
+    static bool setOversampling(unsigned int ratio, unsigned int shift);
+    static unsigned int oversamplingRatio();
+    static unsigned int oversamplingShift();
+
+    // Bits in each input sample, as set by setOversampling(); 2^(bits - 1)
+    // is 0V.
+    static unsigned int sampleBits();
 
     /**
      * Used to override the handler function for the currently running
@@ -73,6 +127,14 @@ private:
     static adcsample_t *m_current_buffer;
     static size_t m_current_buffer_size;
     static Operation m_operation;
+    static uint32_t m_sample_time;
+    static unsigned int m_rate;
+    static unsigned int m_oversampling_ratio;
+    static unsigned int m_oversampling_shift;
+
+    static void scanChannels(unsigned int channels);
+    static unsigned int effectiveRatio();
+    static void applyOversampling();
 
 public:
     static void conversionCallback(ADCDriver *);
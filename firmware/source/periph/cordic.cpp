@@ -12,9 +12,109 @@
 #include "cordic.hpp"
 #include "hal.h"
 
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+
+namespace cordic {
+
+constexpr float Q31_SCALE = 2147483648.f;
+constexpr float PIf = static_cast<float>(PI);
+constexpr float LN2 = 0.693147181f;
+
+// Converts to Q31, saturating values outside of [-1, 1).
+static int32_t floatToQ31(float x)
+{
+    if (!(x < 1.f)) // Also catches NaN.
+        return INT32_MAX;
+    else if (x <= -1.f)
+        return INT32_MIN;
+    else
+        return static_cast<int32_t>(x * Q31_SCALE);
+}
+
+static float q31ToFloat(int32_t q)
+{
+    return static_cast<float>(q) * (1.f / Q31_SCALE);
+}
+
+// Wraps an angle in radians to [-pi, pi) and scales it by 1/pi.
+template<typename T>
+static T normalizeAngle(T x)
+{
+    T t = x * static_cast<T>(1. / PI) + 1;
+    return t - 2 * std::floor(t / 2) - 1;
+}
+
+// Reference implementations, used where the CORDIC is unavailable or out
+// of range. Two-argument functions take (x, y) as (a, b).
+static float software(uint32_t func, float a, float b)
+{
+    switch (func) {
+    case Sin:       return std::sin(a);
+    case Cos:       return std::cos(a);
+    case Tan:       return std::tan(a);
+    case Atan2:     return std::atan2(b, a);
+    case Magnitude: return std::hypot(a, b);
+    case Atan:      return std::atan(a);
+    case Sqrt:      return std::sqrt(a);
+    case Sinh:      return std::sinh(a);
+    case Cosh:      return std::cosh(a);
+    case Atanh:     return std::atanh(a);
+    case Log:       return std::log(a);
+    case Exp:       return std::exp(a);
+    default:        return 0.f;
+    }
+}
+
+unsigned int argumentCount(uint32_t func)
+{
+    switch (func & ~Q31) {
+    case Sin:
+    case Cos:
+    case Tan:
+    case Atan:
+    case Sqrt:
+    case Sinh:
+    case Cosh:
+    case Atanh:
+    case Log:
+    case Exp:
+        return 1;
+    case Atan2:
+    case Magnitude:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+}
+
 #if !defined(TARGET_PLATFORM_L4)
 namespace cordic {
 
+// Hardware function numbers (CORDIC_CSR_FUNC).
+constexpr uint32_t FUNC_COS = 0;
+constexpr uint32_t FUNC_SIN = 1;
+constexpr uint32_t FUNC_PHASE = 2;
+constexpr uint32_t FUNC_MODULUS = 3;
+constexpr uint32_t FUNC_COSH = 5;
+constexpr uint32_t FUNC_SINH = 6;
+constexpr uint32_t FUNC_ATANH = 7;
+constexpr uint32_t FUNC_LN = 8;
+
+// The hyperbolic functions and ln take their argument scaled by 2^-SCALE.
+constexpr uint32_t SCALE_1 = 1 << CORDIC_CSR_SCALE_Pos;
+
+// Argument limits of the hyperbolic functions (at a scale of one).
+constexpr float HYPERBOLIC_LIMIT = 1.118f;
+constexpr float ATANH_LIMIT = 0.806f;
+
+// Six iterations of four: about 2^-19 of error in 6 cycles.
+constexpr uint32_t PRECISION = 6 << CORDIC_CSR_PRECISION_Pos;
+
 void init()
 {
     RCC->AHB2ENR |= RCC_AHB2ENR_CORDICEN;
@@ -22,91 +122,258 @@ void init()
 
 static void prepare() {
     while (CORDIC->CSR & CORDIC_CSR_RRDY)
-        asm("mov r0, %0" :: "r" (CORDIC->RDATA));
+        (void)CORDIC->RDATA;
 }
 
-static uint32_t dtoq(double) {
-    uint32_t res;
-    asm("vcvt.s32.f64 d0, d0, #31;"
-        "vmov %0, r5, d0"
-    : "=r" (res));
-    return res;
+static void writeArg(int32_t arg) {
+    CORDIC->WDATA = static_cast<uint32_t>(arg);
 }
-__attribute__((naked))
-static double qtod(uint32_t) {
-    asm("eor r1, r1;"
-        "vmov d0, r0, r1;"
-        "vcvt.f64.s32 d0, d0, #31;"
-        "bx lr");
-    return 0;
-}
-__attribute__((naked))
-double mod(double, double) {
-    asm("vdiv.f64   d2, d0, d1;"
-        "vrintz.f64 d2;"
-        "vmul.f64   d1, d1, d2;"
-        "vsub.f64   d0, d0, d1;"
-        "bx lr");
-    return 0;
+
+static void writeArgs(int32_t arg1, int32_t arg2) {
+    CORDIC->WDATA = static_cast<uint32_t>(arg1);
+    CORDIC->WDATA = static_cast<uint32_t>(arg2);
 }
 
-double cos(double x) {
-    x = mod(x, 2 * math::PI) / math::PI;
-    auto input = dtoq(x > 1. ? x - 2 : x);
+// Reading before the result is ready stalls the bus until it is.
+static int32_t readResult() {
+    return static_cast<int32_t>(CORDIC->RDATA);
+}
 
+/**
+ * Runs count calculations in "zero-overhead" mode: the arguments for the
+ * next calculation are written before the previous result is read, so the
+ * CORDIC never waits on the CPU.
+ * arg(i) writes the arguments for element i; res(i) reads its result(s).
+ */
+template<typename ArgFunc, typename ResFunc>
+static void pipeline(uint32_t csr, unsigned int count, ArgFunc arg, ResFunc res)
+{
     prepare();
-    CORDIC->CSR = CORDIC_CSR_NARGS | CORDIC_CSR_NRES |
-                  (6 << CORDIC_CSR_PRECISION_Pos) |
-                  (0 << CORDIC_CSR_FUNC_Pos);
+    CORDIC->CSR = csr;
 
-    CORDIC->WDATA = input;
-    CORDIC->WDATA = input;
-    while (!(CORDIC->CSR & CORDIC_CSR_RRDY));
+    arg(0);
+    for (unsigned int i = 1; i < count; ++i) {
+        arg(i);
+        res(i - 1);
+    }
+    res(count - 1);
+}
 
-    double cosx = qtod(CORDIC->RDATA) / x;
-    [[maybe_unused]] auto sinx = CORDIC->RDATA;
-    return cosx;
+// Returns e such that |x| = m * 2^e with m in [0.5, 1), limited to the
+// range that pow2() can represent.
+static int exponentOf(float x)
+{
+    const auto biased = static_cast<int>((std::bit_cast<uint32_t>(x) >> 23) & 0xFF);
+    return std::clamp(biased - 126, -125, 126);
 }
 
-double sin(double x) {
-    x = mod(x, 2 * math::PI) / math::PI;
-    auto input = dtoq(x > 1. ? x - 2 : x);
+// Returns 2^e for e in [-126, 127].
+static float pow2(int e)
+{
+    return std::bit_cast<float>(static_cast<uint32_t>(e + 127) << 23);
+}
 
+static int32_t calculate(uint32_t func, int32_t arg1, int32_t arg2, int32_t *res2 = nullptr)
+{
     prepare();
-    CORDIC->CSR = CORDIC_CSR_NARGS | CORDIC_CSR_NRES |
-                  (6 << CORDIC_CSR_PRECISION_Pos) |
-                  (1 << CORDIC_CSR_FUNC_Pos);
+    CORDIC->CSR = (func << CORDIC_CSR_FUNC_Pos) | PRECISION | CORDIC_CSR_NARGS |
+                  (res2 != nullptr ? CORDIC_CSR_NRES : 0);
+
+    writeArgs(arg1, arg2);
+    auto res = readResult();
+    if (res2 != nullptr)
+        *res2 = readResult();
+    return res;
+}
+
+double mod(double n, double d) {
+    return n - d * std::trunc(n / d);
+}
 
-    CORDIC->WDATA = input;
-    CORDIC->WDATA = input;
-    while (!(CORDIC->CSR & CORDIC_CSR_RRDY));
+static int32_t angleToQ31(double x) {
+    return floatToQ31(static_cast<float>(normalizeAngle(x)));
+}
 
-    double sinx = qtod(CORDIC->RDATA) / x;
-    [[maybe_unused]] auto cosx = CORDIC->RDATA;
-    return sinx;
+double cos(double x) {
+    return q31ToFloat(calculate(FUNC_COS, angleToQ31(x), INT32_MAX));
+}
+
+double sin(double x) {
+    return q31ToFloat(calculate(FUNC_SIN, angleToQ31(x), INT32_MAX));
 }
 
 double tan(double x) {
-    x = mod(x, 2 * math::PI) / math::PI;
-    auto input = dtoq(x > 1. ? x - 2 : x);
+    int32_t cosx;
+    auto sinx = calculate(FUNC_SIN, angleToQ31(x), INT32_MAX, &cosx);
+    return static_cast<double>(sinx) / static_cast<double>(cosx);
+}
 
-    prepare();
-    CORDIC->CSR = CORDIC_CSR_NARGS | CORDIC_CSR_NRES |
-                  (6 << CORDIC_CSR_PRECISION_Pos) |
-                  (1 << CORDIC_CSR_FUNC_Pos);
+bool batch(uint32_t func, const void *in, void *out, unsigned int count)
+{
+    const bool q31 = func & Q31;
+    func &= ~Q31;
+
+    if (func >= FunctionCount)
+        return false;
+    if (count == 0)
+        return true;
 
-    CORDIC->WDATA = input;
-    CORDIC->WDATA = input;
-    while (!(CORDIC->CSR & CORDIC_CSR_RRDY));
+    auto qin = static_cast<const int32_t *>(in);
+    auto qout = static_cast<int32_t *>(out);
+    auto fin = static_cast<const float *>(in);
+    auto fout = static_cast<float *>(out);
 
-    double sinx = qtod(CORDIC->RDATA) / x;
-    double tanx = sinx * x / qtod(CORDIC->RDATA);
-    return tanx;
+    // Element access for functions that are computed through floats.
+    auto load = [=](unsigned int i) { return q31 ? q31ToFloat(qin[i]) : fin[i]; };
+    auto store = [=](unsigned int i, float x) {
+        if (q31)
+            qout[i] = floatToQ31(x);
+        else
+            fout[i] = x;
+    };
+
+    // State carried from arg(i) to res(i); only one element is in flight.
+    float state[2] = {};
+    bool fallback[2] = {};
+
+    auto argAngle = [=](unsigned int i) {
+        writeArgs(q31 ? qin[i] : floatToQ31(normalizeAngle(fin[i])), INT32_MAX);
+    };
+
+    switch (func) {
+    case Sin:
+    case Cos:
+        {
+            const uint32_t csr = ((func == Sin ? FUNC_SIN : FUNC_COS) << CORDIC_CSR_FUNC_Pos) |
+                                 PRECISION | CORDIC_CSR_NARGS;
+            if (q31)
+                pipeline(csr, count, argAngle, [=](unsigned int i) { qout[i] = readResult(); });
+            else
+                pipeline(csr, count, argAngle, [=](unsigned int i) { fout[i] = q31ToFloat(readResult()); });
+        }
+        break;
+    case Tan:
+        {
+            const uint32_t csr = (FUNC_SIN << CORDIC_CSR_FUNC_Pos) | PRECISION |
+                                 CORDIC_CSR_NARGS | CORDIC_CSR_NRES;
+            pipeline(csr, count, argAngle, [=](unsigned int i) {
+                const auto sinx = static_cast<float>(readResult());
+                store(i, sinx / static_cast<float>(readResult()));
+            });
+        }
+        break;
+    case Atan2:
+    case Magnitude:
+        {
+            const uint32_t csr = ((func == Atan2 ? FUNC_PHASE : FUNC_MODULUS) << CORDIC_CSR_FUNC_Pos) |
+                                 PRECISION | CORDIC_CSR_NARGS;
+            if (q31) {
+                pipeline(csr, count,
+                    [=](unsigned int i) { writeArgs(qin[2 * i], qin[2 * i + 1]); },
+                    [=](unsigned int i) { qout[i] = readResult(); });
+            } else {
+                pipeline(csr, count,
+                    [&](unsigned int i) {
+                        // Scale both coordinates into [-0.5, 0.5) by the same
+                        // power of two, which keeps the magnitude below one.
+                        const auto x = fin[2 * i];
+                        const auto y = fin[2 * i + 1];
+                        const int e = exponentOf(std::max(std::fabs(x), std::fabs(y))) + 1;
+                        state[i & 1] = pow2(e);
+                        writeArgs(floatToQ31(x * pow2(-e)), floatToQ31(y * pow2(-e)));
+                    },
+                    [&](unsigned int i) {
+                        const auto r = q31ToFloat(readResult());
+                        fout[i] = func == Atan2 ? r * PIf : r * state[i & 1];
+                    });
+            }
+        }
+        break;
+    case Atan:
+        // atan(x) = atan2(x, 1), scaled as above.
+        pipeline((FUNC_PHASE << CORDIC_CSR_FUNC_Pos) | PRECISION | CORDIC_CSR_NARGS, count,
+            [=](unsigned int i) {
+                const auto x = load(i);
+                const auto s = pow2(-exponentOf(std::max(std::fabs(x), 1.f)) - 1);
+                writeArgs(floatToQ31(s), floatToQ31(x * s));
+            },
+            [=](unsigned int i) {
+                // The result is already scaled by 1/pi, like Q31 angles are.
+                const auto r = readResult();
+                if (q31)
+                    qout[i] = r;
+                else
+                    fout[i] = q31ToFloat(r) * PIf;
+            });
+        break;
+    case Sqrt:
+        for (unsigned int i = 0; i < count; ++i)
+            store(i, std::sqrt(load(i)));
+        break;
+    case Sinh:
+    case Cosh:
+    case Atanh:
+        {
+            const auto limit = func == Atanh ? ATANH_LIMIT : HYPERBOLIC_LIMIT;
+            const auto hwfunc = func == Sinh ? FUNC_SINH : func == Cosh ? FUNC_COSH : FUNC_ATANH;
+            pipeline((hwfunc << CORDIC_CSR_FUNC_Pos) | SCALE_1 | PRECISION, count,
+                [&](unsigned int i) {
+                    // The CORDIC takes x / 2 and returns the result halved.
+                    const auto x = load(i);
+                    fallback[i & 1] = !(std::fabs(x) < limit);
+                    if (fallback[i & 1])
+                        state[i & 1] = software(func, x, 0.f);
+                    writeArg(fallback[i & 1] ? 0 : floatToQ31(x * 0.5f));
+                },
+                [&](unsigned int i) {
+                    const auto r = q31ToFloat(readResult()) * 2.f;
+                    store(i, fallback[i & 1] ? state[i & 1] : r);
+                });
+        }
+        break;
+    case Log:
+        pipeline((FUNC_LN << CORDIC_CSR_FUNC_Pos) | SCALE_1 | PRECISION, count,
+            [&](unsigned int i) {
+                // With x = m * 2^e and m in [0.5, 1): ln(x) = ln(m) + e * ln(2).
+                // The CORDIC takes m / 2 and returns ln(m) / 4.
+                const auto x = load(i);
+                if (x > 0.f && std::isfinite(x)) {
+                    const int e = exponentOf(x);
+                    state[i & 1] = static_cast<float>(e) * LN2;
+                    writeArg(floatToQ31(x * pow2(-e - 1)));
+                } else {
+                    state[i & 1] = x == 0.f ? -INFINITY : x > 0.f ? INFINITY : NAN;
+                    writeArg(INT32_MAX / 2);
+                }
+            },
+            [&](unsigned int i) {
+                store(i, q31ToFloat(readResult()) * 4.f + state[i & 1]);
+            });
+        break;
+    case Exp:
+        pipeline((FUNC_SINH << CORDIC_CSR_FUNC_Pos) | SCALE_1 | PRECISION | CORDIC_CSR_NRES, count,
+            [&](unsigned int i) {
+                // With x = k * ln(2) + r: e^x = 2^k * (sinh(r) + cosh(r)), where
+                // |r| <= ln(2) / 2 is well within the CORDIC's range.
+                // x is limited so that the result stays a normal float.
+                const auto x = std::fmin(std::fmax(load(i), -87.f), 88.f);
+                const auto k = static_cast<int>(x * (1.f / LN2) + (x < 0.f ? -0.5f : 0.5f));
+                state[i & 1] = pow2(k);
+                writeArg(floatToQ31((x - static_cast<float>(k) * LN2) * 0.5f));
+            },
+            [&](unsigned int i) {
+                const auto sinhr = q31ToFloat(readResult());
+                const auto coshr = q31ToFloat(readResult());
+                store(i, (sinhr + coshr) * 2.f * state[i & 1]);
+            });
+        break;
+    }
+
+    return true;
 }
 
 }
 #else // L4
-#include <cmath>
 namespace cordic {
 
 void init() {}
@@ -119,6 +386,47 @@ float cos(float x) { return std::cos(x); }
 float sin(float x) { return std::sin(x); }
 float tan(float x) { return std::tan(x); }
 
+// Q31 formats scale these angles by 1/pi.
+static bool takesAngle(uint32_t func)
+{
+    return func == Sin || func == Cos || func == Tan;
+}
+
+static bool returnsAngle(uint32_t func)
+{
+    return func == Atan2 || func == Atan;
+}
+
+bool batch(uint32_t func, const void *in, void *out, unsigned int count)
+{
+    const bool q31 = func & Q31;
+    func &= ~Q31;
+
+    const auto args = argumentCount(func);
+    if (args == 0)
+        return false;
+
+    auto qin = static_cast<const int32_t *>(in);
+    auto qout = static_cast<int32_t *>(out);
+    auto fin = static_cast<const float *>(in);
+    auto fout = static_cast<float *>(out);
+
+    for (unsigned int i = 0; i < count; ++i) {
+        if (q31) {
+            auto a = q31ToFloat(qin[args * i]);
+            auto b = args > 1 ? q31ToFloat(qin[args * i + 1]) : 0.f;
+            if (takesAngle(func))
+                a *= PIf;
+            auto r = software(func, a, b);
+            qout[i] = floatToQ31(returnsAngle(func) ? r * (1.f / PIf) : r);
+        } else {
+            fout[i] = software(func, fin[args * i], args > 1 ? fin[args * i + 1] : 0.f);
+        }
+    }
+
+    return true;
+}
+
 }
 #endif
 
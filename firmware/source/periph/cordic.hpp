@@ -12,6 +12,8 @@
 #ifndef CORDIC_HPP_
 #define CORDIC_HPP_
 
+#include <cstdint>
+
 /**
  * Named after the hardware CORDIC peripheral even though software
  * implementations may be used.
@@ -20,11 +22,64 @@ namespace cordic {
     // Provides pi in case cordic functions require it.
     constexpr double PI = 3.1415926535L;
 
+    /**
+     * Functions available through batch(). Values are part of the algorithm
+     * interface (svc 4), so only append to this list.
+     */
+    enum Function : uint32_t {
+        Sin = 0,
+        Cos,
+        Tan,
+        Atan2,     // Takes (x, y) pairs.
+        Magnitude, // Takes (x, y) pairs.
+        Atan,
+        Sqrt,
+        Sinh,
+        Cosh,
+        Atanh,
+        Log,       // Natural logarithm.
+        Exp,
+        FunctionCount
+    };
+
+    /**
+     * OR'd with a Function to select Q31 input and output instead of float.
+     * Q31 values are in [-1, 1), and results outside of that saturate.
+     * Angles in Q31 are scaled by 1/pi (i.e. 0x80000000 = -pi): this applies
+     * to the inputs of Sin, Cos and Tan and the results of Atan2 and Atan.
+     */
+    constexpr uint32_t Q31 = 1 << 8;
+
     /**
      * Prepares cordic functions for use.
      */
     void init();
 
+    /**
+     * Returns the number of 32-bit input values that the given function (and
+     * format) takes per result, or zero if the function is unknown.
+     */
+    unsigned int argumentCount(uint32_t func);
+
+    /**
+     * Computes func for count inputs, writing count results to out.
+     * In and out may be the same buffer.
+     *
+     * On the H7 the CORDIC is kept pipelined, writing the next argument
+     * before the previous result is read, so each element costs the CORDIC's
+     * six-cycle latency plus the float/Q31 conversions: an estimated
+     * 15 cycles per element for Q31 data, and 25 for float data.
+     * Functions that need range reduction in software (Atan2, Magnitude,
+     * Atan, Log and Exp with float data) are estimated at 30-40 cycles.
+     * Sinh, Cosh and Atanh are computed in software for arguments outside of
+     * the CORDIC's range (|x| > 1.118 and |x| > 0.806 respectively), and Sqrt
+     * always uses the FPU, which is faster than the CORDIC with scaling.
+     * The L4 falls back to the standard library.
+     *
+     * Returns false if func is not a known function.
+     */
+    bool batch(uint32_t func, const void *in, void *out, unsigned int count);
+
     // mod - Calculates remainder for given fraction.
     // cos, sin, tan - The trig functions.
 
@@ -54,6 +54,7 @@ void DAC::start(int channel, dacsample_t *buffer, size_t count)
     if (channel >= 0 && channel < 2) {
         if (channel == 1)
             dacIsDone = -1;
+        cacheBufferFlush(buffer, count * sizeof(dacsample_t));
         dacStartConversion(m_driver[channel], &m_group_config, buffer, count);
         SClock::start();
     }
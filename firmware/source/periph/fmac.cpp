@@ -0,0 +1,356 @@
+/**
+ * @file fmac.cpp
+ * @brief Provides accelerated FIR and IIR filtering for algorithms.
+ *
+ * Copyright (C) 2023 Clyne Sullivan
+ *
+ * Distributed under the GNU GPL v3 or later. You should have received a copy of
+ * the GNU General Public License along with this program.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fmac.hpp"
+#include "hal.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+namespace fmac {
+
+static bool isValid(Type type, unsigned int nb, unsigned int na, unsigned int gain)
+{
+    if (gain > MAX_GAIN)
+        return false;
+
+    switch (type) {
+    case FIR:
+        return nb >= 2 && nb <= MAX_FIR_TAPS && na == 0;
+    case IIR:
+        return nb >= 2 && nb <= MAX_IIR_FEEDFORWARD &&
+               na >= 1 && na <= MAX_IIR_FEEDBACK &&
+               nb + na <= MAX_COEFFICIENTS;
+    default:
+        return false;
+    }
+}
+
+// Feedback coefficients are added rather than subtracted by the FMAC.
+static int16_t negate(int16_t c)
+{
+    return c == INT16_MIN ? INT16_MAX : static_cast<int16_t>(-c);
+}
+
+}
+
+#if defined(TARGET_PLATFORM_H7)
+namespace fmac {
+
+// Hardware function numbers (FMAC_PARAM_FUNC).
+constexpr uint32_t FUNC_LOAD_X1 = 1;
+constexpr uint32_t FUNC_LOAD_X2 = 2;
+constexpr uint32_t FUNC_LOAD_Y = 3;
+constexpr uint32_t FUNC_FIR = 8;
+constexpr uint32_t FUNC_IIR = 9;
+
+// The FMAC's local memory, in 16-bit words, is split between the
+// coefficients (X2), inputs (X1) and outputs (Y). X1 and Y need room for the
+// filter's history plus some headroom for samples in flight.
+constexpr unsigned int MEMORY_SIZE = 256;
+constexpr unsigned int MAX_HEADROOM = 16;
+
+// DMAMUX1 request lines (RM0468).
+#if !defined(STM32_DMAMUX1_FMAC_RD)
+#define STM32_DMAMUX1_FMAC_RD 121
+#define STM32_DMAMUX1_FMAC_WR 122
+#endif
+
+constexpr uint32_t DMA_IRQ_PRIORITY = 10;
+constexpr sysinterval_t WAIT_TIMEOUT = TIME_MS2I(100);
+
+static const stm32_dma_stream_t *dmaWrite = nullptr;
+static const stm32_dma_stream_t *dmaRead = nullptr;
+static binary_semaphore_t blockDone;
+
+static bool configured = false;
+static bool started = false;  // A block was started and not yet waited on.
+static bool dmaActive = false;
+static volatile bool dmaFailed = false;
+static int16_t *blockOut = nullptr;
+static unsigned int blockCount = 0;
+
+static void dmaReadCallback(void *, uint32_t flags)
+{
+    if (flags & STM32_DMA_ISR_TEIF)
+        dmaFailed = true;
+
+    if (flags & (STM32_DMA_ISR_TCIF | STM32_DMA_ISR_TEIF)) {
+        chSysLockFromISR();
+        chBSemSignalI(&blockDone);
+        chSysUnlockFromISR();
+    }
+}
+
+void init()
+{
+    rccEnableAHB2(RCC_AHB2ENR_FMACEN, true);
+    chBSemObjectInit(&blockDone, true);
+
+    dmaWrite = dmaStreamAlloc(STM32_DMA_STREAM_ID_ANY, DMA_IRQ_PRIORITY, nullptr, nullptr);
+    dmaRead = dmaStreamAlloc(STM32_DMA_STREAM_ID_ANY, DMA_IRQ_PRIORITY, dmaReadCallback, nullptr);
+    if (dmaWrite != nullptr && dmaRead != nullptr) {
+        dmaSetRequestSource(dmaWrite, STM32_DMAMUX1_FMAC_WR);
+        dmaSetRequestSource(dmaRead, STM32_DMAMUX1_FMAC_RD);
+        dmaStreamSetPeripheral(dmaWrite, &FMAC->WDATA);
+        dmaStreamSetPeripheral(dmaRead, &FMAC->RDATA);
+    }
+}
+
+// DMA1/2 can reach AXI SRAM and SRAM1/2, but not the TCMs.
+static bool isDmaAccessible(const void *buffer, size_t size)
+{
+    const auto addr = reinterpret_cast<uint32_t>(buffer);
+    return (addr >= 0x24000000 && addr + size <= 0x24050000) ||
+           (addr >= 0x30000000 && addr + size <= 0x30008000);
+}
+
+// Fills the start of the X1 or Y buffer with zeros.
+static void loadZeros(uint32_t func, unsigned int count)
+{
+    FMAC->PARAM = (func << FMAC_PARAM_FUNC_Pos) | (count << FMAC_PARAM_P_Pos) |
+                  FMAC_PARAM_START;
+    for (unsigned int i = 0; i < count; ++i)
+        FMAC->WDATA = 0;
+}
+
+bool configure(Type type, const int16_t *coeffs, unsigned int nb,
+               unsigned int na, unsigned int gain)
+{
+    if (!isValid(type, nb, na, gain) || started)
+        return false;
+
+    stop();
+
+    const unsigned int headroom = std::min(MAX_HEADROOM, (MEMORY_SIZE - 2 * (nb + na)) / 2);
+    const unsigned int x2Base = 0;
+    const unsigned int x1Base = nb + na;
+    const unsigned int x1Size = nb + headroom;
+    const unsigned int yBase = x1Base + x1Size;
+    const unsigned int ySize = na + headroom;
+
+    FMAC->X2BUFCFG = (x2Base << FMAC_X2BUFCFG_X2_BASE_Pos) |
+                     ((nb + na) << FMAC_X2BUFCFG_X2_BUF_SIZE_Pos);
+    FMAC->X1BUFCFG = (x1Base << FMAC_X1BUFCFG_X1_BASE_Pos) |
+                     (x1Size << FMAC_X1BUFCFG_X1_BUF_SIZE_Pos);
+    FMAC->YBUFCFG = (yBase << FMAC_YBUFCFG_Y_BASE_Pos) |
+                    (ySize << FMAC_YBUFCFG_Y_BUF_SIZE_Pos);
+
+    // Coefficients: b, then the negated a.
+    FMAC->PARAM = (FUNC_LOAD_X2 << FMAC_PARAM_FUNC_Pos) | (nb << FMAC_PARAM_P_Pos) |
+                  (na << FMAC_PARAM_Q_Pos) | FMAC_PARAM_START;
+    for (unsigned int i = 0; i < nb; ++i)
+        FMAC->WDATA = static_cast<uint16_t>(coeffs[i]);
+    for (unsigned int i = 0; i < na; ++i)
+        FMAC->WDATA = static_cast<uint16_t>(negate(coeffs[nb + i]));
+
+    // Zeroed history lets the first input produce the first output.
+    loadZeros(FUNC_LOAD_X1, nb - 1);
+    if (type == IIR)
+        loadZeros(FUNC_LOAD_Y, na);
+
+    FMAC->CR = FMAC_CR_CLIPEN;
+    FMAC->PARAM = ((type == FIR ? FUNC_FIR : FUNC_IIR) << FMAC_PARAM_FUNC_Pos) |
+                  (nb << FMAC_PARAM_P_Pos) | (na << FMAC_PARAM_Q_Pos) |
+                  (gain << FMAC_PARAM_R_Pos) | FMAC_PARAM_START;
+
+    configured = true;
+    return true;
+}
+
+// Feeds the FMAC from the CPU, for buffers that DMA cannot reach.
+static bool runPolled(const int16_t *in, int16_t *out, unsigned int count)
+{
+    unsigned int written = 0;
+    unsigned int read = 0;
+
+    // The FMAC takes a few cycles per sample; bound the loop in case it stalls.
+    for (unsigned int spins = 0; read < count && spins < count * 256; ++spins) {
+        if (written < count && !(FMAC->SR & FMAC_SR_X1FULL))
+            FMAC->WDATA = static_cast<uint16_t>(in[written++]);
+        if (!(FMAC->SR & FMAC_SR_YEMPTY))
+            out[read++] = static_cast<int16_t>(FMAC->RDATA);
+    }
+
+    return read == count;
+}
+
+bool start(const int16_t *in, int16_t *out, unsigned int count)
+{
+    if (!configured || started || count == 0)
+        return false;
+
+    // out is invalidated once DMA is done, so it must hold whole cache lines
+    // that nothing else shares.
+    const auto size = count * sizeof(int16_t);
+    const bool out_lines = (reinterpret_cast<uint32_t>(out) % 32) == 0 && size % 32 == 0;
+    if (dmaWrite == nullptr || dmaRead == nullptr || !out_lines ||
+        !isDmaAccessible(in, size) || !isDmaAccessible(out, size))
+    {
+        dmaActive = false;
+        dmaFailed = !runPolled(in, out, count);
+        started = true;
+        return true;
+    }
+
+    // Write back both buffers so that no dirty line is evicted over DMA data;
+    // out is invalidated again once the block is done.
+    cacheBufferFlush(in, size);
+    cacheBufferFlush(out, size);
+
+    blockOut = out;
+    blockCount = count;
+    dmaFailed = false;
+    chBSemReset(&blockDone, true);
+
+    dmaStreamSetMemory0(dmaRead, out);
+    dmaStreamSetTransactionSize(dmaRead, count);
+    dmaStreamSetMode(dmaRead, STM32_DMA_CR_PL(2) | STM32_DMA_CR_DIR_P2M |
+                              STM32_DMA_CR_MINC | STM32_DMA_CR_PSIZE_HWORD |
+                              STM32_DMA_CR_MSIZE_HWORD | STM32_DMA_CR_TCIE |
+                              STM32_DMA_CR_TEIE);
+    dmaStreamSetMemory0(dmaWrite, in);
+    dmaStreamSetTransactionSize(dmaWrite, count);
+    dmaStreamSetMode(dmaWrite, STM32_DMA_CR_PL(2) | STM32_DMA_CR_DIR_M2P |
+                               STM32_DMA_CR_MINC | STM32_DMA_CR_PSIZE_HWORD |
+                               STM32_DMA_CR_MSIZE_HWORD);
+    dmaStreamEnable(dmaRead);
+    dmaStreamEnable(dmaWrite);
+
+    dmaActive = true;
+    started = true;
+    FMAC->CR |= FMAC_CR_DMAREN | FMAC_CR_DMAWEN;
+    return true;
+}
+
+bool wait()
+{
+    if (!started)
+        return false;
+
+    bool ok = !dmaFailed;
+    if (dmaActive) {
+        ok = chBSemWaitTimeout(&blockDone, WAIT_TIMEOUT) == MSG_OK && !dmaFailed;
+
+        FMAC->CR &= ~(FMAC_CR_DMAREN | FMAC_CR_DMAWEN);
+        dmaStreamDisable(dmaWrite);
+        dmaStreamDisable(dmaRead);
+        cacheBufferInvalidate(blockOut, blockCount * sizeof(int16_t));
+        dmaActive = false;
+    }
+
+    started = false;
+    return ok;
+}
+
+void stop()
+{
+    if (dmaWrite != nullptr && dmaRead != nullptr) {
+        dmaStreamDisable(dmaWrite);
+        dmaStreamDisable(dmaRead);
+    }
+
+    FMAC->CR = FMAC_CR_RESET;
+    configured = false;
+    started = false;
+    dmaActive = false;
+}
+
+}
+#else // L4
+namespace fmac {
+
+static std::array<int16_t, MAX_COEFFICIENTS> coefficients;
+// Histories are stored twice over so that the last n values are always
+// contiguous: value i is kept at both i and i + n.
+static std::array<int16_t, MAX_FIR_TAPS * 2> xHistory;
+static std::array<int16_t, MAX_IIR_FEEDBACK * 2> yHistory;
+static unsigned int feedforward = 0;
+static unsigned int feedback = 0;
+static unsigned int shift = 0;
+static unsigned int xIndex = 0;
+static unsigned int yIndex = 0;
+static bool started = false;
+
+void init() {}
+
+bool configure(Type type, const int16_t *coeffs, unsigned int nb,
+               unsigned int na, unsigned int gain)
+{
+    if (!isValid(type, nb, na, gain))
+        return false;
+
+    std::copy(coeffs, coeffs + nb, coefficients.begin());
+    std::transform(coeffs + nb, coeffs + nb + na, coefficients.begin() + nb, negate);
+    xHistory.fill(0);
+    yHistory.fill(0);
+    feedforward = nb;
+    feedback = na;
+    shift = 15 - gain;
+    xIndex = 0;
+    yIndex = 0;
+    started = false;
+    return true;
+}
+
+// Like the FMAC: accumulate in full precision, then scale and saturate.
+bool start(const int16_t *in, int16_t *out, unsigned int count)
+{
+    if (feedforward == 0 || started)
+        return false;
+
+    for (unsigned int i = 0; i < count; ++i) {
+        xHistory[xIndex] = xHistory[xIndex + feedforward] = in[i];
+        const int16_t *x = &xHistory[xIndex + feedforward];
+        int64_t acc = 0;
+        for (unsigned int k = 0; k < feedforward; ++k)
+            acc += static_cast<int32_t>(coefficients[k]) * *(x - k);
+        if (++xIndex == feedforward)
+            xIndex = 0;
+
+        if (feedback > 0) {
+            // y[n - 1] is the most recent output.
+            const int16_t *y = &yHistory[yIndex + feedback - 1];
+            for (unsigned int k = 0; k < feedback; ++k)
+                acc += static_cast<int32_t>(coefficients[feedforward + k]) * *(y - k);
+        }
+
+        const auto result = static_cast<int16_t>(std::clamp<int64_t>(acc >> shift, INT16_MIN, INT16_MAX));
+        out[i] = result;
+
+        if (feedback > 0) {
+            yHistory[yIndex] = yHistory[yIndex + feedback] = result;
+            if (++yIndex == feedback)
+                yIndex = 0;
+        }
+    }
+
+    started = true;
+    return true;
+}
+
+bool wait()
+{
+    const bool ok = started;
+    started = false;
+    return ok;
+}
+
+void stop()
+{
+    feedforward = 0;
+    started = false;
+}
+
+}
+#endif
+
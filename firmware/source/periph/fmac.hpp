@@ -0,0 +1,80 @@
+/**
+ * @file fmac.hpp
+ * @brief Provides accelerated FIR and IIR filtering for algorithms.
+ *
+ * Copyright (C) 2023 Clyne Sullivan
+ *
+ * Distributed under the GNU GPL v3 or later. You should have received a copy of
+ * the GNU General Public License along with this program.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FMAC_HPP_
+#define FMAC_HPP_
+
+#include <cstdint>
+
+/**
+ * Named after the hardware FMAC peripheral even though a software
+ * implementation is used on the L4.
+ * One filter is available at a time. Its state carries over from block to
+ * block until it is configured again or stop() is called.
+ */
+namespace fmac {
+    enum Type : uint32_t {
+        FIR = 0,
+        IIR
+    };
+
+    // Limits on coefficient counts, set by the FMAC's 256-word memory.
+    constexpr unsigned int MAX_FIR_TAPS = 127;
+    constexpr unsigned int MAX_IIR_FEEDFORWARD = 64;
+    constexpr unsigned int MAX_IIR_FEEDBACK = 63;
+    constexpr unsigned int MAX_COEFFICIENTS = 127; // Feed-forward + feedback.
+    constexpr unsigned int MAX_GAIN = 7;
+
+    /**
+     * Prepares the FMAC for use.
+     */
+    void init();
+
+    /**
+     * Loads Q15 coefficients and clears the filter's state.
+     * coeffs holds nb feed-forward coefficients (b0 first), followed for IIR
+     * filters by na feedback coefficients a1 to a_na, such that:
+     *   y[n] = 2^gain * (sum(b[k] * x[n - k]) - sum(a[k] * y[n - k]))
+     * The gain (0-7) allows coefficients with magnitudes above one to be
+     * scaled down. Results saturate to Q15.
+     * Returns false if the filter does not fit or is already running a block.
+     */
+    bool configure(Type type, const int16_t *coeffs, unsigned int nb,
+                   unsigned int na, unsigned int gain);
+
+    /**
+     * Starts filtering count Q15 samples from in to out. wait() must be
+     * called before either buffer is used again.
+     * On the H7, DMA moves the samples if both buffers are in AXI SRAM or
+     * SRAM1/2 and out covers whole cache lines (32-byte aligned, size a
+     * multiple of 32), leaving the CPU free until wait(); otherwise (e.g. in
+     * DTCM, which DMA cannot reach), the CPU feeds the FMAC before this
+     * returns.
+     * The L4 filters in software before returning.
+     * Returns false if no filter is configured or a block is in progress.
+     */
+    bool start(const int16_t *in, int16_t *out, unsigned int count);
+
+    /**
+     * Waits for the block given to start() to finish.
+     * Returns false if no block was started or it did not complete.
+     */
+    bool wait();
+
+    /**
+     * Halts any block in progress and unloads the filter.
+     * Safe to call from an interrupt.
+     */
+    void stop();
+}
+
+#endif // FMAC_HPP_
+
@@ -38,6 +38,25 @@ bool USBSerial::isActive()
     return false;
 }
 
+void USBSerial::waitForInput(sysinterval_t timeout)
+{
+    // The listener wakes the thread that registered it, so it is registered
+    // by the first wait rather than by begin().
+    static event_listener_t listener;
+    static bool registered = false;
+    if (!registered) {
+        chEvtRegisterMaskWithFlags(chnGetEventSource(m_driver), &listener,
+                                   EVENT_MASK(0), CHN_INPUT_AVAILABLE | CHN_CONNECTED);
+        registered = true;
+    }
+
+    // Input that arrived since the caller last checked has left the event
+    // pending, so this cannot miss it.
+    if (!isActive())
+        chEvtWaitAnyTimeout(EVENT_MASK(0), timeout);
+    chEvtGetAndClearFlags(&listener);
+}
+
 size_t USBSerial::read(unsigned char *buffer, size_t count)
 {
     auto bss = reinterpret_cast<BaseSequentialStream *>(m_driver);
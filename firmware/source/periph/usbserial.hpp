@@ -27,6 +27,13 @@ public:
      */
     static bool isActive();
 
+    /**
+     * Sleeps until input data arrives or the USB connection changes, or
+     * until the timeout passes. Returns at once if input is waiting. Only
+     * one thread may wait.
+     */
+    static void waitForInput(sysinterval_t timeout);
+
     /**
      * Reads received input data into the given buffer.
      * @param buffer Buffer to store input data.
@@ -0,0 +1,158 @@
+/**
+ * @file profiler.cpp
+ * @brief Provides the counter that algorithms time their sections with, and
+ *        samples where the algorithm thread spends its time.
+ *
+ * Copyright (C) 2023 Clyne Sullivan
+ *
+ * Distributed under the GNU GPL v3 or later. You should have received a copy of
+ * the GNU General Public License along with this program.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "profiler.hpp"
+
+#include <algorithm>
+
+static_assert(Profiler::COUNTER_ADDRESS == TIM5_BASE + offsetof(TIM_TypeDef, CNT));
+
+GPTConfig Profiler::m_sample_timer_config = {
+    .frequency = 1000000,
+    .callback = Profiler::sampleCallback,
+    .cr2 = 0,
+    .dier = 0
+};
+thread_t *Profiler::m_sample_thread = nullptr;
+ELFManager::EntryFunc Profiler::m_sample_entry = nullptr;
+uint32_t Profiler::m_sample_base = 0;
+uint32_t Profiler::m_sample_size = 0;
+Profiler::SamplingStats Profiler::m_sampling;
+std::array<uint16_t, Profiler::SAMPLE_BINS> Profiler::m_sample_bins = {};
+
+void Profiler::begin()
+{
+    rccEnableTIM5(true);
+    TIM5->CR1 = 0;
+    TIM5->PSC = 0;
+    TIM5->ARR = 0xFFFFFFFF;
+    TIM5->EGR = TIM_EGR_UG;
+    TIM5->CR1 = TIM_CR1_CEN;
+}
+
+uint32_t Profiler::frequency()
+{
+    return STM32_TIMCLK1;
+}
+
+unsigned int Profiler::read(ELFManager::ProfileMarker *out)
+{
+    const auto& iface = ELFManager::loadedInterface();
+    auto markers = reinterpret_cast<volatile ELFManager::ProfileMarker *>(iface.profile);
+    if (markers == nullptr)
+        return 0;
+
+    // The algorithm thread has the higher priority, so it may update a
+    // marker partway through this copy, but never the other way around.
+    // It updates count last: an unchanged count means an unchanged marker.
+    for (unsigned int i = 0; i < iface.profileMarkers; i++) {
+        uint32_t count;
+        do {
+            count = markers[i].count;
+            out[i].total = markers[i].total;
+            out[i].max = markers[i].max;
+        } while (markers[i].count != count);
+
+        out[i].count = count;
+        out[i].start = 0;
+        out[i].reserved = 0;
+    }
+
+    return iface.profileMarkers;
+}
+
+
+bool Profiler::startSampling(thread_t *thread)
+{
+    stopSampling();
+
+    const auto entry = ELFManager::loadedElf();
+    const auto& iface = ELFManager::loadedInterface();
+    if (entry == nullptr || iface.codeSize == 0)
+        return false;
+
+    // Bins are at least a halfword, the size of the smallest instruction.
+    uint32_t shift = 1;
+    while (((iface.codeSize - 1) >> shift) + 1 > SAMPLE_BINS)
+        shift++;
+
+    std::fill(m_sample_bins.begin(), m_sample_bins.end(), 0);
+    m_sampling = {};
+    m_sampling.running = 1;
+    m_sampling.codeLink = iface.codeLink;
+    m_sampling.shift = shift;
+    m_sampling.bins = ((iface.codeSize - 1) >> shift) + 1;
+    m_sample_thread = thread;
+    m_sample_entry = entry;
+    m_sample_base = iface.codeBase;
+    m_sample_size = iface.codeSize;
+
+    gptStart(&GPTD7, &m_sample_timer_config);
+    gptStartContinuous(&GPTD7, SAMPLE_INTERVAL);
+    return true;
+}
+
+void Profiler::stopSampling()
+{
+    // The timer may have already stopped itself.
+    chSysLock();
+    if (GPTD7.state == GPT_CONTINUOUS)
+        gptStopTimerI(&GPTD7);
+    m_sampling.running = 0;
+    chSysUnlock();
+}
+
+Profiler::SamplingStats Profiler::samplingStats()
+{
+    chSysLock();
+    const auto stats = m_sampling;
+    chSysUnlock();
+    return stats;
+}
+
+const uint16_t *Profiler::samplingBins()
+{
+    return m_sample_bins.data();
+}
+
+void Profiler::sampleCallback(GPTDriver *gptp)
+{
+    // The code being sampled is gone.
+    if (ELFManager::loadedElf() != m_sample_entry) {
+        chSysLockFromISR();
+        gptStopTimerI(gptp);
+        m_sampling.running = 0;
+        chSysUnlockFromISR();
+        return;
+    }
+
+    m_sampling.samples++;
+    if (chThdGetSelfX() != m_sample_thread) {
+        m_sampling.other++;
+        return;
+    }
+
+    // Threads run on the process stack, where the interrupted thread's
+    // exception frame holds its PC in the seventh word. If this interrupt
+    // came in over another, that frame is still the thread's.
+    const uint32_t *frame;
+    asm volatile("mrs %0, psp" : "=r" (frame));
+    const uint32_t offset = frame[6] - m_sample_base;
+
+    if (offset < m_sample_size) {
+        auto& bin = m_sample_bins[offset >> m_sampling.shift];
+        if (bin != UINT16_MAX)
+            bin++;
+    } else {
+        m_sampling.outside++;
+    }
+}
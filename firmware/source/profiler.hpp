@@ -0,0 +1,120 @@
+/**
+ * @file profiler.hpp
+ * @brief Provides the counter that algorithms time their sections with, and
+ *        samples where the algorithm thread spends its time.
+ *
+ * Copyright (C) 2023 Clyne Sullivan
+ *
+ * Distributed under the GNU GPL v3 or later. You should have received a copy of
+ * the GNU General Public License along with this program.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STMDSP_PROFILER_HPP
+#define STMDSP_PROFILER_HPP
+
+#include "ch.h"
+#include "hal.h"
+
+#include "elfload.hpp"
+
+#include <array>
+#include <cstdint>
+
+/**
+ * The core's cycle counter cannot be read by the unprivileged algorithm
+ * thread, so algorithms read TIM5 instead: a free-running 32-bit counter
+ * that the MPU leaves readable to them (see boardInit()). Algorithms keep
+ * their own totals in ELFManager::ProfileMarker entries, which are read
+ * from here for the host.
+ *
+ * Separately, the host may sample where the algorithm thread is: a timer
+ * interrupt reads the PC from the thread's exception frame and counts it in
+ * a histogram over the algorithm's code, which the host maps back onto its
+ * disassembly.
+ */
+class Profiler
+{
+public:
+    // Address of the counter, for the algorithm header.
+    static constexpr uint32_t COUNTER_ADDRESS = 0x40000C24; // TIM5->CNT
+
+    /**
+     * Starts the counter.
+     */
+    static void begin();
+
+    /**
+     * Returns the counter's rate in Hz.
+     */
+    static uint32_t frequency();
+
+    /**
+     * Copies the loaded algorithm's markers into out, which must have room
+     * for ELFManager::MAX_PROFILE_MARKERS. Each copy is of one complete
+     * update by the algorithm.
+     * @return The number of markers copied.
+     */
+    static unsigned int read(ELFManager::ProfileMarker *out);
+
+    // PC samples are counted in up to this many bins over the algorithm's
+    // code, each covering two or more bytes.
+    static constexpr unsigned int SAMPLE_BINS = 2048;
+    // Timer ticks (of 1 us) between samples. Prime, so that sampling does
+    // not lock onto the block period.
+    static constexpr unsigned int SAMPLE_INTERVAL = 97;
+
+    /**
+     * The state of PC sampling. Sent to the host as is, so only append to
+     * this.
+     */
+    struct SamplingStats {
+        uint32_t running = 0;  // Nonzero while sampling.
+        uint32_t codeLink = 0; // Link address of the first bin (see
+                               // ELFManager::Interface::codeLink).
+        uint32_t shift = 0;    // Each bin covers 1 << shift bytes.
+        uint32_t bins = 0;     // Bins in use.
+        uint32_t samples = 0;  // Samples taken.
+        uint32_t outside = 0;  // Of those, the thread was outside the
+                               // algorithm's code (e.g. converting samples).
+        uint32_t other = 0;    // Of those, another thread was running.
+    };
+
+    /**
+     * Clears the bins and starts sampling the PC of the given thread (the
+     * algorithm thread) into them, from a timer interrupt. Sampling stops by
+     * itself if the algorithm is unloaded or replaced.
+     * @return False if no algorithm is loaded.
+     */
+    static bool startSampling(thread_t *thread);
+
+    /**
+     * Stops sampling, keeping the results.
+     */
+    static void stopSampling();
+
+    /**
+     * Returns the state of sampling, copied under lock.
+     */
+    static SamplingStats samplingStats();
+
+    /**
+     * Returns the bins; the first samplingStats().bins are in use. Each bin
+     * stops counting at UINT16_MAX.
+     */
+    static const uint16_t *samplingBins();
+
+private:
+    static void sampleCallback(GPTDriver *);
+
+    static GPTConfig m_sample_timer_config;
+    static thread_t *m_sample_thread;
+    static ELFManager::EntryFunc m_sample_entry;
+    static uint32_t m_sample_base;
+    static uint32_t m_sample_size;
+    static SamplingStats m_sampling;
+    static std::array<uint16_t, SAMPLE_BINS> m_sample_bins;
+};
+
+#endif // STMDSP_PROFILER_HPP
+
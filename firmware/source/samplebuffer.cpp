@@ -78,10 +78,12 @@ void SampleBuffer::midmodify(Sample *data, unsigned int srcsize) {
     } while (src < srcend);
 }
 
+__attribute__((section(".convcode")))
 void SampleBuffer::setModified() {
     m_modified = m_buffer;
 }
 
+__attribute__((section(".convcode")))
 void SampleBuffer::setMidmodified() {
     m_modified = middata();
 }
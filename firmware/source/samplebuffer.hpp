@@ -20,6 +20,9 @@ using Sample = uint16_t;
 constexpr unsigned int MAX_SAMPLE_BUFFER_BYTESIZE = sizeof(Sample) * 8192;
 constexpr unsigned int MAX_SAMPLE_BUFFER_SIZE = MAX_SAMPLE_BUFFER_BYTESIZE / sizeof(Sample);
 
+// Input channels the ADC can scan; each has an output on one DAC channel.
+constexpr unsigned int MAX_CHANNELS = 2;
+
 /**
  * Manages a buffer of sample data from the ADC or DAC with facilities to
  * work with separate halves of the total buffer (which is necessary when
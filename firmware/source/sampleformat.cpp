@@ -0,0 +1,337 @@
+/**
+ * @file sampleformat.cpp
+ * @brief Converts samples to and from the formats algorithms work in.
+ *
+ * Copyright (C) 2023 Clyne Sullivan
+ *
+ * Distributed under the GNU GPL v3 or later. You should have received a copy of
+ * the GNU General Public License along with this program.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "sampleformat.hpp"
+
+#include "hal.h"
+
+// These run in the unprivileged conversion thread, so they live in .convcode
+// and must not call into the rest of the firmware.
+
+__attribute__((section(".convcode")))
+void sampleformat::convertIn(SampleFormat format, unsigned int bits, const Sample *in, void *out,
+                             unsigned int count)
+{
+    switch (format) {
+    case SampleFormat::Q15:
+        toQ15(bits, in, static_cast<int16_t *>(out), count);
+        break;
+    case SampleFormat::Float:
+        toFloat(bits, in, static_cast<float *>(out), count);
+        break;
+    case SampleFormat::Q31:
+        toQ31(bits, in, static_cast<int32_t *>(out), count);
+        break;
+    default:
+        {
+            auto dst = static_cast<Sample *>(out);
+            for (unsigned int i = 0; i < count; ++i)
+                dst[i] = in[i];
+        }
+        break;
+    }
+}
+
+__attribute__((section(".convcode")))
+void sampleformat::convertOut(SampleFormat format, const void *in, Sample *out, unsigned int count)
+{
+    switch (format) {
+    case SampleFormat::Q15:
+        fromQ15(static_cast<const int16_t *>(in), out, count);
+        break;
+    case SampleFormat::Float:
+        fromFloat(static_cast<const float *>(in), out, count);
+        break;
+    case SampleFormat::Q31:
+        fromQ31(static_cast<const int32_t *>(in), out, count);
+        break;
+    default:
+        {
+            auto src = static_cast<const Sample *>(in);
+            for (unsigned int i = 0; i < count; ++i)
+                out[i] = src[i];
+        }
+        break;
+    }
+}
+
+__attribute__((section(".convcode")))
+static inline Sample floatToSample(float x)
+{
+    // The half added here rounds, as conversion to integer truncates.
+    // Comparisons are written so that NaN ends up at zero.
+    float s = x * 2048.f + 2048.5f;
+    s = s > 0.f ? s : 0.f;
+    s = s < 4095.f ? s : 4095.f;
+    return static_cast<Sample>(s);
+}
+
+// The strided conversions go one sample at a time, using the same
+// arithmetic as the block conversions below.
+
+__attribute__((section(".convcode")))
+void sampleformat::convertInStrided(SampleFormat format, unsigned int bits, const Sample *in,
+                                    unsigned int stride, void *out, unsigned int count)
+{
+    const uint32_t mask = (1u << bits) - 1;
+    const uint32_t mid = 1u << (bits - 1);
+
+    switch (format) {
+    case SampleFormat::Q15:
+        {
+            auto dst = static_cast<int16_t *>(out);
+            for (unsigned int i = 0; i < count; ++i, in += stride)
+                dst[i] = static_cast<int16_t>(((*in & mask) ^ mid) << (16 - bits));
+        }
+        break;
+    case SampleFormat::Float:
+        {
+            const float scale = 1.f / static_cast<float>(mid);
+            auto dst = static_cast<float *>(out);
+            for (unsigned int i = 0; i < count; ++i, in += stride)
+                dst[i] = static_cast<float>(*in - static_cast<int>(mid)) * scale;
+        }
+        break;
+    case SampleFormat::Q31:
+        {
+            auto dst = static_cast<int32_t *>(out);
+            for (unsigned int i = 0; i < count; ++i, in += stride)
+                dst[i] = static_cast<int32_t>(((*in & mask) ^ mid) << (32 - bits));
+        }
+        break;
+    default:
+        {
+            auto dst = static_cast<Sample *>(out);
+            for (unsigned int i = 0; i < count; ++i, in += stride)
+                dst[i] = *in;
+        }
+        break;
+    }
+}
+
+__attribute__((section(".convcode")))
+void sampleformat::convertOutStrided(SampleFormat format, const void *in, unsigned int stride,
+                                     Sample *out, unsigned int count)
+{
+    switch (format) {
+    case SampleFormat::Q15:
+        {
+            auto src = static_cast<const int16_t *>(in);
+            for (unsigned int i = 0; i < count; ++i, src += stride) {
+                auto s = static_cast<uint32_t>(__QADD16(static_cast<uint16_t>(*src), 8));
+                out[i] = static_cast<Sample>(((s ^ 0x8000) >> 4) & 0xFFF);
+            }
+        }
+        break;
+    case SampleFormat::Float:
+        {
+            auto src = static_cast<const float *>(in);
+            for (unsigned int i = 0; i < count; ++i, src += stride)
+                out[i] = floatToSample(*src);
+        }
+        break;
+    case SampleFormat::Q31:
+        {
+            auto src = static_cast<const int32_t *>(in);
+            for (unsigned int i = 0; i < count; ++i, src += stride) {
+                auto s = static_cast<uint32_t>(__QADD(*src, 1 << 19));
+                out[i] = static_cast<Sample>((s ^ 0x80000000) >> 20);
+            }
+        }
+        break;
+    default:
+        {
+            auto src = static_cast<const Sample *>(in);
+            for (unsigned int i = 0; i < count; ++i, src += stride)
+                out[i] = *src;
+        }
+        break;
+    }
+}
+
+__attribute__((section(".convcode")))
+void sampleformat::toQ15(unsigned int bits, const Sample *in, int16_t *out, unsigned int count)
+{
+    // Flipping the top bit turns a sample into a signed value, and the shift
+    // scales it to Q15. Samples have the bits above it clear, so both halves
+    // of a word can be shifted at once.
+    const uint32_t mask = ((1u << bits) - 1) * 0x00010001;
+    const uint32_t flip = (1u << (bits - 1)) * 0x00010001;
+    const unsigned int shift = 16 - bits;
+    auto one = [&](unsigned int i) {
+        out[i] = static_cast<int16_t>(((in[i] & mask) ^ flip) << shift);
+    };
+
+    // Blocks gathered from an odd frame start halfway into a word: the first
+    // sample is then done alone. If only one buffer is, pairs never line up.
+    const auto in_half = reinterpret_cast<uintptr_t>(in) & 2;
+    if (in_half != (reinterpret_cast<uintptr_t>(out) & 2)) {
+        for (unsigned int i = 0; i < count; ++i)
+            one(i);
+        return;
+    }
+    if (in_half != 0 && count > 0) {
+        one(0);
+        ++in;
+        ++out;
+        --count;
+    }
+
+    auto src = reinterpret_cast<const uint32_t *>(in);
+    auto dst = reinterpret_cast<uint32_t *>(out);
+    unsigned int n = count / 2;
+    for (; n >= 4; n -= 4) {
+        uint32_t a = src[0];
+        uint32_t b = src[1];
+        uint32_t c = src[2];
+        uint32_t d = src[3];
+        dst[0] = ((a & mask) ^ flip) << shift;
+        dst[1] = ((b & mask) ^ flip) << shift;
+        dst[2] = ((c & mask) ^ flip) << shift;
+        dst[3] = ((d & mask) ^ flip) << shift;
+        src += 4;
+        dst += 4;
+    }
+    for (; n > 0; --n)
+        *dst++ = ((*src++ & mask) ^ flip) << shift;
+
+    if (count & 1)
+        one(count - 1);
+}
+
+__attribute__((section(".convcode")))
+void sampleformat::fromQ15(const int16_t *in, Sample *out, unsigned int count)
+{
+    // A saturating add of half a sample rounds; then flipping the sign bits
+    // offsets both halves to unsigned before they are shifted down together.
+    auto one = [&](unsigned int i) {
+        auto s = static_cast<uint32_t>(__QADD16(static_cast<uint16_t>(in[i]), 8));
+        out[i] = static_cast<Sample>(((s ^ 0x8000) >> 4) & 0xFFF);
+    };
+
+    // Unaligned buffers are handled as in toQ15().
+    const auto in_half = reinterpret_cast<uintptr_t>(in) & 2;
+    if (in_half != (reinterpret_cast<uintptr_t>(out) & 2)) {
+        for (unsigned int i = 0; i < count; ++i)
+            one(i);
+        return;
+    }
+    if (in_half != 0 && count > 0) {
+        one(0);
+        ++in;
+        ++out;
+        --count;
+    }
+
+    auto src = reinterpret_cast<const uint32_t *>(in);
+    auto dst = reinterpret_cast<uint32_t *>(out);
+    unsigned int n = count / 2;
+    for (; n >= 4; n -= 4) {
+        uint32_t a = __QADD16(src[0], 0x00080008);
+        uint32_t b = __QADD16(src[1], 0x00080008);
+        uint32_t c = __QADD16(src[2], 0x00080008);
+        uint32_t d = __QADD16(src[3], 0x00080008);
+        dst[0] = ((a ^ 0x80008000) >> 4) & 0x0FFF0FFF;
+        dst[1] = ((b ^ 0x80008000) >> 4) & 0x0FFF0FFF;
+        dst[2] = ((c ^ 0x80008000) >> 4) & 0x0FFF0FFF;
+        dst[3] = ((d ^ 0x80008000) >> 4) & 0x0FFF0FFF;
+        src += 4;
+        dst += 4;
+    }
+    for (; n > 0; --n)
+        *dst++ = ((__QADD16(*src++, 0x00080008) ^ 0x80008000) >> 4) & 0x0FFF0FFF;
+
+    if (count & 1)
+        one(count - 1);
+}
+
+__attribute__((section(".convcode")))
+void sampleformat::toFloat(unsigned int bits, const Sample *in, float *out, unsigned int count)
+{
+    // Four at a time so that the integer-to-float conversions overlap.
+    const int mid = 1 << (bits - 1);
+    const float scale = 1.f / static_cast<float>(mid);
+    unsigned int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        int a = in[i] - mid;
+        int b = in[i + 1] - mid;
+        int c = in[i + 2] - mid;
+        int d = in[i + 3] - mid;
+        out[i] = static_cast<float>(a) * scale;
+        out[i + 1] = static_cast<float>(b) * scale;
+        out[i + 2] = static_cast<float>(c) * scale;
+        out[i + 3] = static_cast<float>(d) * scale;
+    }
+    for (; i < count; ++i)
+        out[i] = static_cast<float>(in[i] - mid) * scale;
+}
+
+__attribute__((section(".convcode")))
+void sampleformat::fromFloat(const float *in, Sample *out, unsigned int count)
+{
+    unsigned int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        Sample a = floatToSample(in[i]);
+        Sample b = floatToSample(in[i + 1]);
+        Sample c = floatToSample(in[i + 2]);
+        Sample d = floatToSample(in[i + 3]);
+        out[i] = a;
+        out[i + 1] = b;
+        out[i + 2] = c;
+        out[i + 3] = d;
+    }
+    for (; i < count; ++i)
+        out[i] = floatToSample(in[i]);
+}
+
+__attribute__((section(".convcode")))
+void sampleformat::toQ31(unsigned int bits, const Sample *in, int32_t *out, unsigned int count)
+{
+    // As for Q15: flip the top bit, then shift the value to the top.
+    const uint32_t mask = (1u << bits) - 1;
+    const uint32_t flip = 1u << (bits - 1);
+    const unsigned int shift = 32 - bits;
+    unsigned int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        uint32_t a = in[i];
+        uint32_t b = in[i + 1];
+        uint32_t c = in[i + 2];
+        uint32_t d = in[i + 3];
+        out[i] = static_cast<int32_t>(((a & mask) ^ flip) << shift);
+        out[i + 1] = static_cast<int32_t>(((b & mask) ^ flip) << shift);
+        out[i + 2] = static_cast<int32_t>(((c & mask) ^ flip) << shift);
+        out[i + 3] = static_cast<int32_t>(((d & mask) ^ flip) << shift);
+    }
+    for (; i < count; ++i)
+        out[i] = static_cast<int32_t>(((in[i] & mask) ^ flip) << shift);
+}
+
+__attribute__((section(".convcode")))
+void sampleformat::fromQ31(const int32_t *in, Sample *out, unsigned int count)
+{
+    // Round with a saturating add, then take the top twelve bits.
+    constexpr int32_t half = 1 << 19;
+    unsigned int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        uint32_t a = static_cast<uint32_t>(__QADD(in[i], half));
+        uint32_t b = static_cast<uint32_t>(__QADD(in[i + 1], half));
+        uint32_t c = static_cast<uint32_t>(__QADD(in[i + 2], half));
+        uint32_t d = static_cast<uint32_t>(__QADD(in[i + 3], half));
+        out[i] = static_cast<Sample>((a ^ 0x80000000) >> 20);
+        out[i + 1] = static_cast<Sample>((b ^ 0x80000000) >> 20);
+        out[i + 2] = static_cast<Sample>((c ^ 0x80000000) >> 20);
+        out[i + 3] = static_cast<Sample>((d ^ 0x80000000) >> 20);
+    }
+    for (; i < count; ++i) {
+        auto s = static_cast<uint32_t>(__QADD(in[i], half));
+        out[i] = static_cast<Sample>((s ^ 0x80000000) >> 20);
+    }
+}
@@ -0,0 +1,116 @@
+/**
+ * @file sampleformat.hpp
+ * @brief Converts samples to and from the formats algorithms work in.
+ *
+ * Copyright (C) 2023 Clyne Sullivan
+ *
+ * Distributed under the GNU GPL v3 or later. You should have received a copy of
+ * the GNU General Public License along with this program.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SAMPLEFORMAT_HPP_
+#define SAMPLEFORMAT_HPP_
+
+#include "samplebuffer.hpp"
+
+#include <cstdint>
+
+/**
+ * Sample formats an algorithm may declare in its ELF note. Values are part
+ * of the algorithm interface, so only append to this list.
+ */
+enum class SampleFormat : uint32_t {
+    Raw = 0, // Samples as read by the ADC (see ADC::sampleBits()); output
+             // is 12-bit for the DAC (2048 = 0V).
+    Q15,     // Signed Q15, full scale at +/- 1.0.
+    Float,   // -1.0 to 1.0.
+    Q31,     // Signed Q31, full scale at +/- 1.0.
+    Count
+};
+
+namespace sampleformat {
+    /**
+     * Returns the size in bytes of one sample in the given format.
+     */
+    constexpr unsigned int elementSize(SampleFormat format) {
+        switch (format) {
+        case SampleFormat::Float:
+            return sizeof(float);
+        case SampleFormat::Q31:
+            return sizeof(int32_t);
+        case SampleFormat::Q15:
+            return sizeof(int16_t);
+        default:
+            return sizeof(Sample);
+        }
+    }
+
+    /**
+     * Converts count input samples of the given bits (12 to 16) from in to
+     * the given format, writing them to out. Samples are copied for
+     * SampleFormat::Raw.
+     */
+    void convertIn(SampleFormat format, unsigned int bits, const Sample *in, void *out,
+                   unsigned int count);
+
+    /**
+     * Converts count values in the given format back to 12-bit samples,
+     * saturating values out of range. Samples are copied for SampleFormat::Raw.
+     */
+    void convertOut(SampleFormat format, const void *in, Sample *out, unsigned int count);
+
+    /**
+     * As convertIn, but reads every stride'th sample of in; for separating
+     * the channels of interleaved samples.
+     */
+    void convertInStrided(SampleFormat format, unsigned int bits, const Sample *in,
+                          unsigned int stride, void *out, unsigned int count);
+
+    /**
+     * As convertOut, but reads every stride'th value of in.
+     */
+    void convertOutStrided(SampleFormat format, const void *in, unsigned int stride,
+                           Sample *out, unsigned int count);
+
+    /**
+     * Converts count samples of the given bits to Q15: for 12 bits, 0
+     * becomes -1.0 (0x8000) and 4095 becomes 0x7FF0. Works on two samples
+     * per 32-bit operation where both buffers are aligned alike (halfword
+     * aligned is enough otherwise). Buffers may not overlap.
+     */
+    void toQ15(unsigned int bits, const Sample *in, int16_t *out, unsigned int count);
+
+    /**
+     * Converts count Q15 values to 12-bit samples, rounding to the nearest
+     * sample. Pairs samples as toQ15() does. Buffers may be the same.
+     */
+    void fromQ15(const int16_t *in, Sample *out, unsigned int count);
+
+    /**
+     * Converts count samples of the given bits to floats in [-1, 1).
+     * Buffers may not overlap.
+     */
+    void toFloat(unsigned int bits, const Sample *in, float *out, unsigned int count);
+
+    /**
+     * Converts count floats to 12-bit samples, rounding to the nearest
+     * sample and saturating values outside of [-1, 1) (NaN gives 0).
+     */
+    void fromFloat(const float *in, Sample *out, unsigned int count);
+
+    /**
+     * Converts count samples of the given bits to Q31. Buffers may not
+     * overlap.
+     */
+    void toQ31(unsigned int bits, const Sample *in, int32_t *out, unsigned int count);
+
+    /**
+     * Converts count Q31 values to 12-bit samples, rounding to the nearest
+     * sample.
+     */
+    void fromQ31(const int32_t *in, Sample *out, unsigned int count);
+}
+
+#endif // SAMPLEFORMAT_HPP_
+
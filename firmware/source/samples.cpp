@@ -20,16 +20,23 @@ static_assert(sizeof(adcsample_t) == sizeof(uint16_t));
 static_assert(sizeof(dacsample_t) == sizeof(uint16_t));
 
 #if defined(TARGET_PLATFORM_H7)
+// Buffers start on cache line boundaries and are only shared with DMA, so
+// whole-buffer cache maintenance never touches unrelated data.
+static_assert(0x38000000 % CACHE_LINE_SIZE == 0 && 0x30004000 % CACHE_LINE_SIZE == 0 &&
+              MAX_SAMPLE_BUFFER_BYTESIZE <= 16 * 1024);
+
 __attribute__((section(".convdata")))
 SampleBuffer Samples::In (reinterpret_cast<Sample *>(0x38000000)); // 16k
 __attribute__((section(".convdata")))
 SampleBuffer Samples::Out (reinterpret_cast<Sample *>(0x30004000)); // 16k
-SampleBuffer Samples::SigGen (reinterpret_cast<Sample *>(0x30000000)); // 16k
+__attribute__((section(".convdata")))
+SampleBuffer Samples::Generator (reinterpret_cast<Sample *>(0x30000000)); // 16k
 #else
 __attribute__((section(".convdata")))
 SampleBuffer Samples::In (reinterpret_cast<Sample *>(0x20008000)); // 16k
 __attribute__((section(".convdata")))
 SampleBuffer Samples::Out (reinterpret_cast<Sample *>(0x2000C000)); // 16k
+__attribute__((section(".convdata")))
 SampleBuffer Samples::Generator (reinterpret_cast<Sample *>(0x20010000)); // 16k
 #endif
 
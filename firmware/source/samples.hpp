@@ -15,7 +15,8 @@
 #include "samplebuffer.hpp"
 
 // Define sample buffers for the input and output signals and the signal
-// generator.
+// generator. With two channels, the generator's buffer holds the second
+// channel's output instead.
 class Samples
 {
 public:
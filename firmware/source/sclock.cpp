@@ -15,35 +15,14 @@ GPTDriver *SClock::m_timer = &GPTD6;
 unsigned int SClock::m_div = 1;
 unsigned int SClock::m_runcount = 0;
 
-const GPTConfig SClock::m_timer_config = {
-#if defined(TARGET_PLATFORM_H7)
-    .frequency = 4800000,
-#else
-    .frequency = 36000000,
-#endif
+// The frequency (the timer clock after the prescaler) is set by setRate().
+GPTConfig SClock::m_timer_config = {
+    .frequency = STM32_TIMCLK1,
     .callback = nullptr,
     .cr2 = TIM_CR2_MMS_1, /* TRGO */
     .dier = 0
 };
 
-const std::array<unsigned int, 6> SClock::m_rate_divs = {{
-#if defined(TARGET_PLATFORM_H7)
-    /* 8k  */ 600,
-    /* 16k */ 300,
-    /* 20k */ 240,
-    /* 32k */ 150,
-    /* 48k */ 100,
-    /* 96k */ 50
-#else
-    /* 8k  */ 4500,
-    /* 16k */ 2250,
-    /* 20k */ 1800,
-    /* 32k */ 1125,
-    /* 48k */ 750,
-    /* 96k */ 375
-#endif
-}};
-
 void SClock::begin()
 {
     gptStart(m_timer, &m_timer_config);
@@ -51,8 +30,12 @@ void SClock::begin()
 
 void SClock::start()
 {
-    if (m_runcount++ == 0)
+    if (m_runcount++ == 0) {
+        // Restart the driver in case setRate() changed the prescaler.
+        gptStop(m_timer);
+        gptStart(m_timer, &m_timer_config);
         gptStartContinuous(m_timer, m_div);
+    }
 }
 
 void SClock::stop()
@@ -61,18 +44,52 @@ void SClock::stop()
         gptStopTimer(m_timer);
 }
 
-void SClock::setRate(SClock::Rate rate)
+unsigned int SClock::setRate(unsigned int rate)
 {
-    m_div = m_rate_divs[static_cast<unsigned int>(rate)];
-}
+    if (rate < MIN_RATE || rate > MAX_RATE)
+        return 0;
 
-unsigned int SClock::getRate()
-{
-    for (unsigned int i = 0; i < m_rate_divs.size(); ++i) {
-        if (m_rate_divs[i] == m_div)
-            return i;
+    // The timer clock is divided by the prescaler and then by the period,
+    // each at most 65536. The smallest prescaler leaves the most resolution
+    // for the period, but the driver needs one that divides the clock
+    // evenly, so a few are tried.
+    constexpr uint32_t clock = STM32_TIMCLK1;
+    constexpr uint32_t max_div = 65536;
+    const uint32_t total = (clock + rate / 2) / rate;
+    const uint32_t first = (total + max_div - 1) / max_div;
+
+    uint32_t best_psc = 0;
+    uint32_t best_div = 0;
+    uint32_t best_error = UINT32_MAX;
+    for (uint32_t psc = first; psc < first + 16 && psc <= max_div; psc++) {
+        if (clock % psc != 0)
+            continue;
+
+        const uint32_t freq = clock / psc;
+        uint32_t div = (freq + rate / 2) / rate;
+        div = div < 2 ? 2 : (div > max_div ? max_div : div);
+
+        // Error in thousandths of a Hz, to tell apart close candidates.
+        const uint64_t made = static_cast<uint64_t>(freq) * 1000 / div;
+        const uint64_t want = static_cast<uint64_t>(rate) * 1000;
+        const auto error = static_cast<uint32_t>(made > want ? made - want : want - made);
+        if (error < best_error) {
+            best_error = error;
+            best_psc = psc;
+            best_div = div;
+        }
     }
 
-    return static_cast<unsigned int>(-1);
+    if (best_psc == 0)
+        return 0;
+
+    m_timer_config.frequency = clock / best_psc;
+    m_div = best_div;
+    return getFrequency();
+}
+
+unsigned int SClock::getFrequency()
+{
+    return (m_timer_config.frequency + m_div / 2) / m_div;
 }
 
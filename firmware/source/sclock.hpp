@@ -19,15 +19,10 @@
 class SClock
 {
 public:
-    // These are the supported sampling rates. GUI keeps its own enumeration.
-    enum class Rate : unsigned int {
-        R8K = 0,
-        R16K,
-        R20K,
-        R32K,
-        R48K,
-        R96K
-    };
+    // Range of sampling rates that setRate() accepts, in Hz. The ADC keeps up
+    // with the highest rate on both platforms (see ADC::setRate).
+    static constexpr unsigned int MIN_RATE = 1000;
+    static constexpr unsigned int MAX_RATE = 96000;
 
     /**
      * Initializes the sample clock hardware.
@@ -47,22 +42,23 @@ public:
     static void stop();
 
     /**
-     * Sets the desired sampling rate, used for the next start() call.
+     * Sets the sampling rate for the next start() call to the closest that
+     * the timer can make to the given rate in Hz.
+     * @return The rate that will be produced, rounded to the nearest Hz, or
+     *         zero (leaving the rate as it was) if the rate is out of range.
      */
-    static void setRate(Rate rate);
+    static unsigned int setRate(unsigned int rate);
 
     /**
-     * Gets the desired sampling rate (SClock::Rate value) casted to an
-     * unsigned int.
+     * Gets the sampling rate in Hz, rounded to the nearest Hz.
      */
-    static unsigned int getRate();
+    static unsigned int getFrequency();
 
 private:
     static GPTDriver *m_timer;
     static unsigned int m_div;
     static unsigned int m_runcount;
-    static const GPTConfig m_timer_config;
-    static const std::array<unsigned int, 6> m_rate_divs;
+    static GPTConfig m_timer_config;
 };
 
 #endif // SCLOCK_HPP_
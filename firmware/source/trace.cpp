@@ -0,0 +1,77 @@
+/**
+ * @file trace.cpp
+ * @brief Records timestamped events for finding timing problems.
+ *
+ * Copyright (C) 2023 Clyne Sullivan
+ *
+ * Distributed under the GNU GPL v3 or later. You should have received a copy of
+ * the GNU General Public License along with this program.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "trace.hpp"
+
+#include <algorithm>
+
+static_assert((Trace::SIZE & (Trace::SIZE - 1)) == 0);
+
+uint32_t Trace::m_mask = 0;
+uint32_t Trace::m_head = 0;
+uint32_t Trace::m_tail = 0;
+uint32_t Trace::m_lost = 0;
+std::array<Trace::Entry, Trace::SIZE> Trace::m_ring = {};
+
+void Trace::enable(uint32_t mask)
+{
+    chSysLock();
+    m_mask = mask & ((1u << static_cast<unsigned int>(Event::Count)) - 1);
+    m_head = 0;
+    m_tail = 0;
+    m_lost = 0;
+    chSysUnlock();
+}
+
+void Trace::record(Event event, uint32_t arg)
+{
+    if (!(m_mask & (1u << static_cast<unsigned int>(event))))
+        return;
+
+    // Callers may already hold the lock, or be in an interrupt.
+    const auto sts = chSysGetStatusAndLockX();
+    auto& entry = m_ring[m_head++ & (SIZE - 1)];
+    entry.time = TIM5->CNT; // See Profiler.
+    entry.event = static_cast<uint16_t>(event);
+    entry.arg = static_cast<uint16_t>(arg);
+    chSysRestoreStatusX(sts);
+}
+
+unsigned int Trace::pending(uint32_t *lost)
+{
+    chSysLock();
+    skipLost();
+    const auto count = m_head - m_tail;
+    *lost += m_lost;
+    m_lost = 0;
+    chSysUnlock();
+    return count;
+}
+
+unsigned int Trace::read(Entry *out, unsigned int count)
+{
+    chSysLock();
+    skipLost();
+    count = std::min(count, m_head - m_tail);
+    for (unsigned int i = 0; i < count; i++)
+        out[i] = m_ring[m_tail++ & (SIZE - 1)];
+    chSysUnlock();
+    return count;
+}
+
+void Trace::skipLost()
+{
+    if (m_head - m_tail > SIZE) {
+        m_lost += m_head - m_tail - SIZE;
+        m_tail = m_head - SIZE;
+    }
+}
+
@@ -0,0 +1,91 @@
+/**
+ * @file trace.hpp
+ * @brief Records timestamped events for finding timing problems.
+ *
+ * Copyright (C) 2023 Clyne Sullivan
+ *
+ * Distributed under the GNU GPL v3 or later. You should have received a copy of
+ * the GNU General Public License along with this program.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STMDSP_TRACE_HPP
+#define STMDSP_TRACE_HPP
+
+#include "ch.h"
+#include "hal.h"
+
+#include <array>
+#include <cstdint>
+
+/**
+ * A ring of events, each stamped with the Profiler counter. Events may be
+ * recorded from any privileged code, in threads or interrupts, but not from
+ * fault handlers. The host enables the events it wants and reads the ring
+ * as it fills; when it falls behind, the oldest events are overwritten and
+ * counted as lost.
+ */
+class Trace
+{
+public:
+    enum class Event : uint16_t {
+        AdcBlock = 0, // ADC filled half of its buffer; arg: the half.
+        MailboxPost,  // Block posted for the algorithm; arg: the message.
+        Overrun,      // arg: 0 if conversion was aborted for falling behind,
+                      // 1 if the low-latency mode dropped a block.
+        RunnerWake,   // Algorithm thread got a block; arg: the message.
+        BlockDone,    // Algorithm thread finished a block.
+        Syscall,      // Service call from the algorithm; arg: its number.
+        Command,      // USB command handled; arg: its letter.
+        Count
+    };
+
+    /**
+     * One recorded event. Sent to the host as is.
+     */
+    struct Entry {
+        uint32_t time;  // Profiler counter.
+        uint16_t event;
+        uint16_t arg;
+    };
+
+    // Entries held; a power of two.
+    static constexpr unsigned int SIZE = 1024;
+
+    /**
+     * Clears the ring and records only the events whose bits (1 << Event)
+     * are set in mask; zero stops recording.
+     */
+    static void enable(uint32_t mask);
+
+    /**
+     * Records the event if it is enabled.
+     */
+    static void record(Event event, uint32_t arg = 0);
+
+    /**
+     * Returns the number of events waiting to be read, and adds the number
+     * lost since the last call to lost.
+     */
+    static unsigned int pending(uint32_t *lost);
+
+    /**
+     * Removes up to count of the oldest events from the ring into out.
+     * Events lost meanwhile are skipped, and reported by the next pending().
+     * @return The number of events copied.
+     */
+    static unsigned int read(Entry *out, unsigned int count);
+
+private:
+    // Drops events that have been overwritten. Called with the system locked.
+    static void skipLost();
+
+    static uint32_t m_mask;
+    static uint32_t m_head; // Events recorded.
+    static uint32_t m_tail; // Events read or lost.
+    static uint32_t m_lost;
+    static std::array<Entry, SIZE> m_ring;
+};
+
+#endif // STMDSP_TRACE_HPP
+
@@ -0,0 +1,30 @@
+/**
+ * 10_fir_window.cpp
+ * Written by Clyne Sullivan.
+ *
+ * The FIR filter of 3_fir.cpp, without the prev[] buffer. Defining BLOCK_WINDOW has the device
+ * keep that many past samples directly in front of each block, so block.in[n - k] is valid for
+ * every k below the filter size and the loops need no branches. This uses the block interface
+ * (ALGORITHM_ABI 2), which gives the algorithm a separate output buffer.
+ */
+
+#define SAMPLE_FORMAT Float
+#define ALGORITHM_ABI 2
+#define BLOCK_WINDOW 31
+
+void process_block(const Block<SampleFloat>& block)
+{
+	// Define the filter (a 32-sample moving average):
+	constexpr unsigned int filter_size = BLOCK_WINDOW + 1;
+	constexpr float coefficient = 1.f / filter_size;
+
+	for (unsigned int n = 0; n < block.length; n++) {
+		// x[-k] is the sample k samples before x[0], even past the start of the block
+		const float *x = block.in + n;
+		float v = 0;
+		for (unsigned int k = 0; k < filter_size; k++)
+			v += x[-int(k)] * coefficient;
+		block.out[n] = v;
+	}
+}
+
@@ -0,0 +1,29 @@
+/**
+ * 11_stereo_balance.cpp
+ * Written by Clyne Sullivan.
+ *
+ * A balance control for two channels (set the device to two channels first). BLOCK_CHANNELS has
+ * the device pass both inputs to each block, and BLOCK_PLANAR puts each channel's samples together:
+ * the first block.length are the left channel, the next block.length the right. The first knob
+ * moves the balance from left to right; the two outputs leave on the device's two DAC channels.
+ */
+
+#define SAMPLE_FORMAT Float
+#define ALGORITHM_ABI 2
+#define BLOCK_FLAGS (BLOCK_CHANNELS | BLOCK_PLANAR | BLOCK_PARAMS)
+
+void process_block(const Block<SampleFloat>& block)
+{
+	// 1. Work out each channel's gain from the knob (0 to 4095):
+	const float balance = block.params[0] / 4095.f;
+	const float gain[2] = { 1.f - balance, balance };
+
+	// 2. Scale each channel; with one channel set, only the first is there
+	for (unsigned int c = 0; c < block.channels; c++) {
+		const float *in = block.in + c * block.length;
+		float *out = block.out + c * block.length;
+		for (unsigned int n = 0; n < block.length; n++)
+			out[n] = in[n] * gain[c];
+	}
+}
+
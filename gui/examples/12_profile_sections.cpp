@@ -0,0 +1,41 @@
+/**
+ * 12_profile_sections.cpp
+ * Written by Clyne Sullivan.
+ *
+ * An adaptive line enhancer: an LMS filter predicts each sample from the ones before it, which
+ * keeps tones and drops noise. PROFILE_BEGIN and PROFILE_END time the filtering and the weight
+ * update separately; open "Profile sections" in the Device menu while running to see where each
+ * block's time goes.
+ */
+
+#define SAMPLE_FORMAT Float
+#define ALGORITHM_ABI 2
+#define BLOCK_WINDOW 32
+#define PROFILE_MARKERS 2
+
+void process_block(const Block<SampleFloat>& block)
+{
+	constexpr unsigned int taps = BLOCK_WINDOW - 1;
+	constexpr float mu = 0.005f;
+	static float w[taps] = {};
+
+	for (unsigned int n = 0; n < block.length; n++) {
+		// Past samples only: x[-1] is the sample before this one
+		const float *x = block.in + n;
+
+		// 1. Section 0, the filter: predict this sample
+		PROFILE_BEGIN(0);
+		float y = 0;
+		for (unsigned int k = 0; k < taps; k++)
+			y += w[k] * x[-int(k) - 1];
+		PROFILE_END(0);
+		block.out[n] = y;
+
+		// 2. Section 1, the adaptive update: move the weights against the error
+		PROFILE_BEGIN(1);
+		const float e = (x[0] - y) * mu;
+		for (unsigned int k = 0; k < taps; k++)
+			w[k] += e * x[-int(k) - 1];
+		PROFILE_END(1);
+	}
+}
@@ -1,12 +1,11 @@
-Sample* process_data(Samples samples)
+#define SAMPLE_FORMAT Float
+
+SampleFloat* process_data(SamplesFloat samples)
 {
-	const auto p = param1();
-	const float scale = p / 4095.f;
-	const auto offset = (4095 -	p) / 2;
+	const float scale = param1() / 4095.f;
 
 	for (int i = 0; i < SIZE; ++i)
-		samples[i] = samples[i] * scale + offset;
+		samples[i] *= scale;
 
-    return samples;
+    return &samples[0];
 }
-
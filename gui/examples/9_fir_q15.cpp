@@ -0,0 +1,31 @@
+/**
+ * 9_fir_q15.cpp
+ * Written by Clyne Sullivan.
+ *
+ * The FIR filter of 4_fir_pro.cpp in Q15 fixed point. Defining SAMPLE_FORMAT as Q15 has the device
+ * convert samples to signed Q15 (-32768 to 32767) before process_data() and back afterwards, and
+ * the Q15 kernels in dsp.hpp do two multiply-accumulates per instruction, so longer filters can
+ * run in the same time.
+ */
+
+#define SAMPLE_FORMAT Q15
+
+SampleQ15* process_data(SamplesQ15 samples)
+{
+	// 1. Define our filter (a 100-sample moving average): 0.01 in Q15 is 328
+	constexpr unsigned int filter_size = 100;
+	static int16_t filter[filter_size];
+	if (filter[0] == 0) {
+		for (auto& c : filter)
+			c = 328;
+	}
+
+	// 2. Create the filter for blocks of SIZE samples
+	static dsp::FirQ15<filter_size, SIZE> fir (filter);
+
+	// 3. Compute the FIR in place
+	fir.process(&samples[0], &samples[0], SIZE);
+
+	return &samples[0];
+}
+
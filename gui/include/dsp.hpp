@@ -0,0 +1,563 @@
+/**
+ * @file dsp.hpp
+ * @brief Common signal processing kernels for algorithms.
+ *
+ * Copyright (C) 2023 Clyne Sullivan
+ *
+ * Distributed under the GNU GPL v3 or later. You should have received a copy of
+ * the GNU General Public License along with this program.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STMDSP_DSP_HPP
+#define STMDSP_DSP_HPP
+
+#include <cstdint>
+
+#if defined(__ARM_FEATURE_SIMD32)
+#include <arm_acle.h>
+#endif
+
+/**
+ * Float kernels written for the Cortex-M4/M7 FPU: inner loops keep four
+ * independent accumulators so that each multiply-accumulate does not wait on
+ * the previous one, and FIR loops reuse each loaded sample for four outputs.
+ * Filters keep their own history, so blocks can be processed one after
+ * another. Filter objects have constexpr constructors; declare them static
+ * with static coefficient arrays to avoid any run-time initialization.
+ *
+ * Q15 kernels (for SAMPLE_FORMAT Q15) use the DSP extension's packed 16-bit
+ * instructions, which do two multiply-accumulates at once, and saturate
+ * their results. Without the extension (e.g. on a PC) they fall back to
+ * plain C++.
+ */
+namespace dsp {
+
+namespace detail {
+    // Returns sum(b[taps - 1 - m] * x[m]): one FIR output, with x pointing
+    // to the oldest of the taps samples involved.
+    inline float convolve(const float *__restrict b, const float *__restrict x, unsigned int taps)
+    {
+        const float *c = b + taps;
+        float a0 = 0, a1 = 0, a2 = 0, a3 = 0;
+        unsigned int m = 0;
+        for (; m + 4 <= taps; m += 4) {
+            a0 += *--c * x[m];
+            a1 += *--c * x[m + 1];
+            a2 += *--c * x[m + 2];
+            a3 += *--c * x[m + 3];
+        }
+        for (; m < taps; ++m)
+            a0 += *--c * x[m];
+        return (a0 + a1) + (a2 + a3);
+    }
+
+    inline void copy(const float *in, float *out, unsigned int n)
+    {
+        for (unsigned int i = 0; i < n; ++i)
+            out[i] = in[i];
+    }
+
+    inline void copy(const int16_t *in, int16_t *out, unsigned int n)
+    {
+        for (unsigned int i = 0; i < n; ++i)
+            out[i] = in[i];
+    }
+
+    // Packed Q15 pairs: the first value is in the low half of the word.
+    inline uint32_t load2(const int16_t *p)
+    {
+        uint32_t w;
+        __builtin_memcpy(&w, p, sizeof(w));
+        return w;
+    }
+
+    inline void store2(int16_t *p, uint32_t w)
+    {
+        __builtin_memcpy(p, &w, sizeof(w));
+    }
+
+    inline uint32_t pack(int32_t lo, int32_t hi)
+    {
+        return (static_cast<uint32_t>(lo) & 0xFFFF) | (static_cast<uint32_t>(hi) << 16);
+    }
+
+    inline int32_t lo(uint32_t w) { return static_cast<int16_t>(w & 0xFFFF); }
+    inline int32_t hi(uint32_t w) { return static_cast<int16_t>(w >> 16); }
+
+#if defined(__ARM_FEATURE_SIMD32)
+    // acc + lo(a) * lo(b) + hi(a) * hi(b)
+    inline int64_t smlald(uint32_t a, uint32_t b, int64_t acc)
+        { return __smlald(static_cast<int32_t>(a), static_cast<int32_t>(b), acc); }
+    // acc + lo(a) * hi(b) + hi(a) * lo(b)
+    inline int64_t smlaldx(uint32_t a, uint32_t b, int64_t acc)
+        { return __smlaldx(static_cast<int32_t>(a), static_cast<int32_t>(b), acc); }
+    // acc + lo(a) * lo(b) - hi(a) * hi(b)
+    inline int64_t smlsld(uint32_t a, uint32_t b, int64_t acc)
+        { return __smlsld(static_cast<int32_t>(a), static_cast<int32_t>(b), acc); }
+    // Saturating add of each half.
+    inline uint32_t qadd16(uint32_t a, uint32_t b)
+        { return static_cast<uint32_t>(__qadd16(static_cast<int32_t>(a), static_cast<int32_t>(b))); }
+    inline int32_t ssat16(int32_t x) { return __ssat(x, 16); }
+#else
+    inline int64_t smlald(uint32_t a, uint32_t b, int64_t acc)
+        { return acc + lo(a) * lo(b) + hi(a) * hi(b); }
+    inline int64_t smlaldx(uint32_t a, uint32_t b, int64_t acc)
+        { return acc + lo(a) * hi(b) + hi(a) * lo(b); }
+    inline int64_t smlsld(uint32_t a, uint32_t b, int64_t acc)
+        { return acc + lo(a) * lo(b) - hi(a) * hi(b); }
+    inline int32_t ssat16(int32_t x) { return x < -32768 ? -32768 : (x > 32767 ? 32767 : x); }
+    inline uint32_t qadd16(uint32_t a, uint32_t b)
+        { return pack(ssat16(lo(a) + lo(b)), ssat16(hi(a) + hi(b))); }
+#endif
+
+    // Rounds a Q30 (or shifted) accumulator to a saturated Q15 value.
+    inline int16_t round15(int64_t acc, unsigned int shift = 15)
+    {
+        const int64_t r = (acc + (int64_t(1) << (shift - 1))) >> shift;
+        return static_cast<int16_t>(r < -32768 ? -32768 : (r > 32767 ? 32767 : r));
+    }
+}
+
+/**
+ * Converts 12-bit samples (0-4095) to floats in [-1, 1).
+ */
+inline void toFloat(const uint16_t *__restrict in, float *__restrict out, unsigned int n)
+{
+    for (unsigned int i = 0; i < n; ++i)
+        out[i] = static_cast<float>(in[i]) * (1.f / 2048.f) - 1.f;
+}
+
+/**
+ * Converts floats in [-1, 1) to 12-bit samples, saturating values out of range.
+ */
+inline void toSamples(const float *__restrict in, uint16_t *__restrict out, unsigned int n)
+{
+    for (unsigned int i = 0; i < n; ++i) {
+        float s = in[i] * 2048.f + 2048.f;
+        s = s < 0.f ? 0.f : (s > 4095.f ? 4095.f : s);
+        out[i] = static_cast<uint16_t>(s);
+    }
+}
+
+/**
+ * Returns the sum of a[i] * b[i].
+ */
+inline float dot(const float *a, const float *b, unsigned int n)
+{
+    float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    unsigned int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 += a[i] * b[i];
+        s1 += a[i + 1] * b[i + 1];
+        s2 += a[i + 2] * b[i + 2];
+        s3 += a[i + 3] * b[i + 3];
+    }
+    for (; i < n; ++i)
+        s0 += a[i] * b[i];
+    return (s0 + s1) + (s2 + s3);
+}
+
+/**
+ * out[i] = in[i] * gain + offset. In and out may be the same buffer.
+ */
+inline void scale(const float *in, float *out, unsigned int n, float gain, float offset = 0)
+{
+    for (unsigned int i = 0; i < n; ++i)
+        out[i] = in[i] * gain + offset;
+}
+
+/**
+ * out[i] = a[i] + b[i]. Out may be either input.
+ */
+inline void add(const float *a, const float *b, float *out, unsigned int n)
+{
+    for (unsigned int i = 0; i < n; ++i)
+        out[i] = a[i] + b[i];
+}
+
+/**
+ * out[i] = a[i] * b[i]. Out may be either input.
+ */
+inline void multiply(const float *a, const float *b, float *out, unsigned int n)
+{
+    for (unsigned int i = 0; i < n; ++i)
+        out[i] = a[i] * b[i];
+}
+
+/**
+ * Finds the smallest and largest of n (at least one) values.
+ */
+inline void minmax(const float *in, unsigned int n, float& min, float& max)
+{
+    float lo = in[0], hi = in[0];
+    for (unsigned int i = 1; i < n; ++i) {
+        lo = in[i] < lo ? in[i] : lo;
+        hi = in[i] > hi ? in[i] : hi;
+    }
+    min = lo;
+    max = hi;
+}
+
+/**
+ * out[i] = a[i] + b[i] for Q15 values, saturating. Out may be either input.
+ */
+inline void add(const int16_t *a, const int16_t *b, int16_t *out, unsigned int n)
+{
+    unsigned int i = 0;
+    for (; i + 2 <= n; i += 2)
+        detail::store2(out + i, detail::qadd16(detail::load2(a + i), detail::load2(b + i)));
+    if (i < n)
+        out[i] = static_cast<int16_t>(detail::ssat16(a[i] + b[i]));
+}
+
+/**
+ * Mixes two Q15 signals: out[i] = gainA * a[i] + gainB * b[i], with Q15
+ * gains and saturated results. Out may be either input.
+ */
+inline void mix(const int16_t *a, const int16_t *b, int16_t *out, unsigned int n,
+                int16_t gainA, int16_t gainB)
+{
+    const uint32_t g = detail::pack(gainA, gainB);
+    unsigned int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        const uint32_t aw = detail::load2(a + i);
+        const uint32_t bw = detail::load2(b + i);
+        const auto y0 = detail::smlald(g, detail::pack(detail::lo(aw), detail::lo(bw)), 0);
+        const auto y1 = detail::smlald(g, detail::pack(detail::hi(aw), detail::hi(bw)), 0);
+        out[i] = detail::round15(y0);
+        out[i + 1] = detail::round15(y1);
+    }
+    if (i < n)
+        out[i] = detail::round15(detail::smlald(g, detail::pack(a[i], b[i]), 0));
+}
+
+inline float mean(const float *in, unsigned int n)
+{
+    float s0 = 0, s1 = 0;
+    unsigned int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        s0 += in[i];
+        s1 += in[i + 1];
+    }
+    if (i < n)
+        s0 += in[i];
+    return (s0 + s1) / static_cast<float>(n);
+}
+
+/**
+ * Returns the root-mean-square of the values.
+ */
+inline float rms(const float *in, unsigned int n)
+{
+    return __builtin_sqrtf(dot(in, in, n) / static_cast<float>(n));
+}
+
+/**
+ * Block FIR filter with Taps coefficients, for blocks of up to MaxBlock.
+ */
+template<unsigned int Taps, unsigned int MaxBlock>
+class Fir
+{
+    static_assert(Taps > 0);
+
+public:
+    // coeffs points to Taps coefficients, b0 first; it is not copied.
+    constexpr explicit Fir(const float *coeffs) :
+        m_coeffs(coeffs) {}
+
+    // Filters n (up to MaxBlock) samples. In and out may be the same buffer.
+    void process(const float *in, float *out, unsigned int n) {
+        float *x = m_state;
+        detail::copy(in, x + Taps - 1, n);
+
+        // Four outputs at a time: each sample loaded serves all four.
+        unsigned int i = 0;
+        for (; i + 4 <= n; i += 4) {
+            const float *c = m_coeffs + Taps;
+            const float *xp = x + i;
+            float a0 = 0, a1 = 0, a2 = 0, a3 = 0;
+            float x0 = xp[0], x1 = xp[1], x2 = xp[2];
+            for (unsigned int k = 0; k < Taps; ++k) {
+                const float b = *--c;
+                const float x3 = xp[k + 3];
+                a0 += b * x0;
+                a1 += b * x1;
+                a2 += b * x2;
+                a3 += b * x3;
+                x0 = x1;
+                x1 = x2;
+                x2 = x3;
+            }
+            out[i] = a0;
+            out[i + 1] = a1;
+            out[i + 2] = a2;
+            out[i + 3] = a3;
+        }
+        for (; i < n; ++i)
+            out[i] = detail::convolve(m_coeffs, x + i, Taps);
+
+        // Keep the last Taps - 1 inputs for the next block.
+        detail::copy(x + n, x, Taps - 1);
+    }
+
+    void reset() {
+        for (auto& s : m_state)
+            s = 0;
+    }
+
+private:
+    const float *m_coeffs;
+    float m_state[Taps - 1 + MaxBlock] = {};
+};
+
+/**
+ * Cascade of Stages biquad sections in transposed direct form II.
+ */
+template<unsigned int Stages>
+class Biquad
+{
+public:
+    // coeffs points to Stages sets of { b0, b1, b2, a1, a2 }, each computing
+    //   y[n] = b0 x[n] + b1 x[n-1] + b2 x[n-2] - a1 y[n-1] - a2 y[n-2]
+    // It is not copied.
+    constexpr explicit Biquad(const float *coeffs) :
+        m_coeffs(coeffs) {}
+
+    // Filters n samples. In and out may be the same buffer.
+    void process(const float *in, float *out, unsigned int n) {
+        // Stage by stage, so that each stage's coefficients and state stay
+        // in registers for the whole block.
+        const float *src = in;
+        for (unsigned int s = 0; s < Stages; ++s) {
+            const float *c = m_coeffs + s * 5;
+            const float b0 = c[0], b1 = c[1], b2 = c[2], a1 = c[3], a2 = c[4];
+            float d1 = m_state[s][0], d2 = m_state[s][1];
+            for (unsigned int i = 0; i < n; ++i) {
+                const float x = src[i];
+                const float y = b0 * x + d1;
+                d1 = b1 * x - a1 * y + d2;
+                d2 = b2 * x - a2 * y;
+                out[i] = y;
+            }
+            m_state[s][0] = d1;
+            m_state[s][1] = d2;
+            src = out;
+        }
+    }
+
+    void reset() {
+        for (auto& s : m_state)
+            s[0] = s[1] = 0;
+    }
+
+private:
+    const float *m_coeffs;
+    float m_state[Stages][2] = {};
+};
+
+/**
+ * FIR filter and decimator: only the kept outputs are computed.
+ * Input blocks of up to MaxBlock must be multiples of Factor.
+ */
+template<unsigned int Taps, unsigned int Factor, unsigned int MaxBlock>
+class Decimator
+{
+    static_assert(Taps > 0 && Factor > 0);
+
+public:
+    // coeffs points to Taps anti-aliasing coefficients, b0 first.
+    constexpr explicit Decimator(const float *coeffs) :
+        m_coeffs(coeffs) {}
+
+    // Filters n inputs into n / Factor outputs. In and out may be the same buffer.
+    void process(const float *in, float *out, unsigned int n) {
+        float *x = m_state;
+        detail::copy(in, x + Taps - 1, n);
+
+        for (unsigned int i = Factor - 1, j = 0; i < n; i += Factor, ++j)
+            out[j] = detail::convolve(m_coeffs, x + i, Taps);
+
+        detail::copy(x + n, x, Taps - 1);
+    }
+
+    void reset() {
+        for (auto& s : m_state)
+            s = 0;
+    }
+
+private:
+    const float *m_coeffs;
+    float m_state[Taps - 1 + MaxBlock] = {};
+};
+
+/**
+ * Polyphase interpolator: inserts Factor - 1 zeros between samples and
+ * applies a Taps long FIR filter, skipping the products with zeros.
+ * Taps must be a multiple of Factor, and the coefficients should have a
+ * DC gain of Factor to keep the signal level.
+ */
+template<unsigned int Taps, unsigned int Factor, unsigned int MaxBlock>
+class Interpolator
+{
+    static_assert(Factor > 0 && Taps % Factor == 0);
+    static constexpr unsigned int PhaseLength = Taps / Factor;
+
+public:
+    // coeffs points to Taps coefficients, b0 first.
+    constexpr explicit Interpolator(const float *coeffs) :
+        m_coeffs(coeffs) {}
+
+    // Produces n * Factor outputs from n inputs. Out may not overlap in.
+    void process(const float *__restrict in, float *__restrict out, unsigned int n) {
+        float *x = m_state;
+        detail::copy(in, x + PhaseLength - 1, n);
+
+        // Output i * Factor + p = sum(b[p + j * Factor] * x[i - j]).
+        for (unsigned int i = 0; i < n; ++i) {
+            const float *xi = x + i + PhaseLength - 1;
+            for (unsigned int p = 0; p < Factor; ++p) {
+                float acc = 0;
+                for (unsigned int j = 0; j < PhaseLength; ++j)
+                    acc += m_coeffs[p + j * Factor] * *(xi - j);
+                *out++ = acc;
+            }
+        }
+
+        detail::copy(x + n, x, PhaseLength - 1);
+    }
+
+    void reset() {
+        for (auto& s : m_state)
+            s = 0;
+    }
+
+private:
+    const float *m_coeffs;
+    float m_state[PhaseLength - 1 + MaxBlock] = {};
+};
+
+/**
+ * Block FIR filter on Q15 samples with Taps Q15 coefficients, for blocks of
+ * up to MaxBlock. Products are summed in 64 bits, so only the result
+ * saturates.
+ */
+template<unsigned int Taps, unsigned int MaxBlock>
+class FirQ15
+{
+    static_assert(Taps > 0);
+
+public:
+    // coeffs points to Taps coefficients, b0 first; it is not copied.
+    constexpr explicit FirQ15(const int16_t *coeffs) :
+        m_coeffs(coeffs) {}
+
+    // Filters n (up to MaxBlock) samples. In and out may be the same buffer.
+    void process(const int16_t *in, int16_t *out, unsigned int n) {
+        int16_t *x = m_state;
+        detail::copy(in, x + Taps - 1, n);
+
+        // Two outputs at a time, two taps per instruction. The samples for
+        // the second output are one sample ahead, so they are packed from
+        // the halves of neighbouring words instead of loaded again.
+        unsigned int i = 0;
+        for (; i + 2 <= n; i += 2) {
+            const int16_t *xp = x + i;
+            int64_t a0 = 0, a1 = 0;
+            uint32_t x01 = detail::load2(xp);
+            unsigned int m = 0;
+            for (; m + 2 <= Taps; m += 2) {
+                const uint32_t b = detail::load2(m_coeffs + Taps - 2 - m);
+                const uint32_t x23 = detail::load2(xp + m + 2);
+                a0 = detail::smlaldx(x01, b, a0);
+                a1 = detail::smlaldx(detail::pack(detail::hi(x01), detail::lo(x23)), b, a1);
+                x01 = x23;
+            }
+            if (m < Taps) {
+                a0 += detail::lo(x01) * m_coeffs[0];
+                a1 += detail::hi(x01) * m_coeffs[0];
+            }
+            out[i] = detail::round15(a0);
+            out[i + 1] = detail::round15(a1);
+        }
+        if (i < n) {
+            int64_t a0 = 0;
+            for (unsigned int m = 0; m < Taps; ++m)
+                a0 += x[i + m] * m_coeffs[Taps - 1 - m];
+            out[i] = detail::round15(a0);
+        }
+
+        // Keep the last Taps - 1 inputs for the next block.
+        detail::copy(x + n, x, Taps - 1);
+    }
+
+    void reset() {
+        for (auto& s : m_state)
+            s = 0;
+    }
+
+private:
+    const int16_t *m_coeffs;
+    // One extra sample, as the paired loads may read one past the block.
+    alignas(4) int16_t m_state[Taps + MaxBlock] = {};
+};
+
+/**
+ * Cascade of Stages biquad sections on Q15 samples, in direct form I.
+ */
+template<unsigned int Stages>
+class BiquadQ15
+{
+public:
+    // coeffs points to Stages sets of Q15 { b0, b1, b2, a1, a2 }, as for
+    // Biquad, scaled by 2^-postShift so that they fit in Q15 (a1 often
+    // needs postShift = 1). It is not copied.
+    constexpr explicit BiquadQ15(const int16_t *coeffs, unsigned int postShift = 1) :
+        m_coeffs(coeffs), m_shift(15 - postShift) {}
+
+    // Filters n samples. In and out may be the same buffer.
+    void process(const int16_t *in, int16_t *out, unsigned int n) {
+        const int16_t *src = in;
+        for (unsigned int s = 0; s < Stages; ++s) {
+            const int16_t *c = m_coeffs + s * 5;
+            const uint32_t b01 = detail::pack(c[0], c[1]);
+            const uint32_t b2a1 = detail::pack(c[2], c[3]);
+            const int32_t a2 = c[4];
+            int32_t x1 = m_state[s][0], x2 = m_state[s][1];
+            int32_t y1 = m_state[s][2], y2 = m_state[s][3];
+            for (unsigned int i = 0; i < n; ++i) {
+                const int32_t x = src[i];
+                // b0 x + b1 x1, then + b2 x2 - a1 y1, then - a2 y2.
+                int64_t acc = detail::smlald(b01, detail::pack(x, x1), 0);
+                acc = detail::smlsld(b2a1, detail::pack(x2, y1), acc);
+                acc -= a2 * y2;
+                const int16_t y = detail::round15(acc, m_shift);
+                x2 = x1;
+                x1 = x;
+                y2 = y1;
+                y1 = y;
+                out[i] = y;
+            }
+            m_state[s][0] = static_cast<int16_t>(x1);
+            m_state[s][1] = static_cast<int16_t>(x2);
+            m_state[s][2] = static_cast<int16_t>(y1);
+            m_state[s][3] = static_cast<int16_t>(y2);
+            src = out;
+        }
+    }
+
+    void reset() {
+        for (auto& s : m_state)
+            s[0] = s[1] = s[2] = s[3] = 0;
+    }
+
+private:
+    const int16_t *m_coeffs;
+    unsigned int m_shift;
+    int16_t m_state[Stages][4] = {};
+};
+
+} // namespace dsp
+
+#endif // STMDSP_DSP_HPP
+
@@ -0,0 +1,317 @@
+/**
+ * @file fastmath.hpp
+ * @brief Fast transcendental functions for algorithms.
+ *
+ * Copyright (C) 2023 Clyne Sullivan
+ *
+ * Distributed under the GNU GPL v3 or later. You should have received a copy of
+ * the GNU General Public License along with this program.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STMDSP_FASTMATH_HPP
+#define STMDSP_FASTMATH_HPP
+
+#include <bit>
+#include <cstdint>
+
+/**
+ * Table and polynomial approximations that run in the algorithm itself,
+ * avoiding the service call (and libm) behind sin(), cos() and friends.
+ * Every function takes an accuracy tier as a template parameter:
+ *
+ *   fastmath::sin(x)                    // Medium
+ *   fastmath::sin<fastmath::Fast>(x)
+ *
+ * Maximum errors below were measured in float against double-precision
+ * results (trigonometric functions over +/-100 radians), and are checked by
+ * gui/test/fastmath_test.cpp. Polynomials are
+ * minimax fits. Trigonometric inputs should be within +/-10^5 radians;
+ * beyond that, range reduction loses precision.
+ */
+namespace fastmath {
+
+enum Accuracy {
+    Fast,    // About 1e-4: fine for control signals and soft clipping.
+    Medium,  // About 1e-6: most audio uses.
+    Precise  // Close to float precision.
+};
+
+namespace detail {
+    constexpr float PI = 3.14159265358979f;
+    constexpr float TWO_PI = 6.28318530717959f;
+    constexpr float LN2 = 0.693147180559945f;
+
+    // Constants split in two so that multiples of the first part are exact,
+    // keeping range reduction accurate for larger multiples.
+    constexpr float PI_HI = 3.140625f;
+    constexpr float PI_LO = 9.67653589793e-4f;
+    constexpr float LN2_HI = 0.693145751953125f;
+    constexpr float LN2_LO = 1.42860682030942e-6f;
+    constexpr float SQRT2 = 1.41421356237310f;
+
+    // Rounds to the nearest integer; float-to-int conversion truncates.
+    inline int32_t round(float x) {
+        return static_cast<int32_t>(x + (x < 0.f ? -0.5f : 0.5f));
+    }
+
+    template<unsigned int N>
+    constexpr float horner(const float (&c)[N], float x) {
+        float r = c[N - 1];
+        for (unsigned int i = N - 1; i > 0; --i)
+            r = r * x + c[i - 1];
+        return r;
+    }
+
+    // Sine table for the Fast tier, with a guard entry for interpolation.
+    constexpr unsigned int SINE_TABLE_SIZE = 256;
+
+    consteval double sineTaylor(double x) {
+        // Reduce to [-pi, pi]; the series converges well within 20 terms.
+        constexpr double pi = 3.14159265358979323846;
+        if (x > pi)
+            x -= 2 * pi;
+        double term = x, sum = x;
+        for (int n = 1; n < 20; ++n) {
+            term *= -x * x / ((2 * n) * (2 * n + 1));
+            sum += term;
+        }
+        return sum;
+    }
+
+    consteval auto makeSineTable() {
+        struct { float v[SINE_TABLE_SIZE + 1]; } t {};
+        for (unsigned int i = 0; i <= SINE_TABLE_SIZE; ++i)
+            t.v[i] = static_cast<float>(sineTaylor(2 * 3.14159265358979323846 * i / SINE_TABLE_SIZE));
+        return t;
+    }
+
+    inline constexpr auto sineTable = makeSineTable();
+
+    // sin(r) / r as a polynomial in r^2, for r in [-pi/2, pi/2].
+    constexpr float SIN_MEDIUM[] = {
+        0.999999061580973f, -0.166655542945878f, 0.00831190133989782f,
+        -0.000184881742953223f
+    };
+    constexpr float SIN_PRECISE[] = {
+        0.999999994690001f, -0.166666566859971f, 0.00833302516631996f,
+        -0.000198074201368482f, 2.60190550717665e-06f
+    };
+
+    // e^r for r in [-ln(2)/2, ln(2)/2].
+    constexpr float EXP_FAST[] = {
+        0.999928072917078f, 1.00016418717869f, 0.50496328624984f,
+        0.165668422537189f
+    };
+    constexpr float EXP_MEDIUM[] = {
+        0.999999261437644f, 0.999963404596854f, 0.500043586895613f,
+        0.167909076545897f, 0.0414586080556637f
+    };
+    constexpr float EXP_PRECISE[] = {
+        1.0000000716553f, 0.999999691988848f, 0.49998894844774f,
+        0.166675747333297f, 0.0419153827214637f, 0.00829765506798024f
+    };
+
+    // ln(m) / t as a polynomial in t^2, where t = (m - 1) / (m + 1) and m is
+    // in [sqrt(2)/2, sqrt(2)).
+    constexpr float LOG_FAST[] = {
+        1.99988804785558f, 0.681734205201091f
+    };
+    constexpr float LOG_MEDIUM[] = {
+        2.0000008370412f, 0.66644077978698f, 0.4151770831248f
+    };
+    constexpr float LOG_PRECISE[] = {
+        1.9999999937438f, 0.666669484515772f, 0.399657948477455f,
+        0.301003299252375f
+    };
+
+    // atan(x) / x as a polynomial in x^2, for x in [0, 1].
+    constexpr float ATAN_FAST[] = {
+        0.999213809703647f, -0.321174936023556f, 0.146264378704009f,
+        -0.0389864556896396f
+    };
+    constexpr float ATAN_MEDIUM[] = {
+        0.999977219012144f, -0.332622825804339f, 0.193540361340057f,
+        -0.116426441942883f, 0.0526473054554281f, -0.011719116901852f
+    };
+    constexpr float ATAN_PRECISE[] = {
+        0.999999335576817f, -0.3332986077496f, 0.19946565521164f,
+        -0.139086288121405f, 0.0964219525957526f, -0.055912296406064f,
+        0.0218629355202538f, -0.00405456070294308f
+    };
+
+    // Returns 2^k for k in [-126, 127].
+    inline float pow2(int32_t k) {
+        return std::bit_cast<float>(static_cast<uint32_t>(k + 127) << 23);
+    }
+
+    inline float sinTurns(float p) {
+        // p is the angle scaled so that SINE_TABLE_SIZE is a full turn.
+        int32_t i = static_cast<int32_t>(p);
+        if (p < static_cast<float>(i))
+            --i;
+        const float f = p - static_cast<float>(i);
+        const auto n = static_cast<uint32_t>(i) & (SINE_TABLE_SIZE - 1);
+        return sineTable.v[n] + f * (sineTable.v[n + 1] - sineTable.v[n]);
+    }
+
+    // Returns sin(x + offset * pi) for offset = 0 or 0.5, using
+    // sin(y) = (-1)^n * sin(y - n * pi).
+    template<Accuracy A>
+    float sinPoly(float x, float offset) {
+        const int32_t n = round(x * (1.f / PI) + offset);
+        const float fn = static_cast<float>(n) - offset;
+        const float r = (x - fn * PI_HI) - fn * PI_LO;
+        const float r2 = r * r;
+        const float s = r * (A == Precise ? horner(SIN_PRECISE, r2) : horner(SIN_MEDIUM, r2));
+        return (n & 1) ? -s : s;
+    }
+}
+
+/**
+ * Sine of x radians.
+ * Max absolute error: Fast 7.6e-5 (table), Medium 1.1e-6, Precise 1.6e-7.
+ */
+template<Accuracy A = Medium>
+float sin(float x) {
+    if constexpr (A == Fast)
+        return detail::sinTurns(x * (detail::SINE_TABLE_SIZE / detail::TWO_PI));
+    else
+        return detail::sinPoly<A>(x, 0.f);
+}
+
+/**
+ * Cosine of x radians.
+ * Max absolute error: Fast 7.6e-5 (table), Medium 1.1e-6, Precise 1.6e-7.
+ */
+template<Accuracy A = Medium>
+float cos(float x) {
+    if constexpr (A == Fast)
+        return detail::sinTurns(x * (detail::SINE_TABLE_SIZE / detail::TWO_PI) +
+                                   detail::SINE_TABLE_SIZE / 4);
+    else
+        return detail::sinPoly<A>(x, 0.5f);
+}
+
+/**
+ * e^x. Results are limited to the normal float range, [e^-87, e^88].
+ * Max relative error: Fast 7.5e-5, Medium 2.7e-6, Precise 2.2e-7.
+ */
+template<Accuracy A = Medium>
+float exp(float x) {
+    // e^x = 2^k * e^r with |r| <= ln(2) / 2.
+    x = x < 88.f ? (x > -87.f ? x : -87.f) : 88.f;
+    const int32_t k = detail::round(x * (1.f / detail::LN2));
+    const float fk = static_cast<float>(k);
+    const float r = (x - fk * detail::LN2_HI) - fk * detail::LN2_LO;
+
+    float p;
+    if constexpr (A == Fast)
+        p = detail::horner(detail::EXP_FAST, r);
+    else if constexpr (A == Medium)
+        p = detail::horner(detail::EXP_MEDIUM, r);
+    else
+        p = detail::horner(detail::EXP_PRECISE, r);
+    return p * detail::pow2(k);
+}
+
+/**
+ * Natural logarithm of x, for normal positive floats. Returns -infinity for
+ * zero and NaN for negative x.
+ * Max absolute error for x in [1e-3, 1e3]: Fast 4.2e-6, Medium 3.5e-7,
+ * Precise 3.1e-7. Further out, rounding of the (large) result dominates.
+ */
+template<Accuracy A = Medium>
+float log(float x) {
+    if (!(x > 0.f))
+        return x == 0.f ? -__builtin_inff() : __builtin_nanf("");
+
+    // x = m * 2^e with m in [sqrt(2)/2, sqrt(2)).
+    const auto bits = std::bit_cast<uint32_t>(x);
+    int32_t e = static_cast<int32_t>(bits >> 23) - 127;
+    float m = std::bit_cast<float>((bits & 0x007FFFFFu) | 0x3F800000u);
+    if (m >= detail::SQRT2) {
+        m *= 0.5f;
+        ++e;
+    }
+
+    const float t = (m - 1.f) / (m + 1.f);
+    const float t2 = t * t;
+    float p;
+    if constexpr (A == Fast)
+        p = detail::horner(detail::LOG_FAST, t2);
+    else if constexpr (A == Medium)
+        p = detail::horner(detail::LOG_MEDIUM, t2);
+    else
+        p = detail::horner(detail::LOG_PRECISE, t2);
+    const float fe = static_cast<float>(e);
+    return fe * detail::LN2_HI + (t * p + fe * detail::LN2_LO);
+}
+
+/**
+ * Hyperbolic tangent, e.g. for soft clipping.
+ * Max absolute error: Fast 3.7e-5, Medium 1.3e-6, Precise 1.2e-7.
+ */
+template<Accuracy A = Medium>
+float tanh(float x) {
+    // tanh(|x|) = (1 - e^-2|x|) / (1 + e^-2|x|), which cannot overflow.
+    const float ax = x < 0.f ? -x : x;
+    const float t = exp<A>(-2.f * ax);
+    const float r = (1.f - t) / (1.f + t);
+    return x < 0.f ? -r : r;
+}
+
+/**
+ * Angle of the point (x, y) in radians, in [-pi, pi].
+ * Max absolute error: Fast 8.2e-5, Medium 1.9e-6, Precise 2.9e-7.
+ */
+template<Accuracy A = Medium>
+float atan2(float y, float x) {
+    const float ax = x < 0.f ? -x : x;
+    const float ay = y < 0.f ? -y : y;
+    if (ax == 0.f && ay == 0.f)
+        return 0.f;
+
+    // atan of the ratio within [0, 1], then unfold the octant.
+    const bool swap = ay > ax;
+    const float a = swap ? ax / ay : ay / ax;
+    const float a2 = a * a;
+    float r;
+    if constexpr (A == Fast)
+        r = a * detail::horner(detail::ATAN_FAST, a2);
+    else if constexpr (A == Medium)
+        r = a * detail::horner(detail::ATAN_MEDIUM, a2);
+    else
+        r = a * detail::horner(detail::ATAN_PRECISE, a2);
+
+    if (swap)
+        r = detail::PI / 2 - r;
+    if (x < 0.f)
+        r = detail::PI - r;
+    return y < 0.f ? -r : r;
+}
+
+/**
+ * x raised to the power y, computed as e^(y * ln(x)). Negative x is only
+ * supported for integer y. The relative error grows with |y * ln(x)|; while
+ * that is below 10 it is at most 9.5e-5 (Fast), 3.8e-6 (Medium) or 1.3e-6
+ * (Precise).
+ */
+template<Accuracy A = Medium>
+float pow(float x, float y) {
+    if (x > 0.f)
+        return exp<A>(y * log<A>(x));
+    else if (x == 0.f)
+        return y > 0.f ? 0.f : y == 0.f ? 1.f : __builtin_inff();
+
+    const auto n = static_cast<int32_t>(y);
+    if (static_cast<float>(n) != y)
+        return __builtin_nanf("");
+    const float r = exp<A>(y * log<A>(-x));
+    return (n & 1) ? -r : r;
+}
+
+} // namespace fastmath
+
+#endif // STMDSP_FASTMATH_HPP
+
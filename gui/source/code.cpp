@@ -9,11 +9,14 @@
  * If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include "code.hpp"
 #include "main.hpp"
 #include "stmdsp.hpp"
 #include "stmdsp_code.hpp"
 
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
@@ -71,6 +74,11 @@ void compileEditorCode(const std::string& code)
     const auto platform = m_device ? m_device->get_platform()
                                    : stmdsp::platform::L4;
 
+    if (platform != stmdsp::platform::L4) {
+        std::ofstream ldfile (tempFileName + ".ld", std::ios::trunc | std::ios::binary);
+        ldfile << stmdsp::linker_script_h7;
+    }
+
     {
         std::ofstream file (tempFileName, std::ios::trunc | std::ios::binary);
 
@@ -82,7 +90,7 @@ void compileEditorCode(const std::string& code)
 
         stringReplaceAll(file_text, "$0", std::to_string(buffer_size));
 
-        file << file_text << '\n' << code;
+        file << file_text << '\n' << code << stmdsp::file_footer;
     }
 
     const auto scriptFile = tempFileName +
@@ -117,6 +125,7 @@ void compileEditorCode(const std::string& code)
         log("Compilation failed.");
 
     std::filesystem::remove(tempFileName);
+    std::filesystem::remove(tempFileName + ".ld");
     std::filesystem::remove(scriptFile);
 }
 
@@ -138,6 +147,51 @@ void disassembleCode()
         log("Failed to load disassembly.");
 }
 
+std::vector<CodeInstruction> disassembleCodeInstructions()
+{
+    std::vector<CodeInstruction> instructions;
+    if (tempFileName.empty())
+        return instructions;
+
+    const auto output = tempFileName + ".asm";
+    const auto command =
+        std::string("arm-none-eabi-objdump -d -C --no-show-raw-insn ") +
+        tempFileName + ".orig.o > " + output + " 2>&1";
+
+    if (system(command.c_str()) == 0) {
+        // Symbols are given as "00000010 <name>:", and instructions as
+        // "  10:<tab>mnemonic<tab>operands".
+        std::ifstream file (output);
+        std::string function;
+        for (std::string line; std::getline(file, line);) {
+            const auto open = line.find(" <");
+            const auto colon = line.find(':');
+            if (line.empty() || colon == std::string::npos)
+                continue;
+
+            if (line[0] != ' ' && open != std::string::npos && line.ends_with(">:")) {
+                function = line.substr(open + 2, line.size() - 2 - (open + 2));
+            } else if (line[0] == ' ' && colon + 1 < line.size() && line[colon + 1] == '\t') {
+                char *end;
+                const auto address = std::strtoul(line.c_str(), &end, 16);
+                if (end != line.c_str() + colon)
+                    continue;
+
+                auto text = line.substr(colon + 2);
+                stringReplaceAll(text, "\t", " ");
+                instructions.push_back({static_cast<uint32_t>(address), function, text});
+            }
+        }
+    }
+
+    std::filesystem::remove(output);
+
+    // Sections are listed one after another, not necessarily by address.
+    std::stable_sort(instructions.begin(), instructions.end(),
+        [](const auto& a, const auto& b) { return a.address < b.address; });
+    return instructions;
+}
+
 std::string newTempFileName()
 {
     const auto path = std::filesystem::temp_directory_path() / "stmdspgui_build";
@@ -12,9 +12,20 @@
 #ifndef STMDSPGUI_CODE_HPP
 #define STMDSPGUI_CODE_HPP
 
+#include <cstdint>
 #include <fstream>
 #include <istream>
 #include <string>
+#include <vector>
+
+/**
+ * One instruction from the disassembly of a compiled binary.
+ */
+struct CodeInstruction {
+    uint32_t address;      // Link address.
+    std::string function;  // Symbol the instruction falls under.
+    std::string text;      // Mnemonic and operands.
+};
 
 /**
  * Attempts to open the most recently created binary file.
@@ -35,5 +46,13 @@ void compileEditorCode(const std::string& code);
  */
 void disassembleCode();
 
+/**
+ * Disassembles the most recently compiled binary into its instructions,
+ * without logging them, so that device addresses can be mapped back onto the
+ * code.
+ * @return The instructions in address order, or none if disassembly failed.
+ */
+std::vector<CodeInstruction> disassembleCodeInstructions();
+
 #endif // STMDSPGUI_CODE_HPP
 
@@ -41,8 +41,9 @@ static std::timed_mutex mutexDrawSamples;
 static std::timed_mutex mutexDeviceLoad;
 static std::ofstream logSamplesFile;
 static wav::clip wavOutput;
-static std::deque<stmdsp::dacsample_t> drawSamplesQueue;
-static std::deque<stmdsp::dacsample_t> drawSamplesInputQueue;
+// One queue for each channel of output and input.
+static std::array<std::deque<stmdsp::dacsample_t>, stmdsp::CHANNELS_MAX> drawSamplesQueue;
+static std::array<std::deque<stmdsp::dacsample_t>, stmdsp::CHANNELS_MAX> drawSamplesInputQueue;
 static bool drawSamplesInput = false;
 static unsigned int drawSamplesBufferSize = 1;
 
@@ -52,8 +53,10 @@ void deviceSetInputDrawing(bool enabled)
 {
     drawSamplesInput = enabled;
     if (enabled) {
-        drawSamplesQueue.clear();
-        drawSamplesInputQueue.clear();
+        for (auto& queue : drawSamplesQueue)
+            queue.clear();
+        for (auto& queue : drawSamplesInputQueue)
+            queue.clear();
     }
 }
 
@@ -90,8 +93,9 @@ static std::chrono::duration<double> getBufferPeriod(
     const double factor = 0.975)
 {
     if (device) {
+        // The buffer size is counted at the algorithm's rate.
         const double bufferSize = device->get_buffer_size();
-        const double sampleRate = device->get_sample_rate();
+        const double sampleRate = device->get_sample_rate() / device->get_rate_factor();
         return std::chrono::duration<double>(bufferSize / sampleRate * factor);
     } else {
         return {};
@@ -105,11 +109,16 @@ static void drawSamplesTask(std::shared_ptr<stmdsp::device> device)
 
     // This is the amount of time to wait between device reads.
     const auto bufferTime = getBufferPeriod(device, 1);
+    const auto channels = device->get_channels();
+    // Input is drawn at the output's 12-bit scale, dropping oversampled bits.
+    const auto inputShift = device->get_oversampling().bits - 12;
 
-    // Adds the given chunk of samples to the given queue.
-    const auto addToQueue = [](auto& queue, const auto& chunk) {
+    // Adds the given chunk of interleaved samples to the given queues, one
+    // for each channel.
+    const auto addToQueue = [channels](auto& queues, const auto& chunk) {
         std::scoped_lock lock (mutexDrawSamples);
-        std::copy(chunk.cbegin(), chunk.cend(), std::back_inserter(queue));
+        for (std::size_t i = 0; i < chunk.size(); ++i)
+            queues[i % channels].push_back(chunk[i]);
     };
 
     std::unique_lock<std::timed_mutex> lockDevice (mutexDeviceLoad, std::defer_lock);
@@ -125,6 +134,8 @@ static void drawSamplesTask(std::shared_ptr<stmdsp::device> device)
             if (drawSamplesInput) {
                 chunk2 = tryReceiveChunk(device,
                     std::mem_fn(&stmdsp::device::continuous_read_input));
+                for (auto& s : chunk2)
+                    s = static_cast<stmdsp::adcsample_t>(s >> inputShift);
             }
 
             lockDevice.unlock();
@@ -133,9 +144,10 @@ static void drawSamplesTask(std::shared_ptr<stmdsp::device> device)
             if (drawSamplesInput)
                 addToQueue(drawSamplesInputQueue, chunk2);
 
+            // One line per frame, with channels separated by spaces.
             if (logSamplesFile.is_open()) {
-                for (const auto& s : chunk)
-                    logSamplesFile << s << '\n';
+                for (std::size_t i = 0; i < chunk.size(); ++i)
+                    logSamplesFile << chunk[i] << ((i + 1) % channels ? ' ' : '\n');
             }
         } else {
             // Device must be busy, back off for a bit.
@@ -154,7 +166,10 @@ static void feedSigGenTask(std::shared_ptr<stmdsp::device> device)
     const auto delay = getBufferPeriod(device);
     const auto uploadDelay = getBufferPeriod(device, 0.001);
 
-    std::vector<stmdsp::dacsample_t> wavBuf (device->get_buffer_size() * 2, 2048);
+    // The generator runs at the converter rate, so each buffer period takes
+    // the buffer size times the rate factor in samples.
+    std::vector<stmdsp::dacsample_t> wavBuf (
+        device->get_buffer_size() * device->get_rate_factor() * 2, 2048);
 
     {
         std::scoped_lock lock (mutexDeviceLoad);
@@ -202,6 +217,18 @@ static void statusTask(std::shared_ptr<stmdsp::device> device)
             case stmdsp::Error::ConversionAborted:
                 log("Error: Algorithm unloaded, a fault occurred!");
                 break;
+            case stmdsp::Error::BadSlot:
+                log("Error: Invalid or empty algorithm slot.");
+                break;
+            case stmdsp::Error::FlashFailure:
+                log("Error: Failed to write the algorithm store.");
+                break;
+            case stmdsp::Error::BadChannels:
+                log("Error: Two channels need an algorithm with BLOCK_CHANNELS and the generator stopped.");
+                break;
+            case stmdsp::Error::BadBufferSize:
+                log("Error: The buffer size changed since the algorithm was compiled; upload it again.");
+                break;
             case stmdsp::Error::GUIDisconnect:
                 // Do GUI events for disconnect if device was lost.
                 deviceConnect();
@@ -266,15 +293,109 @@ bool deviceGenStartToggle()
 void deviceUpdateDrawBufferSize(double timeframe)
 {
     drawSamplesBufferSize = std::round(
-        m_device->get_sample_rate() * timeframe);
+        m_device->get_sample_rate() / m_device->get_rate_factor() * timeframe);
+}
+
+void deviceSetDataCache(bool enabled)
+{
+    if (m_device && !m_device->is_running()) {
+        {
+            std::scoped_lock lock (mutexDeviceLoad);
+            m_device->set_data_cache(enabled);
+        }
+        log(enabled ? "Data cache enabled." : "Data cache disabled.");
+    }
+}
+
+// Returns the number of channels the device is left converting.
+unsigned int deviceSetChannels(unsigned int channels)
+{
+    if (!m_device)
+        return 1;
+    else if (m_device->is_running())
+        return m_device->get_channels();
+
+    std::scoped_lock lock (mutexDeviceLoad);
+    const auto factor = m_device->get_rate_factor();
+    if (m_device->get_buffer_size() * channels * factor > stmdsp::SAMPLES_MAX) {
+        log("Error: Buffer size must be at most " +
+            std::to_string(stmdsp::SAMPLES_MAX / channels / factor) + " for " +
+            std::to_string(channels) + " channels.");
+    } else {
+        m_device->set_channels(channels);
+    }
+
+    const auto set = m_device->get_channels();
+    if (set == channels)
+        log(channels > 1 ? "Converting two channels." : "Converting one channel.");
+    return set;
+}
+
+// Returns the oversampling the device is left with.
+stmdsp::oversampling deviceSetOversampling(unsigned int ratio, unsigned int shift)
+{
+    if (!m_device)
+        return {0, 0, 12};
+    else if (m_device->is_running())
+        return m_device->get_oversampling();
+
+    std::scoped_lock lock (mutexDeviceLoad);
+    m_device->set_oversampling(ratio, shift);
+
+    const auto set = m_device->get_oversampling();
+    if (set.ratio == ratio && set.shift == shift) {
+        log("Input samples are now " + std::to_string(set.bits) + "-bit, from " +
+            std::to_string(1u << ratio) + "x oversampling.");
+    } else {
+        log("Error: The device cannot oversample " + std::to_string(1u << ratio) +
+            "x at this sample rate and channel count.");
+    }
+    return set;
+}
+
+// Returns the rate factor the device is left with.
+unsigned int deviceSetRateFactor(unsigned int factor)
+{
+    if (!m_device)
+        return 1;
+    else if (m_device->is_running())
+        return m_device->get_rate_factor();
+
+    std::scoped_lock lock (mutexDeviceLoad);
+    const auto channels = m_device->get_channels();
+    if (m_device->get_buffer_size() * channels * factor > stmdsp::SAMPLES_MAX) {
+        log("Error: Buffer size must be at most " +
+            std::to_string(stmdsp::SAMPLES_MAX / channels / factor) + " for a rate factor of " +
+            std::to_string(factor) + ".");
+    } else {
+        m_device->set_rate_factor(factor);
+    }
+
+    const auto set = m_device->get_rate_factor();
+    if (set == factor) {
+        log(factor > 1 ? "Algorithm runs at 1/" + std::to_string(factor) + " of the sample rate."
+                       : "Algorithm runs at the sample rate.");
+    }
+    return set;
 }
 
-void deviceSetSampleRate(unsigned int rate)
+// Returns the sample rate the device is left with.
+unsigned int deviceSetSampleRate(unsigned int rate)
 {
-    do {
-        m_device->set_sample_rate(rate);
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-    } while (m_device->get_sample_rate() != rate);
+    if (!m_device)
+        return 0;
+    else if (m_device->is_running())
+        return m_device->get_sample_rate();
+
+    std::scoped_lock lock (mutexDeviceLoad);
+    const auto set = m_device->set_sample_rate(rate);
+    if (set == 0) {
+        log("Error: Could not set the sample rate.");
+    } else if (set != rate) {
+        log("Sample rate set to " + std::to_string(set) + " Hz, the closest to " +
+            std::to_string(rate) + " Hz that the device can make.");
+    }
+    return set;
 }
 
 bool deviceConnect()
@@ -351,6 +472,42 @@ void deviceStartMeasurement()
     }
 }
 
+void deviceMeasureLatency()
+{
+    if (!m_device || !m_device->is_running())
+        return;
+
+    // Blocks are counted at the converter rate, where the low-latency limit
+    // applies.
+    const auto factor = m_device->get_rate_factor();
+    const auto block = m_device->get_buffer_size() * factor;
+    const auto rate = m_device->get_sample_rate();
+    if (block > stmdsp::LOW_LATENCY_MAX_BLOCK || rate == 0) {
+        log("Latency is measured in low-latency mode (buffer size up to " +
+            std::to_string(stmdsp::LOW_LATENCY_MAX_BLOCK / factor) + ").");
+        return;
+    }
+
+    const auto stats = m_device->latency_read();
+    if (stats.period == 0) {
+        log("No latency measurements yet.");
+        return;
+    }
+
+    // Times are in device cycles; one period is one block of samples.
+    const double blockUs = block * 1e6 / rate;
+    auto toUs = [&](uint32_t cycles) {
+        return std::to_string(static_cast<int>(cycles * blockUs / stats.period)) + " us";
+    };
+
+    // The rate-change filters add their delay to that of the buffers.
+    const auto delay = block * 2 + (factor > 1 ? stmdsp::RATE_FILTER_TAPS * factor - 1 : 0);
+    log("ADC to DAC delay: " + std::to_string(static_cast<int>(delay * 1e6 / rate)) + " us (" +
+        std::to_string(delay) + " samples).");
+    log("Turnaround: " + toUs(stats.turnaround) + " (max " + toUs(stats.turnaround_max) +
+        ") of " + toUs(stats.period) + "; " + std::to_string(stats.missed) + " blocks missed.");
+}
+
 void deviceAlgorithmUpload()
 {
     if (!m_device) {
@@ -381,6 +538,55 @@ void deviceAlgorithmUnload()
     }
 }
 
+void deviceAlgorithmStore(unsigned int slot, const std::string& name, bool isDefault)
+{
+    if (!m_device) {
+        log("No device connected.");
+    } else if (m_device->is_running()) {
+        log("Cannot store algorithm while running.");
+    } else {
+        std::scoped_lock lock (mutexDeviceLoad);
+        m_device->store_filter(slot, name, isDefault);
+        log("Algorithm stored in slot " + std::to_string(slot) + ".");
+    }
+}
+
+void deviceAlgorithmLoadStored(unsigned int slot)
+{
+    if (!m_device) {
+        log("No device connected.");
+    } else if (m_device->is_running()) {
+        log("Cannot load algorithm while running.");
+    } else {
+        std::scoped_lock lock (mutexDeviceLoad);
+        m_device->load_stored_filter(slot);
+        log("Algorithm loaded from slot " + std::to_string(slot) + ".");
+    }
+}
+
+void deviceAlgorithmEraseStored(unsigned int slot)
+{
+    if (!m_device) {
+        log("No device connected.");
+    } else if (m_device->is_running()) {
+        log("Cannot erase algorithm while running.");
+    } else {
+        std::scoped_lock lock (mutexDeviceLoad);
+        m_device->erase_stored_filter(slot);
+        log("Erased algorithm slot " + std::to_string(slot) + ".");
+    }
+}
+
+std::vector<stmdsp::stored_algorithm> deviceAlgorithmListStored()
+{
+    if (m_device && !m_device->is_running()) {
+        std::scoped_lock lock (mutexDeviceLoad);
+        return m_device->list_stored_filters();
+    }
+
+    return {};
+}
+
 void deviceGenLoadList(const std::string_view list)
 {
     std::vector<stmdsp::dacsample_t> samples;
@@ -451,7 +657,7 @@ std::size_t pullFromQueue(
     // The 1.025 factor keeps us on top of the stream; don't want to fall
     // behind.
     const double FPS = ImGui::GetIO().Framerate;
-    const auto desiredCount = m_device->get_sample_rate() / FPS;
+    const auto desiredCount = m_device->get_sample_rate() / m_device->get_rate_factor() / FPS;
 
     // Transfer from the queue to the render buffer.
     auto count = std::min(queue.size(), static_cast<std::size_t>(desiredCount));
@@ -464,18 +670,20 @@ std::size_t pullFromQueue(
 }
 
 /**
- * Pulls a render frame's worth of samples from the draw samples queue, adding
- * the samples to the given buffer.
+ * Pulls a render frame's worth of samples from the given channel's draw
+ * samples queue, adding the samples to the given buffer.
  */
 std::size_t pullFromDrawQueue(
-    CircularBuffer<std::vector, stmdsp::dacsample_t>& circ)
+    CircularBuffer<std::vector, stmdsp::dacsample_t>& circ,
+    unsigned int channel)
 {
-    return pullFromQueue(drawSamplesQueue, circ);
+    return pullFromQueue(drawSamplesQueue[channel], circ);
 }
 
 std::size_t pullFromInputDrawQueue(
-    CircularBuffer<std::vector, stmdsp::dacsample_t>& circ)
+    CircularBuffer<std::vector, stmdsp::dacsample_t>& circ,
+    unsigned int channel)
 {
-    return pullFromQueue(drawSamplesInputQueue, circ);
+    return pullFromQueue(drawSamplesInputQueue[channel], circ);
 }
 
@@ -1,15 +1,21 @@
 #include "circular.hpp"
+#include "code.hpp"
 #include "imgui.h"
 #include "imgui_internal.h"
 #include "ImGuiFileDialog.h"
 #include "kiss_fftr.h"
 #include "stmdsp.hpp"
 
+#include <algorithm>
 #include <array>
+#include <chrono>
+#include <cmath>
 #include <cstdio>
+#include <map>
 #include <memory>
 #include <string>
 #include <string_view>
+#include <vector>
 
 namespace ImGui
 {
@@ -35,6 +41,10 @@ namespace ImGui
 // Used for status queries and buffer size configuration.
 extern std::shared_ptr<stmdsp::device> m_device;
 
+void deviceAlgorithmEraseStored(unsigned int slot);
+std::vector<stmdsp::stored_algorithm> deviceAlgorithmListStored();
+void deviceAlgorithmLoadStored(unsigned int slot);
+void deviceAlgorithmStore(unsigned int slot, const std::string& name, bool isDefault);
 void deviceAlgorithmUnload();
 void deviceAlgorithmUpload();
 bool deviceConnect();
@@ -43,29 +53,48 @@ void deviceGenLoadList(std::string_view list);
 bool deviceGenStartToggle();
 void deviceLoadAudioFile(const std::string& file);
 void deviceLoadLogFile(const std::string& file);
-void deviceSetSampleRate(unsigned int index);
+void deviceSetDataCache(bool enabled);
+unsigned int deviceSetChannels(unsigned int channels);
+unsigned int deviceSetRateFactor(unsigned int factor);
+stmdsp::oversampling deviceSetOversampling(unsigned int ratio, unsigned int shift);
+unsigned int deviceSetSampleRate(unsigned int rate);
 void deviceSetInputDrawing(bool enabled);
 void deviceStart(bool fetchSamples);
 void deviceStartMeasurement();
+void deviceMeasureLatency();
 void deviceUpdateDrawBufferSize(double timeframe);
 std::size_t pullFromDrawQueue(
-    CircularBuffer<std::vector, stmdsp::dacsample_t>& circ);
+    CircularBuffer<std::vector, stmdsp::dacsample_t>& circ,
+    unsigned int channel = 0);
 std::size_t pullFromInputDrawQueue(
-    CircularBuffer<std::vector, stmdsp::dacsample_t>& circ);
+    CircularBuffer<std::vector, stmdsp::dacsample_t>& circ,
+    unsigned int channel = 0);
 
 static std::string sampleRatePreview = "?";
 static bool measureCodeTime = false;
 static bool logResults = false;
 static bool drawSamples = false;
 static bool drawFrequencies = false;
+static bool drawTiming = false;
+static bool drawProfile = false;
+static bool drawSampling = false;
+static bool drawTrace = false;
+static bool dataCache = false;
+static bool twoChannels = false;
+static unsigned int rateFactor = 1;
+static stmdsp::oversampling oversampling = {0, 0, 12};
 static bool popupRequestBuffer = false;
+static bool popupRequestRate = false;
 static bool popupRequestSiggen = false;
 static bool popupRequestLog = false;
+static bool popupRequestStore = false;
+static bool popupRequestStored = false;
 static double drawSamplesTimeframe = 1.0; // seconds
 
 static std::string getSampleRatePreview(unsigned int rate)
 {
-    return std::to_string(rate / 1000) + " kHz";
+    return rate % 1000 == 0 ? std::to_string(rate / 1000) + " kHz"
+                            : std::to_string(rate) + " Hz";
 }
 
 static std::string connectLabel ("Connect");
@@ -76,6 +105,10 @@ void deviceRenderDisconnect()
     logResults = false;
     drawSamples = false;
     drawFrequencies = false;
+    drawTiming = false;
+    drawProfile = false;
+    drawSampling = false;
+    drawTrace = false;
 }
 
 void deviceRenderMenu()
@@ -92,6 +125,10 @@ void deviceRenderMenu()
                     connectLabel = "Disconnect";
                     sampleRatePreview =
                         getSampleRatePreview(m_device->get_sample_rate());
+                    dataCache = m_device->get_data_cache();
+                    twoChannels = m_device->get_channels() > 1;
+                    rateFactor = m_device->get_rate_factor();
+                    oversampling = m_device->get_oversampling();
                     deviceUpdateDrawBufferSize(drawSamplesTimeframe);
                 } else {
                     deviceRenderDisconnect();
@@ -114,7 +151,18 @@ void deviceRenderMenu()
             deviceAlgorithmUpload);
         addMenuItem("Unload algorithm", isConnected && !isRunning,
             deviceAlgorithmUnload);
+        addMenuItem("Store algorithm...", isConnected && !isRunning,
+            [] { popupRequestStore = true; });
+        addMenuItem("Stored algorithms...", isConnected && !isRunning,
+            [] { popupRequestStored = true; });
         addMenuItem("Measure Code Time", isRunning, deviceStartMeasurement);
+        addMenuItem("Measure Latency", isRunning &&
+            m_device->get_buffer_size() * rateFactor <= stmdsp::LOW_LATENCY_MAX_BLOCK,
+            deviceMeasureLatency);
+        ImGui::MenuItem("Timing stats", nullptr, &drawTiming, isConnected);
+        ImGui::MenuItem("Profile sections", nullptr, &drawProfile, isConnected);
+        ImGui::MenuItem("PC samples", nullptr, &drawSampling, isConnected);
+        ImGui::MenuItem("Event trace", nullptr, &drawTrace, isConnected);
 
         ImGui::Separator();
         if (!isConnected || isRunning)
@@ -127,6 +175,45 @@ void deviceRenderMenu()
                 popupRequestLog = true;
         }
         addMenuItem("Set buffer size...", true, [] { popupRequestBuffer = true; });
+        if (ImGui::Checkbox("Two channels", &twoChannels))
+            twoChannels = deviceSetChannels(twoChannels ? 2 : 1) > 1;
+        if (ImGui::BeginMenu("Rate factor")) {
+            for (unsigned int f = 1; f <= stmdsp::RATE_FACTOR_MAX; f *= 2) {
+                const auto label = f > 1 ? "1/" + std::to_string(f) + " rate" : "Full rate";
+                if (ImGui::MenuItem(label.c_str(), nullptr, rateFactor == f)) {
+                    rateFactor = deviceSetRateFactor(f);
+                    deviceUpdateDrawBufferSize(drawSamplesTimeframe);
+                }
+            }
+            ImGui::EndMenu();
+        }
+
+        const bool isH7 = isConnected &&
+            m_device->get_platform() == stmdsp::platform::H7;
+        if (ImGui::BeginMenu("Input resolution")) {
+            // Ratios are powers of two; the L4 already averages 8x by default.
+            struct mode { const char *label; unsigned int ratio, shift; };
+            const std::array<mode, 5> modes {{
+                {"12-bit (default)", isH7 ? 0u : 3u, isH7 ? 0u : 3u},
+                {"14-bit (4x)", 2, 0},
+                {"15-bit (8x)", 3, 0},
+                {"16-bit (16x)", 4, 0},
+                {"16-bit (256x, averaged)", 8, 4}
+            }};
+            for (const auto& m : modes) {
+                const bool selected = oversampling.ratio == m.ratio && oversampling.shift == m.shift;
+                if (ImGui::MenuItem(m.label, nullptr, selected))
+                    oversampling = deviceSetOversampling(m.ratio, m.shift);
+            }
+            ImGui::EndMenu();
+        }
+
+        if (!isH7)
+            ImGui::PushDisabled();
+        if (ImGui::Checkbox("Data cache", &dataCache))
+            deviceSetDataCache(dataCache);
+        if (!isH7)
+            ImGui::PopDisabled();
 
         if (!isConnected || isRunning)
             ImGui::PopDisabled();
@@ -166,11 +253,12 @@ void deviceRenderToolbar()
         for (const auto& r : sampleRateInts) {
             const auto s = getSampleRatePreview(r);
             if (ImGui::Selectable(s.c_str())) {
-                sampleRatePreview = s;
-                deviceSetSampleRate(r);
+                sampleRatePreview = getSampleRatePreview(deviceSetSampleRate(r));
                 deviceUpdateDrawBufferSize(drawSamplesTimeframe);
             }
         }
+        if (ImGui::Selectable("Custom..."))
+            popupRequestRate = true;
 
         ImGui::EndCombo();
     }
@@ -183,6 +271,7 @@ void deviceRenderWidgets()
 {
     static std::string siggenInput (32768, '\0');
     static int siggenOption = 0;
+    static std::vector<stmdsp::stored_algorithm> storedList;
 
     if (popupRequestSiggen) {
         popupRequestSiggen = false;
@@ -190,10 +279,20 @@ void deviceRenderWidgets()
     } else if (popupRequestBuffer) {
         popupRequestBuffer = false;
         ImGui::OpenPopup("buffer");
+    } else if (popupRequestRate) {
+        popupRequestRate = false;
+        ImGui::OpenPopup("rate");
     } else if (popupRequestLog) {
         popupRequestLog = false;
         ImGuiFileDialog::Instance()->OpenDialog(
             "ChooseFileLog", "Choose File", ".csv", ".", 1, nullptr, ImGuiFileDialogFlags_Modal);
+    } else if (popupRequestStore) {
+        popupRequestStore = false;
+        ImGui::OpenPopup("store");
+    } else if (popupRequestStored) {
+        popupRequestStored = false;
+        storedList = deviceAlgorithmListStored();
+        ImGui::OpenPopup("stored");
     }
 
     if (ImGui::BeginPopup("siggen")) {
@@ -250,7 +349,9 @@ void deviceRenderWidgets()
 
     if (ImGui::BeginPopup("buffer")) {
         static std::string bufferSizeInput ("4096");
-        ImGui::Text("Please enter a new sample buffer size (100-4096):");
+        const int maxSize = stmdsp::SAMPLES_MAX / (twoChannels ? 2 : 1) / rateFactor;
+        ImGui::Text("Please enter a new sample buffer size (1-%d):", maxSize);
+        ImGui::Text("Sizes up to %u run in low-latency mode.", stmdsp::LOW_LATENCY_MAX_BLOCK);
         ImGui::PushStyleColor(ImGuiCol_FrameBg, {.8, .8, .8, 1});
         ImGui::InputText("##",
             bufferSizeInput.data(),
@@ -259,7 +360,7 @@ void deviceRenderWidgets()
         ImGui::PopStyleColor();
         if (ImGui::Button("Save")) {
             if (m_device) {
-                int n = std::clamp(std::stoi(bufferSizeInput), 100, 4096);
+                int n = std::clamp(std::stoi(bufferSizeInput), 1, maxSize);
                 m_device->continuous_set_buffer_size(n);
             }
             ImGui::CloseCurrentPopup();
@@ -270,6 +371,83 @@ void deviceRenderWidgets()
         ImGui::EndPopup();
     }
 
+    if (ImGui::BeginPopup("rate")) {
+        static std::string rateInput ("44100");
+        rateInput.resize(16);
+        ImGui::Text("Please enter a sample rate in Hz (%u-%u):",
+            stmdsp::SAMPLE_RATE_MIN, stmdsp::SAMPLE_RATE_MAX);
+        ImGui::PushStyleColor(ImGuiCol_FrameBg, {.8, .8, .8, 1});
+        ImGui::InputText("##",
+            rateInput.data(),
+            rateInput.size(),
+            ImGuiInputTextFlags_CharsDecimal);
+        ImGui::PopStyleColor();
+        if (ImGui::Button("Save")) {
+            if (m_device) {
+                const int rate = std::clamp(std::stoi(rateInput),
+                    static_cast<int>(stmdsp::SAMPLE_RATE_MIN),
+                    static_cast<int>(stmdsp::SAMPLE_RATE_MAX));
+                sampleRatePreview = getSampleRatePreview(deviceSetSampleRate(rate));
+                deviceUpdateDrawBufferSize(drawSamplesTimeframe);
+            }
+            ImGui::CloseCurrentPopup();
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Cancel"))
+            ImGui::CloseCurrentPopup();
+        ImGui::EndPopup();
+    }
+
+    if (ImGui::BeginPopup("store")) {
+        static int storeSlot = 0;
+        static std::string storeName (stmdsp::STORED_NAME_LENGTH + 1, '\0');
+        static bool storeDefault = false;
+
+        ImGui::Text("Store the uploaded algorithm in the device's flash.");
+        ImGui::PushStyleColor(ImGuiCol_FrameBg, {.8, .8, .8, 1});
+        ImGui::InputInt("Slot", &storeSlot);
+        ImGui::InputText("Name", storeName.data(), storeName.size());
+        ImGui::PopStyleColor();
+        ImGui::Checkbox("Start at power-on", &storeDefault);
+
+        if (ImGui::Button("Save")) {
+            deviceAlgorithmStore(std::max(storeSlot, 0),
+                storeName.substr(0, storeName.find('\0')), storeDefault);
+            ImGui::CloseCurrentPopup();
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Cancel"))
+            ImGui::CloseCurrentPopup();
+        ImGui::EndPopup();
+    }
+
+    if (ImGui::BeginPopup("stored")) {
+        if (storedList.empty())
+            ImGui::Text("No algorithms are stored on the device.");
+
+        for (const auto& algo : storedList) {
+            ImGui::PushID(algo.slot);
+            ImGui::Text("%u: %-12s %5u bytes, %u samples @ %u Hz%s",
+                algo.slot, algo.name.c_str(), algo.size, algo.buffer_size,
+                algo.sample_rate / algo.rate_factor, algo.is_default ? " (default)" : "");
+            ImGui::SameLine();
+            if (ImGui::Button("Load")) {
+                deviceAlgorithmLoadStored(algo.slot);
+                ImGui::CloseCurrentPopup();
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Erase")) {
+                deviceAlgorithmEraseStored(algo.slot);
+                ImGui::CloseCurrentPopup();
+            }
+            ImGui::PopID();
+        }
+
+        if (ImGui::Button("Close"))
+            ImGui::CloseCurrentPopup();
+        ImGui::EndPopup();
+    }
+
     if (ImGuiFileDialog::Instance()->Display("ChooseFileLog",
                                              ImGuiWindowFlags_NoCollapse,
                                              ImVec2(460, 540)))
@@ -297,14 +475,375 @@ void deviceRenderWidgets()
     }
 }
 
+// Shows how long the device takes on each block, refreshed while running.
+static void deviceRenderTiming()
+{
+    static stmdsp::timing_stats stats {};
+    static double blockUs = 0;
+    static auto lastRead = std::chrono::steady_clock::now();
+
+    const auto now = std::chrono::steady_clock::now();
+    if (m_device && m_device->is_running() &&
+        now - lastRead > std::chrono::milliseconds(250))
+    {
+        lastRead = now;
+        stats = m_device->timing_read();
+        // The budget is one block at the converter rate.
+        const auto rate = m_device->get_sample_rate();
+        blockUs = rate > 0 ? m_device->get_buffer_size() * rateFactor * 1e6 / rate : 0;
+    }
+
+    ImGui::Begin("timing", &drawTiming);
+    if (stats.blocks == 0 || stats.budget == 0) {
+        ImGui::Text("No blocks processed yet.");
+    } else {
+        auto toUs = [](uint32_t cycles) { return cycles * blockUs / stats.budget; };
+        auto load = [](uint32_t cycles) { return cycles * 100. / stats.budget; };
+
+        ImGui::Text("Blocks: %u", stats.blocks);
+        ImGui::Text("Last: %.1f us  Mean: %.1f us  Min: %.1f us  Max: %.1f us",
+            toUs(stats.last), toUs(stats.mean), toUs(stats.min), toUs(stats.max));
+        ImGui::Text("Budget: %.1f us (%u cycles); mean load %.0f%%, worst %.0f%%",
+            blockUs, stats.budget, load(stats.mean), load(stats.max));
+        ImGui::Text("Near misses: %u  Overruns: %u", stats.near_misses, stats.overruns);
+
+        std::array<float, stmdsp::TIMING_BINS> bins;
+        for (unsigned int i = 0; i < bins.size(); i++)
+            bins[i] = static_cast<float>(stats.histogram[i]);
+        ImGui::PlotHistogram("##timing", bins.data(), static_cast<int>(bins.size()), 0,
+            "Blocks by cycles (x2 per bar from 256)", 0, FLT_MAX,
+            {ImGui::GetContentRegionAvail().x, 100});
+    }
+    ImGui::End();
+}
+
+// Shows the time spent in each section that the algorithm marks with
+// PROFILE_BEGIN and PROFILE_END, refreshed while running.
+static void deviceRenderProfile()
+{
+    static stmdsp::profile profile {};
+    static auto lastRead = std::chrono::steady_clock::now();
+
+    const auto now = std::chrono::steady_clock::now();
+    if (m_device && m_device->is_running() &&
+        now - lastRead > std::chrono::milliseconds(250))
+    {
+        lastRead = now;
+        profile = m_device->profile_read();
+    }
+
+    ImGui::Begin("profile", &drawProfile);
+    if (profile.sections.empty() || profile.frequency == 0) {
+        ImGui::Text("The algorithm has no profile sections (see PROFILE_MARKERS).");
+    } else {
+        uint64_t all = 0;
+        for (const auto& s : profile.sections)
+            all += s.total;
+
+        const double usPerCount = 1e6 / profile.frequency;
+        ImGui::Text("Section  Passes      Mean (us)   Max (us)    Share");
+        for (unsigned int i = 0; i < profile.sections.size(); i++) {
+            const auto& s = profile.sections[i];
+            const double mean = s.count > 0 ? s.total * usPerCount / s.count : 0;
+            const double share = all > 0 ? s.total * 100. / all : 0;
+            ImGui::Text("%-8u %-11u %-11.2f %-11.2f %.1f%%",
+                i, s.count, mean, s.max * usPerCount, share);
+            ImGui::ProgressBar(static_cast<float>(share / 100), {-1, 4}, "");
+        }
+    }
+    ImGui::End();
+}
+
+// Shows where the algorithm spends its time, from the device sampling the
+// algorithm thread's PC, mapped onto the disassembly of the last compiled
+// algorithm (which should be the one on the device).
+static void deviceRenderSampling()
+{
+    static stmdsp::pc_samples samples {};
+    static std::vector<CodeInstruction> instructions;
+    static std::vector<uint32_t> perInstruction;
+    static std::vector<std::pair<std::string, uint32_t>> perFunction;
+    static uint32_t mapped = 0;
+    static auto lastRead = std::chrono::steady_clock::now();
+
+    ImGui::Begin("samples", &drawSampling);
+
+    bool update = false;
+    if (ImGui::Button(samples.running ? "Stop" : "Start") && m_device) {
+        if (samples.running) {
+            m_device->sampling_stop();
+        } else {
+            instructions = disassembleCodeInstructions();
+            m_device->sampling_start();
+        }
+        update = true;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    if (m_device && (update || (samples.running && now - lastRead > std::chrono::milliseconds(250)))) {
+        lastRead = now;
+        samples = m_device->sampling_read();
+
+        // Each bin goes to the instruction at its start; with bins wider
+        // than an instruction, the rest of its instructions get nothing.
+        perInstruction.assign(instructions.size(), 0);
+        mapped = 0;
+        for (unsigned int i = 0; i < samples.bins.size(); i++) {
+            if (samples.bins[i] == 0)
+                continue;
+
+            const uint32_t address = samples.link_base + i * samples.bin_size;
+            auto it = std::upper_bound(instructions.cbegin(), instructions.cend(), address,
+                [](uint32_t a, const auto& ins) { return a < ins.address; });
+            if (it != instructions.cbegin()) {
+                perInstruction[it - instructions.cbegin() - 1] += samples.bins[i];
+                mapped += samples.bins[i];
+            }
+        }
+
+        std::map<std::string, uint32_t> functions;
+        for (unsigned int i = 0; i < instructions.size(); i++) {
+            if (perInstruction[i] > 0)
+                functions[instructions[i].function] += perInstruction[i];
+        }
+        perFunction.assign(functions.cbegin(), functions.cend());
+        std::sort(perFunction.begin(), perFunction.end(),
+            [](const auto& a, const auto& b) { return a.second > b.second; });
+    }
+
+    if (samples.samples == 0) {
+        ImGui::Text("No samples yet; start sampling with an algorithm loaded.");
+    } else {
+        auto percent = [](uint32_t n) { return n * 100. / samples.samples; };
+        const uint32_t inAlgorithm = samples.samples - samples.outside - samples.other;
+
+        ImGui::Text("Samples: %u  Algorithm: %.1f%%  Device code: %.1f%%  Other threads: %.1f%%",
+            samples.samples, percent(inAlgorithm), percent(samples.outside),
+            percent(samples.other));
+
+        if (instructions.empty()) {
+            ImGui::Text("No disassembly; compile the algorithm, then start again.");
+        } else if (mapped > 0) {
+            ImGui::Separator();
+            ImGui::Text("Function                          Share of algorithm");
+            for (const auto& [name, count] : perFunction) {
+                const double share = count * 100. / mapped;
+                ImGui::Text("%-33.33s %.1f%%", name.c_str(), share);
+                ImGui::ProgressBar(static_cast<float>(share / 100), {-1, 4}, "");
+            }
+
+            // The hottest instructions, most samples first.
+            std::vector<unsigned int> order;
+            for (unsigned int i = 0; i < perInstruction.size(); i++) {
+                if (perInstruction[i] > 0)
+                    order.push_back(i);
+            }
+            std::sort(order.begin(), order.end(),
+                [](unsigned int a, unsigned int b) { return perInstruction[a] > perInstruction[b]; });
+            if (order.size() > 20)
+                order.resize(20);
+
+            ImGui::Separator();
+            ImGui::Text("Address   Share   Instruction");
+            for (auto i : order) {
+                const auto& ins = instructions[i];
+                ImGui::Text("%08x  %5.1f%%  %-32s <%s>", ins.address,
+                    perInstruction[i] * 100. / mapped, ins.text.c_str(), ins.function.c_str());
+            }
+        }
+    }
+    ImGui::End();
+}
+
+// Shows the device's event trace as a timeline with one lane for each kind
+// of event, ending at the newest event. While streaming, new events are read
+// as they come; otherwise, Fetch reads what the device has so far.
+static void deviceRenderTrace()
+{
+    constexpr auto lanes = static_cast<unsigned int>(stmdsp::trace_event::count);
+    constexpr std::size_t maxEvents = 65536;
+
+    struct Event {
+        uint64_t time; // Profile counter, with its wraps counted.
+        uint16_t event;
+        uint16_t arg;
+    };
+
+    static const std::array<const char *, lanes> names {
+        "ADC block", "Mailbox post", "Overrun", "Runner wake",
+        "Block done", "Service call", "Command"
+    };
+    static const std::array<ImU32, lanes> colors {
+        IM_COL32(80, 160, 255, 255), IM_COL32(160, 120, 255, 255),
+        IM_COL32(255, 60, 60, 255), IM_COL32(80, 220, 80, 255),
+        IM_COL32(255, 200, 60, 255), IM_COL32(0, 220, 220, 255),
+        IM_COL32(200, 200, 200, 255)
+    };
+    // Service calls and commands can crowd out the rest, so start without.
+    static std::array<bool, lanes> enabled { true, true, true, true, true, false, false };
+    static std::vector<Event> events;
+    static uint32_t frequency = 0;
+    static uint32_t lost = 0;
+    static uint32_t lastCount = 0;
+    static bool tracing = false;
+    static bool stream = true;
+    static double windowMs = 8;
+    static auto lastRead = std::chrono::steady_clock::now();
+
+    // Counts wrap every few seconds, so each event's time is taken as the
+    // one before's plus the difference in counts.
+    auto read = [] {
+        const auto trace = m_device->trace_read();
+        frequency = trace.frequency;
+        lost += trace.lost;
+        for (const auto& e : trace.entries) {
+            const uint64_t time = events.empty() ? e.time
+                : events.back().time + static_cast<uint32_t>(e.time - lastCount);
+            lastCount = e.time;
+            events.push_back({time, e.event, e.arg});
+        }
+        if (events.size() > maxEvents)
+            events.erase(events.begin(), events.end() - maxEvents);
+    };
+
+    ImGui::Begin("trace", &drawTrace);
+
+    for (unsigned int i = 0; i < lanes; i++) {
+        if (i % 4 != 0)
+            ImGui::SameLine();
+        ImGui::Checkbox(names[i], &enabled[i]);
+    }
+
+    if (ImGui::Button(tracing ? "Stop" : "Start") && m_device) {
+        if (tracing) {
+            m_device->trace_stop();
+            read();
+        } else {
+            uint8_t mask = 0;
+            for (unsigned int i = 0; i < lanes; i++)
+                mask |= enabled[i] ? (1 << i) : 0;
+            events.clear();
+            lost = 0;
+            m_device->trace_start(mask);
+        }
+        tracing = !tracing;
+    }
+    ImGui::SameLine();
+    ImGui::Checkbox("Stream", &stream);
+    ImGui::SameLine();
+    if (ImGui::Button("Fetch") && m_device && tracing)
+        read();
+    ImGui::SameLine();
+    ImGui::Text("Window: %0.3f ms", windowMs);
+    ImGui::SameLine();
+    if (ImGui::Button("-", {30, 0}))
+        windowMs = std::max(windowMs / 2, 0.125);
+    ImGui::SameLine();
+    if (ImGui::Button("+", {30, 0}))
+        windowMs = std::min(windowMs * 2, 4096.);
+
+    const auto now = std::chrono::steady_clock::now();
+    if (m_device && tracing && stream && now - lastRead > std::chrono::milliseconds(50)) {
+        lastRead = now;
+        read();
+    }
+
+    const auto overruns = std::count_if(events.cbegin(), events.cend(),
+        [](const auto& e) { return e.event == static_cast<uint16_t>(stmdsp::trace_event::overrun); });
+    ImGui::Text("Events: %zu  Lost: %u  Overruns: %zu", events.size(), lost,
+        static_cast<std::size_t>(overruns));
+
+    if (!events.empty() && frequency > 0) {
+        auto drawList = ImGui::GetWindowDrawList();
+        const ImVec2 p0 = ImGui::GetCursorScreenPos();
+        ImVec2 size = ImGui::GetContentRegionAvail();
+        size.y = std::max(size.y, lanes * 16.f);
+        const float labelWidth = 100;
+        const float laneHeight = size.y / lanes;
+        const float x0 = p0.x + labelWidth;
+        const float width = size.x - labelWidth;
+        drawList->AddRectFilled(p0, {p0.x + size.x, p0.y + size.y}, IM_COL32_BLACK);
+
+        for (unsigned int i = 0; i < lanes; i++) {
+            const float y = p0.y + i * laneHeight;
+            drawList->AddText({p0.x + 4, y + 2}, colors[i], names[i]);
+            drawList->AddLine({p0.x, y}, {p0.x + size.x, y}, IM_COL32(40, 40, 40, 255));
+        }
+
+        const double span = windowMs * 1e-3 * frequency;
+        const uint64_t end = events.back().time;
+        const uint64_t start = end > span ? end - static_cast<uint64_t>(span) : 0;
+        auto first = std::lower_bound(events.cbegin(), events.cend(), start,
+            [](const auto& e, uint64_t t) { return e.time < t; });
+        auto xOf = [&](uint64_t t) { return x0 + static_cast<float>((t - start) / span) * width; };
+
+        for (auto it = first; it != events.cend(); ++it) {
+            if (it->event >= lanes)
+                continue;
+
+            const float x = xOf(it->time);
+            if (it->event == static_cast<uint16_t>(stmdsp::trace_event::overrun)) {
+                drawList->AddLine({x, p0.y}, {x, p0.y + size.y}, colors[it->event], 2);
+            } else {
+                const float y = p0.y + it->event * laneHeight;
+                drawList->AddLine({x, y + 2}, {x, y + laneHeight - 2}, colors[it->event]);
+            }
+        }
+
+        // Describe the event under the mouse, and the time since the last of
+        // its kind.
+        const auto mouse = ImGui::GetMousePos();
+        if (mouse.x > x0 && mouse.x < p0.x + size.x &&
+            mouse.y > p0.y && mouse.y < p0.y + size.y)
+        {
+            const auto lane = static_cast<unsigned int>((mouse.y - p0.y) / laneHeight);
+            auto nearest = events.cend();
+            float distance = 4;
+            for (auto it = first; it != events.cend(); ++it) {
+                if (it->event == lane && std::abs(xOf(it->time) - mouse.x) < distance) {
+                    distance = std::abs(xOf(it->time) - mouse.x);
+                    nearest = it;
+                }
+            }
+
+            if (nearest != events.cend()) {
+                const double usPerCount = 1e6 / frequency;
+                auto previous = std::find_if(std::make_reverse_iterator(nearest), events.crend(),
+                    [&](const auto& e) { return e.event == nearest->event; });
+                char since[32] = "";
+                if (previous != events.crend()) {
+                    snprintf(since, sizeof(since), ", %.1f us after the last",
+                        (nearest->time - previous->time) * usPerCount);
+                }
+
+                if (nearest->event == static_cast<uint16_t>(stmdsp::trace_event::command)) {
+                    ImGui::SetTooltip("%s '%c'\n%.1f us before the newest%s", names[lane],
+                        static_cast<char>(nearest->arg), (end - nearest->time) * usPerCount, since);
+                } else {
+                    ImGui::SetTooltip("%s (%u)\n%.1f us before the newest%s", names[lane],
+                        nearest->arg, (end - nearest->time) * usPerCount, since);
+                }
+            }
+        }
+
+        ImGui::Dummy(size);
+    }
+    ImGui::End();
+}
+
 void deviceRenderDraw()
 {
     static std::vector<stmdsp::dacsample_t> buffer;
     static std::vector<stmdsp::dacsample_t> bufferInput;
+    // The second channel, when converting two.
+    static std::vector<stmdsp::dacsample_t> buffer2;
+    static std::vector<stmdsp::dacsample_t> bufferInput2;
     static std::vector<kiss_fft_scalar> bufferFFTIn;
     static std::vector<kiss_fft_cpx> bufferFFTOut;
     static auto bufferCirc = CircularBuffer(buffer);
     static auto bufferInputCirc = CircularBuffer(bufferInput);
+    static auto buffer2Circ = CircularBuffer(buffer2);
+    static auto bufferInput2Circ = CircularBuffer(bufferInput2);
     static bool drawSamplesInput = false;
     static kiss_fftr_cfg kisscfg;
 
@@ -319,6 +858,8 @@ void deviceRenderDraw()
             if (drawSamplesInput) {
                 bufferCirc.reset(2048);
                 bufferInputCirc.reset(2048);
+                buffer2Circ.reset(2048);
+                bufferInput2Circ.reset(2048);
             }
         }
         ImGui::SameLine();
@@ -344,20 +885,23 @@ void deviceRenderDraw()
             yMinMax = std::min(4095u, (yMinMax << 1) | 1);
         }
 
-        auto newSize = pullFromDrawQueue(bufferCirc);
-        if (newSize > 0) {
-            buffer.resize(newSize);
-            bufferCirc = CircularBuffer(buffer);
-            pullFromDrawQueue(bufferCirc);
-        }
-
-        if (drawSamplesInput) {
-            auto newSize = pullFromInputDrawQueue(bufferInputCirc);
+        // Fills the given channel's render buffer, resizing it if needed.
+        auto pull = [](auto pullFunc, auto& buf, auto& circ, unsigned int channel) {
+            auto newSize = pullFunc(circ, channel);
             if (newSize > 0) {
-                bufferInput.resize(newSize);
-                bufferInputCirc = CircularBuffer(bufferInput);
-                pullFromInputDrawQueue(bufferInputCirc);
+                buf.resize(newSize);
+                circ = CircularBuffer(buf);
+                pullFunc(circ, channel);
             }
+        };
+
+        pull(pullFromDrawQueue, buffer, bufferCirc, 0);
+        if (twoChannels)
+            pull(pullFromDrawQueue, buffer2, buffer2Circ, 1);
+        if (drawSamplesInput) {
+            pull(pullFromInputDrawQueue, bufferInput, bufferInputCirc, 0);
+            if (twoChannels)
+                pull(pullFromInputDrawQueue, bufferInput2, bufferInput2Circ, 1);
         }
 
         auto drawList = ImGui::GetWindowDrawList();
@@ -391,30 +935,31 @@ void deviceRenderDraw()
 
         const float di = static_cast<float>(buffer.size()) / size.x;
         const float dx = std::ceil(size.x / static_cast<float>(buffer.size()));
-        ImVec2 pp = p0;
-        float i = 0;
-        while (pp.x < p0.x + size.x) {
-            unsigned int idx = i;
-            float n = std::clamp((buffer[idx] - 2048.) / yMinMax, -0.5, 0.5);
-            i += di;
-
-            ImVec2 next (pp.x + dx, p0.y + size.y * (0.5 - n));
-            drawList->AddLine(pp, next, ImGui::GetColorU32(IM_COL32(255, 0, 0, 255)));
-            pp = next;
-        }
+        auto drawSignal = [&](const auto& buf, ImU32 color) {
+            if (buf.size() != buffer.size())
+                return;
 
-        if (drawSamplesInput) {
             ImVec2 pp = p0;
             float i = 0;
             while (pp.x < p0.x + size.x) {
                 unsigned int idx = i;
-                float n = std::clamp((bufferInput[idx] - 2048.) / yMinMax, -0.5, 0.5);
+                float n = std::clamp((buf[idx] - 2048.) / yMinMax, -0.5, 0.5);
                 i += di;
 
                 ImVec2 next (pp.x + dx, p0.y + size.y * (0.5 - n));
-                drawList->AddLine(pp, next, ImGui::GetColorU32(IM_COL32(0, 0, 255, 255)));
+                drawList->AddLine(pp, next, color);
                 pp = next;
             }
+        };
+
+        // The second channel is drawn in green (output) and cyan (input).
+        drawSignal(buffer, ImGui::GetColorU32(IM_COL32(255, 0, 0, 255)));
+        if (twoChannels)
+            drawSignal(buffer2, ImGui::GetColorU32(IM_COL32(0, 255, 0, 255)));
+        if (drawSamplesInput) {
+            drawSignal(bufferInput, ImGui::GetColorU32(IM_COL32(0, 0, 255, 255)));
+            if (twoChannels)
+                drawSignal(bufferInput2, ImGui::GetColorU32(IM_COL32(0, 255, 255, 255)));
         }
 
         const auto mouse = ImGui::GetMousePos();
@@ -493,7 +1038,8 @@ void deviceRenderDraw()
             }
         }
 
-        const auto Fs = m_device->get_sample_rate();
+        // Samples arrive at the algorithm's rate.
+        const auto Fs = m_device->get_sample_rate() / rateFactor;
 
         const float di = static_cast<float>(buffer.size() / 2) / size.x;
         const float dx = std::ceil(size.x / static_cast<float>(buffer.size()));
@@ -523,5 +1069,14 @@ void deviceRenderDraw()
 
         ImGui::End();
     }
+
+    if (drawTiming)
+        deviceRenderTiming();
+    if (drawProfile)
+        deviceRenderProfile();
+    if (drawSampling)
+        deviceRenderSampling();
+    if (drawTrace)
+        deviceRenderTrace();
 }
 
@@ -15,9 +15,12 @@
 
 #include <algorithm>
 #include <array>
+#include <cstring>
 
 extern void log(const std::string& str);
 
+// Common sample rates, also the rates that older firmware stored algorithms
+// with (by index).
 std::array<unsigned int, 6> sampleRateInts {{
     8'000,
     16'000,
@@ -127,31 +130,94 @@ namespace stmdsp
         }
     }
 
-    void device::set_sample_rate(unsigned int rate) {
-        auto it = std::find(
-            sampleRateInts.cbegin(),
-            sampleRateInts.cend(),
-            rate);
-
-        if (it != sampleRateInts.cend()) {
-            const auto i = std::distance(sampleRateInts.cbegin(), it);
-            try_command({
-                'r',
-                static_cast<uint8_t>(i)
-            });
+    unsigned int device::set_sample_rate(unsigned int rate) {
+        // The device replies with the rate in effect; a rate of zero only
+        // queries it.
+        if (rate == 0 || (rate >= SAMPLE_RATE_MIN && rate <= SAMPLE_RATE_MAX)) {
+            uint8_t result[4];
+            if (try_read({
+                    'r',
+                    static_cast<uint8_t>(rate),
+                    static_cast<uint8_t>(rate >> 8),
+                    static_cast<uint8_t>(rate >> 16),
+                    static_cast<uint8_t>(rate >> 24)},
+                    result, sizeof(result)))
+            {
+                m_sample_rate = result[0] | (result[1] << 8) |
+                    (result[2] << 16) | (static_cast<unsigned int>(result[3]) << 24);
+            }
         }
+
+        return m_sample_rate;
     }
 
     unsigned int device::get_sample_rate() {
+        if (!is_running())
+            set_sample_rate(0);
+
+        return m_sample_rate;
+    }
+
+    void device::set_channels(unsigned int channels) {
+        if (channels >= 1 && channels <= CHANNELS_MAX)
+            try_command({'N', static_cast<uint8_t>(channels)});
+    }
+
+    unsigned int device::get_channels() {
         if (!is_running()) {
             uint8_t result = 0xFF;
-            if (try_read({'r', 0xFF}, &result, 1))
-                m_sample_rate = result;
+            if (try_read({'N', 0xFF}, &result, 1) && result >= 1 && result <= CHANNELS_MAX)
+                m_channels = result;
+        }
+
+        return m_channels;
+    }
+
+    void device::set_rate_factor(unsigned int factor) {
+        if (factor >= 1 && factor <= RATE_FACTOR_MAX)
+            try_command({'H', static_cast<uint8_t>(factor)});
+    }
+
+    unsigned int device::get_rate_factor() {
+        if (!is_running()) {
+            uint8_t result = 0xFF;
+            if (try_read({'H', 0xFF}, &result, 1) && result >= 1 && result <= RATE_FACTOR_MAX)
+                m_rate_factor = result;
+        }
+
+        return m_rate_factor;
+    }
+
+    void device::set_oversampling(unsigned int ratio, unsigned int shift) {
+        if (ratio <= OVERSAMPLING_RATIO_MAX && shift <= ratio) {
+            try_command({
+                'O',
+                static_cast<uint8_t>(ratio),
+                static_cast<uint8_t>(shift)});
+        }
+    }
+
+    oversampling device::get_oversampling() {
+        if (!is_running()) {
+            uint8_t result[3];
+            if (try_read({'O', 0xFF}, result, sizeof(result)) &&
+                result[2] >= 12 && result[2] <= 16)
+            {
+                m_oversampling = {result[0], result[1], result[2]};
+            }
         }
 
-        return m_sample_rate < sampleRateInts.size() ?
-            sampleRateInts[m_sample_rate] :
-            0;
+        return m_oversampling;
+    }
+
+    void device::set_data_cache(bool enabled) {
+        try_command({'C', static_cast<uint8_t>(enabled ? 1 : 0)});
+    }
+
+    bool device::get_data_cache() {
+        uint8_t result = 0;
+        try_read({'C', 0xFF}, &result, 1);
+        return result != 0;
     }
 
     void device::continuous_start() {
@@ -169,13 +235,137 @@ namespace stmdsp
         return count / 2;
     }
 
+    latency_stats device::latency_read() {
+        latency_stats stats {};
+        try_read({'l'}, reinterpret_cast<uint8_t *>(&stats), sizeof(stats));
+        return stats;
+    }
+
+    timing_stats device::timing_read() {
+        timing_stats stats {};
+        try_read({'T'}, reinterpret_cast<uint8_t *>(&stats), sizeof(stats));
+        return stats;
+    }
+
+    profile device::profile_read() {
+        profile result {};
+
+        if (connected()) {
+            try {
+                std::scoped_lock lock (m_lock);
+                m_serial->write("p");
+
+                // Frequency and section count, then four words per section:
+                // total (low, high), count and longest pass.
+                uint32_t header[2] = {};
+                m_serial->read(reinterpret_cast<uint8_t *>(header), sizeof(header));
+                result.frequency = header[0];
+
+                for (unsigned int i = 0; i < header[1] && i < PROFILE_MARKERS_MAX; ++i) {
+                    uint32_t words[4];
+                    if (m_serial->read(reinterpret_cast<uint8_t *>(words), sizeof(words)) != sizeof(words))
+                        break;
+
+                    result.sections.push_back({
+                        words[0] | (static_cast<uint64_t>(words[1]) << 32),
+                        words[2],
+                        words[3]
+                    });
+                }
+            } catch (...) {
+                handle_disconnect();
+            }
+        }
+
+        return result;
+    }
+
+    void device::sampling_start() {
+        try_command({'Q', 1});
+    }
+
+    void device::sampling_stop() {
+        try_command({'Q', 0});
+    }
+
+    pc_samples device::sampling_read() {
+        pc_samples result {};
+
+        if (connected()) {
+            try {
+                std::scoped_lock lock (m_lock);
+                m_serial->write("q");
+
+                // Running, link base, bin shift, bin count, then the sample,
+                // outside and other counts; followed by the 16-bit bins.
+                uint32_t header[7] = {};
+                if (m_serial->read(reinterpret_cast<uint8_t *>(header), sizeof(header)) == sizeof(header) &&
+                    header[3] <= PC_SAMPLE_BINS_MAX)
+                {
+                    result.running = header[0] != 0;
+                    result.link_base = header[1];
+                    result.bin_size = 1u << header[2];
+                    result.samples = header[4];
+                    result.outside = header[5];
+                    result.other = header[6];
+
+                    result.bins.resize(header[3]);
+                    const auto size = result.bins.size() * sizeof(uint16_t);
+                    if (m_serial->read(reinterpret_cast<uint8_t *>(result.bins.data()), size) != size)
+                        result.bins.clear();
+                }
+            } catch (...) {
+                handle_disconnect();
+            }
+        }
+
+        return result;
+    }
+
+    void device::trace_start(uint8_t mask) {
+        try_command({'V', mask});
+    }
+
+    void device::trace_stop() {
+        try_command({'V', 0});
+    }
+
+    trace device::trace_read() {
+        trace result {};
+
+        if (connected()) {
+            try {
+                std::scoped_lock lock (m_lock);
+                m_serial->write("v");
+
+                // Frequency, lost events and event count, then the events.
+                uint32_t header[3] = {};
+                if (m_serial->read(reinterpret_cast<uint8_t *>(header), sizeof(header)) == sizeof(header) &&
+                    header[2] <= TRACE_SIZE_MAX)
+                {
+                    result.frequency = header[0];
+                    result.lost = header[1];
+
+                    result.entries.resize(header[2]);
+                    const auto size = result.entries.size() * sizeof(trace_entry);
+                    if (m_serial->read(reinterpret_cast<uint8_t *>(result.entries.data()), size) != size)
+                        result.entries.clear();
+                }
+            } catch (...) {
+                handle_disconnect();
+            }
+        }
+
+        return result;
+    }
+
     std::vector<adcsample_t> device::continuous_read() {
         if (connected()) {
             try {
                 m_serial->write("s");
                 unsigned char sizebytes[2];
                 m_serial->read(sizebytes, 2);
-                unsigned int size = sizebytes[0] | (sizebytes[1] << 8);
+                unsigned int size = (sizebytes[0] | (sizebytes[1] << 8)) * m_channels;
                 if (size > 0) {
                     std::vector<adcsample_t> data (size);
                     unsigned int total = size * sizeof(adcsample_t);
@@ -206,7 +396,7 @@ namespace stmdsp
                 m_serial->write("t");
                 unsigned char sizebytes[2];
                 m_serial->read(sizebytes, 2);
-                unsigned int size = sizebytes[0] | (sizebytes[1] << 8);
+                unsigned int size = (sizebytes[0] | (sizebytes[1] << 8)) * m_channels;
                 if (size > 0) {
                     std::vector<adcsample_t> data (size);
                     unsigned int total = size * sizeof(adcsample_t);
@@ -300,6 +490,74 @@ namespace stmdsp
         try_command({'e'});
     }
 
+    void device::store_filter(unsigned int slot, const std::string& name, bool is_default) {
+        std::basic_string<uint8_t> request {
+            'F',
+            static_cast<uint8_t>(slot),
+            static_cast<uint8_t>(is_default ? 1 : 0)
+        };
+
+        // Name is sent as a fixed-length, zero-padded field.
+        for (unsigned int i = 0; i < STORED_NAME_LENGTH; ++i)
+            request += i < name.size() ? static_cast<uint8_t>(name[i]) : 0;
+
+        try_command(request);
+    }
+
+    void device::load_stored_filter(unsigned int slot) {
+        try_command({'f', static_cast<uint8_t>(slot)});
+    }
+
+    void device::erase_stored_filter(unsigned int slot) {
+        try_command({'X', static_cast<uint8_t>(slot)});
+    }
+
+    std::vector<stored_algorithm> device::list_stored_filters() {
+        std::vector<stored_algorithm> list;
+
+        if (connected()) {
+            try {
+                std::scoped_lock lock (m_lock);
+                m_serial->write("L");
+                uint8_t count = 0;
+                m_serial->read(&count, 1);
+
+                for (unsigned int i = 0; i < count; ++i) {
+                    // Entry layout: magic (4), name (12), size (4), crc (4),
+                    // buffer size (2), rate (1), flags (1), rate factor (1),
+                    // reserved (3). The rate factor is 0xFF in older entries.
+                    uint8_t entry[32];
+                    if (m_serial->read(entry, sizeof(entry)) != sizeof(entry))
+                        break;
+
+                    auto u32 = [&entry](unsigned int o) {
+                        return entry[o] | (entry[o + 1] << 8) |
+                            (entry[o + 2] << 16) | (static_cast<unsigned int>(entry[o + 3]) << 24);
+                    };
+
+                    if (u32(0) != STORED_MAGIC)
+                        continue;
+
+                    const char *name = reinterpret_cast<const char *>(entry + 4);
+                    list.push_back({
+                        i,
+                        std::string(name, strnlen(name, STORED_NAME_LENGTH)),
+                        u32(16),
+                        static_cast<unsigned int>(entry[24] | (entry[25] << 8)),
+                        entry[26] < sampleRateInts.size() ? sampleRateInts[entry[26]] :
+                            entry[26] == 0xFF ? entry[29] | (entry[30] << 8) | (entry[31] << 16) : 0u,
+                        entry[28] >= 1 && entry[28] <= RATE_FACTOR_MAX ? entry[28] : 1u,
+                        (entry[27] & 1) != 0
+                    });
+                }
+            } catch (...) {
+                handle_disconnect();
+            }
+        }
+
+        return list;
+    }
+
     std::pair<RunStatus, Error> device::get_status() {
         std::pair<RunStatus, Error> ret;
 
@@ -20,6 +20,7 @@
 #include <mutex>
 #include <string>
 #include <tuple>
+#include <vector>
 
 namespace stmdsp
 {
@@ -29,8 +30,49 @@ namespace stmdsp
      */
     constexpr unsigned int SAMPLES_MAX = 4096;
 
+    /**
+     * The most input and output channels the device can convert; the second
+     * channel's output takes over the signal generator's DAC channel.
+     */
+    constexpr unsigned int CHANNELS_MAX = 2;
+
+    /**
+     * The range of sample rates the device accepts, in Hz. The device runs at
+     * the closest rate its timer can make, reported back by set_sample_rate().
+     */
+    constexpr unsigned int SAMPLE_RATE_MIN = 1'000;
+    constexpr unsigned int SAMPLE_RATE_MAX = 96'000;
+
+    /**
+     * The largest rate factor: the device can run the converters up to this
+     * many times faster than the algorithm, decimating the input and
+     * interpolating the output. Factors are powers of two, and the buffers
+     * hold the buffer size times the factor at the converter rate.
+     */
+    constexpr unsigned int RATE_FACTOR_MAX = 8;
+
+    /**
+     * Length of each phase of the device's rate-change filters; the two
+     * filters delay the signal by `RATE_FILTER_TAPS * factor - 1` samples.
+     */
+    constexpr unsigned int RATE_FILTER_TAPS = 16;
+
+    /**
+     * The most sections an algorithm can time with PROFILE_BEGIN and
+     * PROFILE_END (PROFILE_MARKERS).
+     */
+    constexpr unsigned int PROFILE_MARKERS_MAX = 8;
+
+    /**
+     * Algorithm store directory details, matching the firmware's AlgorithmStore.
+     */
+    constexpr unsigned int STORED_NAME_LENGTH = 12;
+    constexpr unsigned int STORED_MAGIC = 0x4F474C41;
+
     /**
      * ADC samples on all platforms are stored as 16-bit unsigned integers.
+     * They hold oversampling::bits bits (12 to 16), with 0V at half scale;
+     * DAC samples are always 12-bit.
      */
     using adcsample_t = uint16_t;
     /**
@@ -70,10 +112,129 @@ namespace stmdsp
         NotIdle,             /* An idle-only command was received while not Idle. */
         ConversionAborted,   /* A conversion was aborted due to a fault. */
         NotRunning,          /* A running-only command was received while not Running. */
+        BadSlot,             /* An invalid or empty algorithm slot was given. */
+        FlashFailure,        /* Writing or erasing the algorithm store failed. */
+        BadChannels,         /* The algorithm or generator conflicts with the channel count. */
+        BadBufferSize,       /* The buffer size is larger than the algorithm was compiled for. */
 
         GUIDisconnect = 100  /* The GUI lost connection with the device. */
     };
 
+    /**
+     * Timing of the device's low-latency mode (buffer sizes up to
+     * LOW_LATENCY_MAX_BLOCK), in device cycles.
+     */
+    constexpr unsigned int LOW_LATENCY_MAX_BLOCK = 8;
+
+    /**
+     * The device's hardware oversampling of its inputs: each sample is the
+     * sum of 2^ratio conversions shifted right by shift bits, leaving
+     * 12 + ratio - shift bits per sample (12 to 16).
+     */
+    constexpr unsigned int OVERSAMPLING_RATIO_MAX = 8;
+    struct oversampling {
+        unsigned int ratio;
+        unsigned int shift;
+        unsigned int bits;
+    };
+    struct latency_stats {
+        uint32_t period;          /* Time between blocks. */
+        uint32_t turnaround;      /* Last time from ADC block to output. */
+        uint32_t turnaround_max;  /* Longest turnaround. */
+        uint32_t missed;          /* Blocks dropped or finished late. */
+    };
+
+    /**
+     * Time the device takes to process each block, in device cycles, since
+     * conversion started. The budget is the time between blocks. The first
+     * histogram bin counts blocks under 256 cycles, and each after it twice
+     * the range of the one before; the last bin holds all longer blocks.
+     */
+    constexpr unsigned int TIMING_BINS = 24;
+    struct timing_stats {
+        uint32_t blocks;
+        uint32_t last;
+        uint32_t min;
+        uint32_t max;
+        uint32_t mean;
+        uint32_t budget;
+        uint32_t near_misses;     /* Blocks within an eighth of the budget. */
+        uint32_t overruns;        /* Blocks over the budget. */
+        uint32_t histogram[TIMING_BINS];
+    };
+
+    /**
+     * Timing of the sections an algorithm marks with PROFILE_BEGIN and
+     * PROFILE_END, in counts of the device's profile counter, which runs at
+     * frequency Hz. Totals are since conversion started.
+     */
+    struct profile_section {
+        uint64_t total;
+        uint32_t count;
+        uint32_t max;
+    };
+    struct profile {
+        uint32_t frequency;
+        std::vector<profile_section> sections;
+    };
+
+    /**
+     * Where the device's algorithm thread was found by periodic sampling of
+     * its PC. Bin i counts samples from link_base + i * bin_size up to the
+     * next bin, by the algorithm's link addresses. Samples are also taken
+     * while the thread runs outside the algorithm (e.g. converting samples),
+     * or while another thread runs.
+     */
+    constexpr unsigned int PC_SAMPLE_BINS_MAX = 2048;
+    struct pc_samples {
+        bool running;
+        uint32_t link_base;
+        uint32_t bin_size;
+        uint32_t samples;
+        uint32_t outside;
+        uint32_t other;
+        std::vector<uint16_t> bins;
+    };
+
+    /**
+     * Events the device can record in its trace, with the meaning of each
+     * event's argument.
+     */
+    enum class trace_event : uint16_t {
+        adc_block = 0,  /* ADC filled half of its buffer; arg: the half. */
+        mailbox_post,   /* Block posted for the algorithm; arg: message. */
+        overrun,        /* arg: 0 = conversion aborted, 1 = block dropped. */
+        runner_wake,    /* Algorithm thread got a block; arg: message. */
+        block_done,     /* Algorithm thread finished a block. */
+        syscall,        /* Algorithm service call; arg: its number. */
+        command,        /* USB command handled; arg: its letter. */
+        count
+    };
+    constexpr unsigned int TRACE_SIZE_MAX = 1024;
+    struct trace_entry {
+        uint32_t time;  /* Counts of the device's profile counter. */
+        uint16_t event;
+        uint16_t arg;
+    };
+    struct trace {
+        uint32_t frequency; /* Of the profile counter, in Hz. */
+        uint32_t lost;      /* Events overwritten before this read. */
+        std::vector<trace_entry> entries;
+    };
+
+    /**
+     * Describes an algorithm kept in the device's algorithm store.
+     */
+    struct stored_algorithm {
+        unsigned int slot;
+        std::string name;
+        unsigned int size;          /* Size of the ELF binary in bytes. */
+        unsigned int buffer_size;   /* Buffer size the algorithm was saved with. */
+        unsigned int sample_rate;   /* Sample rate the algorithm was saved with. */
+        unsigned int rate_factor;   /* Rate factor the algorithm was saved with. */
+        bool is_default;            /* Loaded and started when the device powers on. */
+    };
+
     /**
      * Provides functionality to scan the system for stmdsp devices.
      * A list of devices is returned, though the GUI only interacts with one
@@ -120,14 +281,48 @@ namespace stmdsp
         void continuous_set_buffer_size(unsigned int size);
         unsigned int get_buffer_size() const { return m_buffer_size; }
 
-        void set_sample_rate(unsigned int rate);
+        // Sets the sample rate in Hz, returning the rate the device runs at.
+        unsigned int set_sample_rate(unsigned int rate);
         unsigned int get_sample_rate();
 
+        // Channels read from the ADC and written to the DACs. Read samples
+        // hold one sample of each channel per frame, interleaved.
+        void set_channels(unsigned int channels);
+        unsigned int get_channels();
+
+        // Converter samples per algorithm sample. Read samples are at the
+        // algorithm's rate, get_sample_rate() / get_rate_factor().
+        void set_rate_factor(unsigned int factor);
+        unsigned int get_rate_factor();
+
+        // Input oversampling; read input samples have get_oversampling().bits
+        // bits.
+        void set_oversampling(unsigned int ratio, unsigned int shift);
+        oversampling get_oversampling();
+
+        // Data cache control (H7 only), for comparing algorithm performance.
+        void set_data_cache(bool enabled);
+        bool get_data_cache();
+
         void continuous_start();
         void continuous_stop();
 
         void measurement_start();
         uint32_t measurement_read();
+        latency_stats latency_read();
+        timing_stats timing_read();
+        profile profile_read();
+
+        // PC sampling of the loaded algorithm; starting clears past samples.
+        void sampling_start();
+        void sampling_stop();
+        pc_samples sampling_read();
+
+        // Event tracing; mask has bit n set for trace_event n. Reading
+        // removes the events read from the device.
+        void trace_start(uint8_t mask);
+        void trace_stop();
+        trace trace_read();
 
         std::vector<adcsample_t> continuous_read();
         std::vector<adcsample_t> continuous_read_input();
@@ -143,6 +338,13 @@ namespace stmdsp
         void upload_filter(unsigned char *buffer, size_t size);
         void unload_filter();
 
+        // Stores the currently uploaded filter in the given slot of the
+        // device's flash; the default slot is started at power-on.
+        void store_filter(unsigned int slot, const std::string& name, bool is_default);
+        void load_stored_filter(unsigned int slot);
+        void erase_stored_filter(unsigned int slot);
+        std::vector<stored_algorithm> list_stored_filters();
+
         std::pair<RunStatus, Error> get_status();
 
     private:
@@ -150,6 +352,9 @@ namespace stmdsp
         platform m_platform = platform::Unknown;
         unsigned int m_buffer_size = SAMPLES_MAX;
         unsigned int m_sample_rate = 0;
+        unsigned int m_channels = 1;
+        unsigned int m_rate_factor = 1;
+        oversampling m_oversampling = {0, 0, 12};
         bool m_is_siggening = false;
         bool m_is_running = false;
         bool m_disconnect_error_flag = false;
@@ -23,6 +23,11 @@
 namespace stmdsp {
 
 // $0 = temp file name
+// $1 = GUI directory; algorithms can include headers from $1/include
+//      (dsp.hpp is included by the file headers, fastmath.hpp is optional)
+// L4 algorithms are built position-independent; the device picks where they
+// are loaded and applies the image's relocations. H7 algorithms are linked
+// with linker_script_h7 so that each section lands in its chosen memory.
 // TODO try -ffunction-sections -fdata-sections -Wl,--gc-sections
 static std::string makefile_text_h7 =
 #ifdef STMDSP_WIN32
@@ -30,8 +35,8 @@ static std::string makefile_text_h7 =
 #endif
     "arm-none-eabi-g++ -x c++ -Os -std=c++20 -fno-exceptions -fno-rtti "
         "-mcpu=cortex-m7 -mthumb -mfloat-abi=hard -mfpu=fpv5-d16 -mtune=cortex-m7 "
-	"-nostartfiles "
-        "-Wl,-Ttext-segment=0x00000000 -Wl,-zmax-page-size=512 -Wl,-eprocess_data_entry "
+	"-nostartfiles -I$1/include "
+        "-T$0.ld -Wl,-zmax-page-size=512 -Wl,-eprocess_data_entry "
         "$0 -o $0.o" NEWLINE
 	COPY " $0.o $0.orig.o" NEWLINE
 	"arm-none-eabi-strip -s -S --strip-unneeded $0.o" NEWLINE
@@ -46,8 +51,9 @@ static std::string makefile_text_l4 =
 #endif
     "arm-none-eabi-g++ -x c++ -Os -std=c++20 -fno-exceptions -fno-rtti "
         "-mcpu=cortex-m4 -mthumb -mfloat-abi=hard -mfpu=fpv4-sp-d16 -mtune=cortex-m4 "
-        "-nostartfiles -I$1/cmsis "
-        "-Wl,-Ttext-segment=0x10000000 -Wl,-zmax-page-size=512 -Wl,-eprocess_data_entry "
+        "-nostartfiles -I$1/cmsis -I$1/include "
+        "-fPIE -pie -Wl,--no-dynamic-linker "
+        "-Wl,-zmax-page-size=512 -Wl,-eprocess_data_entry "
         "$0 -o $0.o" NEWLINE
     COPY " $0.o $0.orig.o" NEWLINE
     "arm-none-eabi-strip -s -S --strip-unneeded $0.o" NEWLINE
@@ -57,21 +63,269 @@ static std::string makefile_text_l4 =
                           "$0.o" NEWLINE
     "arm-none-eabi-size $0.o" NEWLINE;
 
+// Places H7 algorithm sections into tightly-coupled or AXI memory; the
+// device's loader checks each segment against these same regions.
+static std::string linker_script_h7 = R"ld(
+MEMORY
+{
+    itcm (rx) : ORIGIN = 0x00000000, LENGTH = 64K
+    dtcm (rw) : ORIGIN = 0x20008000, LENGTH = 32K
+    axi  (rw) : ORIGIN = 0x24040000, LENGTH = 64K
+}
+
+PHDRS
+{
+    code PT_LOAD FLAGS(5);
+    data PT_LOAD FLAGS(6);
+    bulk PT_LOAD FLAGS(6);
+    note PT_NOTE;
+}
+
+SECTIONS
+{
+    .text : ALIGN(8)
+    {
+        *(.hot_code .hot_code.*)
+        *(.text .text.*)
+        *(.rodata .rodata.*)
+        *(.glue_7 .glue_7t .vfp11_veneer .v4_bx)
+        *(.ARM.extab* .ARM.exidx*)
+    } > itcm :code
+
+    .note.stmdsp : ALIGN(4)
+    {
+        KEEP(*(.note.stmdsp))
+    } > itcm :code :note
+
+    .data : ALIGN(8)
+    {
+        *(.hot_data .hot_data.*)
+        *(.data .data.*)
+        *(.bss .bss.* COMMON)
+    } > dtcm :data
+
+    .bulk (NOLOAD) : ALIGN(32)
+    {
+        *(.bulk_data .bulk_data.*)
+    } > axi :bulk
+
+    /DISCARD/ : { *(.init_array* .fini_array* .preinit_array*) }
+}
+)ld";
+
+// The platform-independent part of the headers below, which follows each
+// platform's own types and math functions.
+static std::string file_header_common = R"cpp(
+// Sample formats: by default, process_data() takes and returns 12-bit
+// samples (0 to 4095, 2048 = 0V). With the device's input resolution set
+// higher, input samples have up to 16 bits (block.sampleBits), while output
+// stays 12-bit. To work on floats (-1.0 to 1.0) or signed Q15 or Q31 blocks
+// instead, which keep the extra input bits at the same scale, define
+// SAMPLE_FORMAT before process_data():
+//   #define SAMPLE_FORMAT Float
+//   SampleFloat *process_data(SamplesFloat samples) { ... }
+// The device converts each block before and after process_data(), rounding
+// and saturating the results. The converted block is kept in algorithm
+// memory after the algorithm, using SIZE * 4 bytes (SIZE * 2 for Q15).
+struct SampleFormatRaw { static constexpr uint32_t id = 0; using type = Sample; };
+struct SampleFormatQ15 { static constexpr uint32_t id = 1; using type = SampleQ15; };
+struct SampleFormatFloat { static constexpr uint32_t id = 2; using type = SampleFloat; };
+struct SampleFormatQ31 { static constexpr uint32_t id = 3; using type = SampleQ31; };
+
+// Block interface: defining ALGORITHM_ABI as 2 replaces process_data() with
+//   void process_block(const Block<SampleFloat>& block) { ... }
+// which reads block.length samples from block.in and writes them to
+// block.out. Blocks are always SIZE samples, or BLOCK_SIZE if defined:
+//   #define BLOCK_SIZE 256
+// The device splits up its buffers into blocks when they hold a whole number
+// of them; otherwise blocks are gathered across buffers, which delays the
+// output by one block. The input and output blocks are kept in algorithm
+// memory. block.sampleRate is in Hz, and is the device's rate divided by its
+// rate factor; block.block counts blocks since the start of conversion.
+// Optional flags request more context:
+//   #define BLOCK_FLAGS (BLOCK_PARAMS | BLOCK_HISTORY)
+// BLOCK_PARAMS fills block.params with the two knob readings (taken during
+// the previous block, so they cost no waiting), and
+// BLOCK_HISTORY points block.history at the previous input block (kept in
+// algorithm memory, so the same size again).
+// Alternatively, a window of past input can be kept directly in front of
+// each block, so that block.in[-1] to block.in[-BLOCK_WINDOW] are the
+// samples before it and filters need no special case at block edges:
+//   #define BLOCK_WINDOW 64
+// This uses another (BLOCK_WINDOW * 2) samples of algorithm memory.
+// With the device set to two channels, algorithms must take both with
+// BLOCK_CHANNELS. block.in and block.out then hold block.channels samples per
+// frame, interleaved (L R L R ...); BLOCK_PLANAR gives each channel's
+// block.length samples one after another instead. Blocks take twice the
+// memory, and BLOCK_HISTORY and BLOCK_WINDOW are not available.
+constexpr uint32_t BLOCK_PARAMS = 1 << 0;
+constexpr uint32_t BLOCK_HISTORY = 1 << 1;
+constexpr uint32_t BLOCK_CHANNELS = 1 << 2;
+constexpr uint32_t BLOCK_PLANAR = 1 << 3;
+struct ProfileMarker {
+    uint64_t total;
+    uint32_t count;
+    uint32_t max;
+    uint32_t start;
+    uint32_t reserved;
+};
+template<typename T>
+struct Block {
+    const T *in;
+    T *out;
+    uint32_t length;
+    uint32_t sampleRate;
+    uint32_t block;
+    uint32_t params[2];
+    const T *history;
+    uint32_t channels;
+    uint32_t sampleBits;
+    ProfileMarker *profile;
+};
+
+// Vector math: computes a block of values with one service call instead of
+// one call per value. Q31 versions take angles scaled by 1/pi and saturate
+// results to [-1, 1). Returns false if the device rejected the arguments.
+static inline bool math_n(unsigned int func, const void *in, void *out, unsigned int n) {
+    unsigned int ok;
+    asm volatile("mov r0, %1; mov r1, %2; mov r2, %3; mov r3, %4; svc 4; mov %0, r0"
+        : "=r" (ok) : "r" (func), "r" (in), "r" (out), "r" (n)
+        : "r0", "r1", "r2", "r3", "memory");
+    return ok != 0;
+}
+static inline bool sin_n(const float *in, float *out, unsigned int n) { return math_n(0, in, out, n); }
+static inline bool cos_n(const float *in, float *out, unsigned int n) { return math_n(1, in, out, n); }
+static inline bool tan_n(const float *in, float *out, unsigned int n) { return math_n(2, in, out, n); }
+static inline bool sin_n(const int32_t *in, int32_t *out, unsigned int n) { return math_n(0x100, in, out, n); }
+static inline bool cos_n(const int32_t *in, int32_t *out, unsigned int n) { return math_n(0x101, in, out, n); }
+static inline bool tan_n(const int32_t *in, int32_t *out, unsigned int n) { return math_n(0x102, in, out, n); }
+
+// atan2_n and magnitude_n take n (x, y) pairs. Q31 atan2_n and atan_n return
+// angles scaled by 1/pi.
+static inline bool atan2_n(const float *xy, float *out, unsigned int n) { return math_n(3, xy, out, n); }
+static inline bool magnitude_n(const float *xy, float *out, unsigned int n) { return math_n(4, xy, out, n); }
+static inline bool atan_n(const float *in, float *out, unsigned int n) { return math_n(5, in, out, n); }
+static inline bool sqrt_n(const float *in, float *out, unsigned int n) { return math_n(6, in, out, n); }
+static inline bool sinh_n(const float *in, float *out, unsigned int n) { return math_n(7, in, out, n); }
+static inline bool cosh_n(const float *in, float *out, unsigned int n) { return math_n(8, in, out, n); }
+static inline bool atanh_n(const float *in, float *out, unsigned int n) { return math_n(9, in, out, n); }
+static inline bool log_n(const float *in, float *out, unsigned int n) { return math_n(10, in, out, n); }
+static inline bool exp_n(const float *in, float *out, unsigned int n) { return math_n(11, in, out, n); }
+static inline bool atan2_n(const int32_t *xy, int32_t *out, unsigned int n) { return math_n(0x103, xy, out, n); }
+static inline bool magnitude_n(const int32_t *xy, int32_t *out, unsigned int n) { return math_n(0x104, xy, out, n); }
+static inline bool atan_n(const int32_t *in, int32_t *out, unsigned int n) { return math_n(0x105, in, out, n); }
+static inline bool sqrt_n(const int32_t *in, int32_t *out, unsigned int n) { return math_n(0x106, in, out, n); }
+static inline bool sinh_n(const int32_t *in, int32_t *out, unsigned int n) { return math_n(0x107, in, out, n); }
+static inline bool cosh_n(const int32_t *in, int32_t *out, unsigned int n) { return math_n(0x108, in, out, n); }
+static inline bool atanh_n(const int32_t *in, int32_t *out, unsigned int n) { return math_n(0x109, in, out, n); }
+static inline bool log_n(const int32_t *in, int32_t *out, unsigned int n) { return math_n(0x10A, in, out, n); }
+static inline bool exp_n(const int32_t *in, int32_t *out, unsigned int n) { return math_n(0x10B, in, out, n); }
+
+// Single-value versions of the above (one service call each).
+static inline float math_1(unsigned int func, float x, float y = 0) {
+    float in[2] = { x, y };
+    math_n(func, in, in, 1);
+    return in[0];
+}
+static inline float atan2(float y, float x) { return math_1(3, x, y); }
+static inline float magnitude(float x, float y) { return math_1(4, x, y); }
+static inline float atan(float x) { return math_1(5, x); }
+static inline float sinh(float x) { return math_1(7, x); }
+static inline float cosh(float x) { return math_1(8, x); }
+static inline float atanh(float x) { return math_1(9, x); }
+static inline float log(float x) { return math_1(10, x); }
+static inline float exp(float x) { return math_1(11, x); }
+
+// Filter acceleration (the FMAC on the H7, software on the L4). Configure a
+// Q15 FIR or IIR filter once, then filter blocks: filter_start() begins a
+// block and filter_wait() waits for it to finish.
+// IIR coefficients are b0..b[nb-1] followed by a1..a[na], for
+//   y[n] = 2^gain * (sum(b[k] * x[n - k]) - sum(a[k] * y[n - k])).
+// On the H7, buffers in BULK_DATA are moved by DMA, leaving the CPU free
+// until filter_wait(), if the output buffer has its own cache lines
+// (alignas(32), size a multiple of 32); other buffers are fed to the FMAC by
+// the CPU.
+// The filter keeps its state between blocks. Limits: FIR 127 taps; IIR 64
+// feed-forward and 63 feedback coefficients, 127 total; gain 0-7.
+static inline bool filter_call(unsigned int op, unsigned int a, unsigned int b, unsigned int c) {
+    unsigned int ok;
+    asm volatile("mov r0, %1; mov r1, %2; mov r2, %3; mov r3, %4; svc 5; mov %0, r0"
+        : "=r" (ok) : "r" (op), "r" (a), "r" (b), "r" (c)
+        : "r0", "r1", "r2", "r3", "memory");
+    return ok != 0;
+}
+static inline bool filter_fir(const int16_t *b, unsigned int nb, unsigned int gain = 0) {
+    return filter_call(0, reinterpret_cast<unsigned int>(b), nb, gain);
+}
+static inline bool filter_iir(const int16_t *ba, unsigned int nb, unsigned int na, unsigned int gain = 0) {
+    return filter_call(0, reinterpret_cast<unsigned int>(ba), nb | (na << 8) | (1 << 16), gain);
+}
+static inline bool filter_start(const int16_t *in, int16_t *out, unsigned int n) {
+    return filter_call(1, reinterpret_cast<unsigned int>(in), reinterpret_cast<unsigned int>(out), n);
+}
+static inline bool filter_wait() { return filter_call(2, 0, 0, 0); }
+
+// Profiling: PROFILE_BEGIN(id) and PROFILE_END(id) time a section of the
+// algorithm from a free-running device counter, with no service call, so
+// they are cheap enough to put around each part of process_block(). Sections
+// are numbered from zero, and ALGORITHM_ABI 2 algorithms set how many there
+// are (up to 8):
+//   #define PROFILE_MARKERS 3
+// Each section's total, count and longest pass are kept in algorithm memory
+// (24 bytes each) and shown by the device's "Profile sections" window.
+static ProfileMarker *stmdsp_profile = nullptr;
+static inline uint32_t profile_counter() {
+    return *reinterpret_cast<volatile uint32_t *>(0x40000C24);
+}
+static inline void profile_begin(unsigned int id) {
+    stmdsp_profile[id].start = profile_counter();
+}
+static inline void profile_end(unsigned int id) {
+    auto& m = stmdsp_profile[id];
+    const uint32_t t = profile_counter() - m.start;
+    m.total += t;
+    if (t > m.max)
+        m.max = t;
+    // The device may read the marker at any time; count is updated last.
+    asm volatile("" ::: "memory");
+    m.count++;
+}
+#define PROFILE_BEGIN(id) do { \
+    static_assert((id) < PROFILE_MARKERS, "Profile section out of range"); \
+    profile_begin(id); } while (0)
+#define PROFILE_END(id) do { \
+    static_assert((id) < PROFILE_MARKERS, "Profile section out of range"); \
+    profile_end(id); } while (0)
+
+// End stmdspgui header code
+)cpp";
+
 // $0 = buffer size
 static std::string file_header_h7 = R"cpp(
 #include <cstdint>
 #include <span>
+#include <dsp.hpp>
+
+// Memory placement (see also the "Measure Code Time" device option):
+//  HOT_CODE:  ITCM, zero wait-state instruction fetch (default for code).
+//  HOT_DATA:  DTCM, zero wait-state data access (default for data).
+//  BULK_DATA: 64K of AXI SRAM for large buffers; always zero-initialized.
+#define HOT_CODE  __attribute__((section(".hot_code")))
+#define HOT_DATA  __attribute__((section(".hot_data")))
+#define BULK_DATA __attribute__((section(".bulk_data")))
 
 using Sample = uint16_t;
 using Samples = std::span<Sample, $0>;
+using SampleQ15 = int16_t;
+using SamplesQ15 = std::span<SampleQ15, $0>;
+using SampleFloat = float;
+using SamplesFloat = std::span<SampleFloat, $0>;
+using SampleQ31 = int32_t;
+using SamplesQ31 = std::span<SampleQ31, $0>;
+constexpr unsigned int SIZE = $0;
 
-Sample *process_data(Samples samples);
-extern "C" void process_data_entry()
-{
-    Sample *samples;
-    asm("mov %0, r0" : "=r" (samples));
-    process_data(Samples(samples, $0));
-}
+template<typename T>
+auto sample_block(T *samples) { return std::span<T, $0>(samples, $0); }
 
 static double PI = 3.14159265358979323846L;
 __attribute__((naked))
@@ -112,24 +366,23 @@ Sample s;
 asm("svc 3; mov %0, r0" : "=&r"(s));
 return s;
 }
-
-// End stmdspgui header code
-
-)cpp";
+)cpp" + file_header_common;
 static std::string file_header_l4 = R"cpp(
 #include <cstdint>
+#include <dsp.hpp>
 
 using Sample = uint16_t;
 using Samples = Sample[$0];
+using SampleQ15 = int16_t;
+using SamplesQ15 = SampleQ15[$0];
+using SampleFloat = float;
+using SamplesFloat = SampleFloat[$0];
+using SampleQ31 = int32_t;
+using SamplesQ31 = SampleQ31[$0];
 constexpr unsigned int SIZE = $0;
 
-Sample *process_data(Samples samples);
-extern "C" void process_data_entry()
-{
-    Sample *samples;
-    asm("mov %0, r0" : "=r" (samples));
-    process_data(samples);
-}
+template<typename T>
+T *sample_block(T *samples) { return samples; }
 
 static inline float PI = 3.14159265358979L;
 __attribute__((naked))
@@ -175,14 +428,103 @@ static inline auto param2() {
     asm("mov r0, #1; svc 3; mov %0, r0" : "=r" (s) :: "r0");
     return s;
 }
+)cpp" + file_header_common;
 
-//static inline void puts(const char *s) {
-//    // 's' will already be in r0.
-//    asm("push {r4-r6}; svc 4; pop {r4-r6}");
-//}
+// Appended to the algorithm: declares the entry point, which calls
+// process_data() or process_block() with the sample format chosen by
+// SAMPLE_FORMAT, and the ELF notes through which the device learns that
+// format and the interface in use.
+static std::string file_footer = R"cpp(
 
-// End stmdspgui header code
+// Begin stmdspgui footer code
+
+#ifndef SAMPLE_FORMAT
+#define SAMPLE_FORMAT Raw
+#endif
+#ifndef ALGORITHM_ABI
+#define ALGORITHM_ABI 1
+#endif
+#ifndef BLOCK_FLAGS
+#define BLOCK_FLAGS 0
+#endif
+#ifndef BLOCK_WINDOW
+#define BLOCK_WINDOW 0
+#endif
+#ifndef BLOCK_SIZE
+#define BLOCK_SIZE SIZE
+#endif
+#ifndef PROFILE_MARKERS
+#define PROFILE_MARKERS 0
+#endif
+static_assert(ALGORITHM_ABI == 2 || BLOCK_SIZE == SIZE,
+              "BLOCK_SIZE requires ALGORITHM_ABI 2");
+static_assert(ALGORITHM_ABI == 2 || !(BLOCK_FLAGS & BLOCK_CHANNELS),
+              "BLOCK_CHANNELS requires ALGORITHM_ABI 2");
+static_assert(ALGORITHM_ABI == 2 || PROFILE_MARKERS == 0,
+              "PROFILE_MARKERS requires ALGORITHM_ABI 2");
+static_assert(PROFILE_MARKERS <= 8, "At most 8 PROFILE_MARKERS");
+#define STMDSP_FORMAT_(f) SampleFormat##f
+#define STMDSP_FORMAT(f) STMDSP_FORMAT_(f)
+using ProcessFormat = STMDSP_FORMAT(SAMPLE_FORMAT);
+
+// Note "stmdsp", type 1: sample format and block size.
+__attribute__((section(".note.stmdsp"), used, aligned(4)))
+static constexpr struct {
+    uint32_t namesz = 7;
+    uint32_t descsz = 8;
+    uint32_t type = 1;
+    char name[8] = "stmdsp";
+    uint32_t desc[2] = { ProcessFormat::id, BLOCK_SIZE };
+} stmdsp_format_note {};
+
+// Note "stmdsp", type 2: interface version and flags.
+__attribute__((section(".note.stmdsp"), used, aligned(4)))
+static constexpr struct {
+    uint32_t namesz = 7;
+    uint32_t descsz = 8;
+    uint32_t type = 2;
+    char name[8] = "stmdsp";
+    uint32_t desc[2] = { ALGORITHM_ABI, BLOCK_FLAGS };
+} stmdsp_abi_note {};
 
+// Note "stmdsp", type 3: samples of history to keep before each block.
+__attribute__((section(".note.stmdsp"), used, aligned(4)))
+static constexpr struct {
+    uint32_t namesz = 7;
+    uint32_t descsz = 4;
+    uint32_t type = 3;
+    char name[8] = "stmdsp";
+    uint32_t desc[1] = { BLOCK_WINDOW };
+} stmdsp_window_note {};
+
+// Note "stmdsp", type 4: profile markers to keep.
+__attribute__((section(".note.stmdsp"), used, aligned(4)))
+static constexpr struct {
+    uint32_t namesz = 7;
+    uint32_t descsz = 4;
+    uint32_t type = 4;
+    char name[8] = "stmdsp";
+    uint32_t desc[1] = { PROFILE_MARKERS };
+} stmdsp_profile_note {};
+
+#if ALGORITHM_ABI == 2
+extern "C" void process_data_entry()
+{
+    Block<ProcessFormat::type> *block;
+    asm("mov %0, r0" : "=r" (block));
+#if PROFILE_MARKERS > 0
+    stmdsp_profile = block->profile;
+#endif
+    process_block(*block);
+}
+#else
+extern "C" void process_data_entry()
+{
+    ProcessFormat::type *samples;
+    asm("mov %0, r0" : "=r" (samples));
+    process_data(sample_block(samples));
+}
+#endif
 )cpp";
 
 
@@ -0,0 +1,202 @@
+/**
+ * @file fastmath_test.cpp
+ * @brief Host-side accuracy and throughput checks for fastmath.hpp.
+ *
+ * Copyright (C) 2023 Clyne Sullivan
+ *
+ * Distributed under the GNU GPL v3 or later. You should have received a copy of
+ * the GNU General Public License along with this program.
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fastmath.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+// Sweeps each function and accuracy tier against the double-precision std::
+// functions, over the domains given in fastmath.hpp, and fails if any error
+// exceeds the bound documented there. Bounds are documented to two
+// significant figures, so measurements may exceed them by this much.
+constexpr double BOUND_MARGIN = 1.05;
+
+static int failures = 0;
+
+static void check(const char *name, const char *tier, double error, double bound)
+{
+    const bool ok = error <= bound * BOUND_MARGIN;
+    std::printf("%-6s %-8s max error %.2e (documented %.1e)%s\n",
+                name, tier, error, bound, ok ? "" : "  FAIL");
+    if (!ok)
+        ++failures;
+}
+
+// Evenly spaced points in [lo, hi].
+static std::vector<float> linear(double lo, double hi, unsigned int count)
+{
+    std::vector<float> v (count);
+    for (unsigned int i = 0; i < count; ++i)
+        v[i] = static_cast<float>(lo + (hi - lo) * i / (count - 1));
+    return v;
+}
+
+// Logarithmically spaced points in [lo, hi] (both positive).
+static std::vector<float> logarithmic(double lo, double hi, unsigned int count)
+{
+    std::vector<float> v (count);
+    for (unsigned int i = 0; i < count; ++i)
+        v[i] = static_cast<float>(lo * std::pow(hi / lo, double(i) / (count - 1)));
+    return v;
+}
+
+static double absError(float (*f)(float), double (*ref)(double), const std::vector<float>& xs)
+{
+    double max = 0;
+    for (auto x : xs)
+        max = std::max(max, std::abs(f(x) - ref(x)));
+    return max;
+}
+
+static double relError(float (*f)(float), double (*ref)(double), const std::vector<float>& xs)
+{
+    double max = 0;
+    for (auto x : xs) {
+        const double r = ref(x);
+        max = std::max(max, std::abs((f(x) - r) / r));
+    }
+    return max;
+}
+
+// (x, y) grid over [-10, 10] squared, plus the unit circle for small angles.
+static double atan2Error(float (*f)(float, float))
+{
+    double max = 0;
+    const auto axis = linear(-10, 10, 801);
+    for (auto y : axis) {
+        for (auto x : axis) {
+            if (x != 0.f || y != 0.f)
+                max = std::max(max, std::abs(f(y, x) - std::atan2(double(y), double(x))));
+        }
+    }
+    for (auto a : linear(-M_PI, M_PI, 200001)) {
+        const float x = static_cast<float>(std::cos(a));
+        const float y = static_cast<float>(std::sin(a));
+        max = std::max(max, std::abs(f(y, x) - std::atan2(double(y), double(x))));
+    }
+    return max;
+}
+
+// Relative error over x in [1e-2, 1e2] and y in [-5, 5], where |y * ln(x)|
+// is below 10.
+static double powError(float (*f)(float, float))
+{
+    double max = 0;
+    const auto ys = linear(-5, 5, 401);
+    for (auto x : logarithmic(1e-2, 1e2, 1001)) {
+        for (auto y : ys) {
+            if (std::abs(y * std::log(double(x))) >= 10)
+                continue;
+            const double r = std::pow(double(x), double(y));
+            max = std::max(max, std::abs((f(x, y) - r) / r));
+        }
+    }
+    return max;
+}
+
+static double dsin(double x) { return std::sin(x); }
+static double dcos(double x) { return std::cos(x); }
+static double dexp(double x) { return std::exp(x); }
+static double dlog(double x) { return std::log(x); }
+static double dtanh(double x) { return std::tanh(x); }
+
+template<fastmath::Accuracy A>
+static void checkTier(const char *tier, const double (&bounds)[7])
+{
+    const auto trig = linear(-100, 100, 2000001);
+    check("sin", tier, absError(fastmath::sin<A>, dsin, trig), bounds[0]);
+    check("cos", tier, absError(fastmath::cos<A>, dcos, trig), bounds[1]);
+    check("exp", tier, relError(fastmath::exp<A>, dexp, linear(-87, 88, 2000001)), bounds[2]);
+    check("log", tier, absError(fastmath::log<A>, dlog, logarithmic(1e-3, 1e3, 2000001)), bounds[3]);
+    check("tanh", tier, absError(fastmath::tanh<A>, dtanh, linear(-20, 20, 2000001)), bounds[4]);
+    check("atan2", tier, atan2Error(fastmath::atan2<A>), bounds[5]);
+    check("pow", tier, powError(fastmath::pow<A>), bounds[6]);
+}
+
+// Reports the time per call of f over the inputs xs, in nanoseconds.
+template<typename F>
+static double timePerCall(F f, const std::vector<float>& xs)
+{
+    constexpr unsigned int ROUNDS = 20;
+    volatile float sink = 0;
+
+    const auto start = std::chrono::steady_clock::now();
+    for (unsigned int r = 0; r < ROUNDS; ++r) {
+        float sum = 0;
+        for (auto x : xs)
+            sum += f(x);
+        sink = sink + sum;
+    }
+    const std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count() / (ROUNDS * xs.size());
+}
+
+static void reportThroughput()
+{
+    using namespace fastmath;
+    const auto trig = linear(-100, 100, 100000);
+    const auto pos = logarithmic(1e-3, 1e3, 100000);
+    const auto any = linear(-10, 10, 100000);
+
+    struct Row {
+        const char *name;
+        const std::vector<float>& xs;
+        std::function<float(float)> funcs[4];
+    };
+    const Row rows[] = {
+        { "sin", trig, { sin<Fast>, sin<Medium>, sin<Precise>,
+                         [](float x) { return std::sin(x); } } },
+        { "cos", trig, { cos<Fast>, cos<Medium>, cos<Precise>,
+                         [](float x) { return std::cos(x); } } },
+        { "exp", any, { exp<Fast>, exp<Medium>, exp<Precise>,
+                        [](float x) { return std::exp(x); } } },
+        { "log", pos, { log<Fast>, log<Medium>, log<Precise>,
+                        [](float x) { return std::log(x); } } },
+        { "tanh", any, { tanh<Fast>, tanh<Medium>, tanh<Precise>,
+                         [](float x) { return std::tanh(x); } } },
+        { "atan2", any, { [](float x) { return atan2<Fast>(x, 1.5f); },
+                          [](float x) { return atan2<Medium>(x, 1.5f); },
+                          [](float x) { return atan2<Precise>(x, 1.5f); },
+                          [](float x) { return std::atan2(x, 1.5f); } } },
+        { "pow", pos, { [](float x) { return pow<Fast>(x, 1.7f); },
+                        [](float x) { return pow<Medium>(x, 1.7f); },
+                        [](float x) { return pow<Precise>(x, 1.7f); },
+                        [](float x) { return std::pow(x, 1.7f); } } },
+    };
+
+    // std::function adds the same call overhead to every column.
+    std::printf("\nns per call   Fast  Medium Precise    libm\n");
+    for (const auto& row : rows) {
+        std::printf("%-10s", row.name);
+        for (const auto& f : row.funcs)
+            std::printf(" %7.2f", timePerCall(f, row.xs));
+        std::printf("\n");
+    }
+}
+
+int main()
+{
+    // Documented maximum errors: sin, cos, exp, log, tanh, atan2, pow.
+    checkTier<fastmath::Fast>("Fast", {7.6e-5, 7.6e-5, 7.5e-5, 4.2e-6, 3.7e-5, 8.2e-5, 9.5e-5});
+    checkTier<fastmath::Medium>("Medium", {1.1e-6, 1.1e-6, 2.7e-6, 3.5e-7, 1.3e-6, 1.9e-6, 3.8e-6});
+    checkTier<fastmath::Precise>("Precise", {1.6e-7, 1.6e-7, 2.2e-7, 3.1e-7, 1.2e-7, 2.9e-7, 1.3e-6});
+
+    reportThroughput();
+
+    if (failures > 0)
+        std::printf("\n%d checks failed\n", failures);
+    return failures > 0 ? 1 : 0;
+}